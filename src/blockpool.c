@@ -0,0 +1,192 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "blockpool.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int init_queue(jackoff_block_queue_t* queue, size_t count);
+static int queue_push(jackoff_block_queue_t* queue, jackoff_block_t* block);
+static jackoff_block_t* queue_pop(jackoff_block_queue_t* queue);
+
+jackoff_block_pool_t* jackoff_create_block_pool(size_t channels,
+	size_t capacity, size_t count)
+{
+	jackoff_block_pool_t* pool;
+	size_t channel_size;
+	char* memory;
+	size_t i, c;
+	
+	pool = calloc(1, sizeof(jackoff_block_pool_t));
+	if (!pool) {
+		jackoff_warn("Failed to allocate memory for the block pool.");
+		return NULL;
+	}
+	
+	// Round each channel up to a whole number of cache lines.
+	channel_size = capacity * sizeof(jack_default_audio_sample_t);
+	channel_size = (channel_size + JACKOFF_CACHE_LINE_SIZE - 1) &
+		~((size_t) JACKOFF_CACHE_LINE_SIZE - 1);
+	
+	pool->channels = channels;
+	pool->capacity = capacity;
+	pool->count = count;
+	pool->memory_size = channel_size * channels * count;
+	
+	pool->blocks = calloc(count, sizeof(jackoff_block_t));
+	if (!pool->blocks || posix_memalign(&pool->memory,
+		JACKOFF_CACHE_LINE_SIZE, pool->memory_size) != 0)
+	{
+		pool->memory = NULL;
+		jackoff_warn("Failed to allocate %lu audio blocks.", count);
+		jackoff_destroy_block_pool(pool);
+		return NULL;
+	}
+	memset(pool->memory, 0, pool->memory_size);
+	
+	if (!init_queue(&pool->empty, count) || !init_queue(&pool->filled, count)) {
+		jackoff_warn("Failed to allocate the block queues.");
+		jackoff_destroy_block_pool(pool);
+		return NULL;
+	}
+	
+	memory = pool->memory;
+	for (i = 0; i < count; i++) {
+		pool->blocks[i].channels = calloc(channels,
+			sizeof(jack_default_audio_sample_t*));
+		if (!pool->blocks[i].channels) {
+			jackoff_destroy_block_pool(pool);
+			return NULL;
+		}
+		
+		for (c = 0; c < channels; c++) {
+			pool->blocks[i].channels[c] =
+				(jack_default_audio_sample_t*) memory;
+			memory += channel_size;
+		}
+		
+		queue_push(&pool->empty, &pool->blocks[i]);
+	}
+	
+	jackoff_debug("Block pool: %lu blocks of %lu frames.", count, capacity);
+	return pool;
+}
+
+void jackoff_destroy_block_pool(jackoff_block_pool_t* pool) {
+	size_t i;
+	
+	if (pool->blocks) {
+		for (i = 0; i < pool->count; i++) {
+			if (pool->blocks[i].channels)
+				free(pool->blocks[i].channels);
+		}
+		free(pool->blocks);
+	}
+	
+	if (pool->memory)
+		free(pool->memory);
+	if (pool->empty.slots)
+		free(pool->empty.slots);
+	if (pool->filled.slots)
+		free(pool->filled.slots);
+	free(pool);
+}
+
+/*
+ * Takes an empty block to fill. Called only by the producer (the process
+ * callback); returns NULL if the writer is holding every block.
+ */
+jackoff_block_t* jackoff_block_acquire(jackoff_block_pool_t* pool) {
+	return queue_pop(&pool->empty);
+}
+
+/*
+ * Whether jackoff_block_acquire would find an empty block. Called only by
+ * the producer.
+ */
+int jackoff_block_available(jackoff_block_pool_t* pool) {
+	return pool->empty.head !=
+		__atomic_load_n(&pool->empty.tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Hands a filled block to the consumer.
+ */
+void jackoff_block_publish(jackoff_block_pool_t* pool, jackoff_block_t* block)
+{
+	queue_push(&pool->filled, block);
+}
+
+/*
+ * Takes the oldest filled block, or NULL if there is none. Called only by the
+ * consumer (the writer).
+ */
+jackoff_block_t* jackoff_block_next(jackoff_block_pool_t* pool) {
+	return queue_pop(&pool->filled);
+}
+
+/*
+ * Returns a block to the pool once the consumer is done with it.
+ */
+void jackoff_block_release(jackoff_block_pool_t* pool, jackoff_block_t* block)
+{
+	queue_push(&pool->empty, block);
+}
+
+static int init_queue(jackoff_block_queue_t* queue, size_t count) {
+	size_t size;
+	
+	// One slot per block is always enough, since there are only `count`
+	// blocks in circulation.
+	for (size = 1; size < count; size <<= 1)
+		;
+	
+	queue->slots = calloc(size, sizeof(jackoff_block_t*));
+	queue->mask = size - 1;
+	queue->head = 0;
+	queue->tail = 0;
+	return queue->slots != NULL;
+}
+
+static int queue_push(jackoff_block_queue_t* queue, jackoff_block_t* block) {
+	size_t tail = queue->tail;
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	
+	if (tail - head > queue->mask)
+		return 0;
+	
+	queue->slots[tail & queue->mask] = block;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static jackoff_block_t* queue_pop(jackoff_block_queue_t* queue) {
+	size_t head = queue->head;
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	jackoff_block_t* block;
+	
+	if (head == tail)
+		return NULL;
+	
+	block = queue->slots[head & queue->mask];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return block;
+}
@@ -0,0 +1,80 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_BLOCKPOOL_H_
+#define _JACKOFF_BLOCKPOOL_H_
+
+#include <jack/jack.h>
+#include <stdlib.h>
+
+#define JACKOFF_CACHE_LINE_SIZE 64
+
+/*
+ * One period of captured audio. Each channel's samples start on their own
+ * cache line.
+ */
+typedef struct jackoff_block {
+	jack_nframes_t frame_count;
+	jack_nframes_t frame_time; // JACK frame time of the first frame
+	jack_time_t usecs; // JACK clock time of the first frame
+	jack_default_audio_sample_t** channels;
+} jackoff_block_t;
+
+/*
+ * A lock-free single-producer, single-consumer queue of block pointers. The
+ * head and tail live on separate cache lines so that the two sides don't
+ * contend.
+ */
+typedef struct {
+	jackoff_block_t** slots;
+	size_t mask;
+	char pad0[JACKOFF_CACHE_LINE_SIZE];
+	size_t head;
+	char pad1[JACKOFF_CACHE_LINE_SIZE - sizeof(size_t)];
+	size_t tail;
+	char pad2[JACKOFF_CACHE_LINE_SIZE - sizeof(size_t)];
+} jackoff_block_queue_t;
+
+/*
+ * A fixed set of preallocated blocks circulating between two queues: empty
+ * blocks flow from the writer to the process callback, which fills them and
+ * publishes them back to the writer.
+ */
+typedef struct {
+	size_t channels;
+	size_t capacity;
+	size_t count;
+	jackoff_block_t* blocks;
+	void* memory;
+	size_t memory_size;
+	jackoff_block_queue_t empty;
+	jackoff_block_queue_t filled;
+} jackoff_block_pool_t;
+
+jackoff_block_pool_t* jackoff_create_block_pool(size_t channels,
+	size_t capacity, size_t count);
+void jackoff_destroy_block_pool(jackoff_block_pool_t* pool);
+
+jackoff_block_t* jackoff_block_acquire(jackoff_block_pool_t* pool);
+int jackoff_block_available(jackoff_block_pool_t* pool);
+void jackoff_block_publish(jackoff_block_pool_t* pool, jackoff_block_t* block);
+jackoff_block_t* jackoff_block_next(jackoff_block_pool_t* pool);
+void jackoff_block_release(jackoff_block_pool_t* pool, jackoff_block_t* block);
+
+#endif
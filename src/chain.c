@@ -0,0 +1,247 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "chain.h"
+#include "resample.h"
+#include "mixer.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Drain 256 frames from the ring buffers at a time
+static const size_t read_size = 256;
+
+struct jackoff_chain {
+	jackoff_client_t* client;
+	size_t channels;
+	jack_nframes_t sample_rate;
+	
+	// Points into the client's transport; the audio there is handed back
+	// only on the following pull, once the encoder is done with it.
+	jack_default_audio_sample_t** input;
+	size_t pending;
+	
+	const jackoff_matrix_t* matrix;
+	jack_default_audio_sample_t** mixed;
+	
+	jackoff_resampler_t* resampler;
+	jack_default_audio_sample_t** resampled;
+};
+
+static jack_default_audio_sample_t** allocate_buffers(size_t channels,
+	size_t frames);
+static void free_buffers(jack_default_audio_sample_t** buffers,
+	size_t channels);
+
+jackoff_chain_t* jackoff_create_chain(jackoff_client_t* client,
+	const jackoff_settings_t* settings)
+{
+	jackoff_chain_t* chain;
+	jack_nframes_t capture_rate = client->sample_rate;
+	
+	chain = calloc(1, sizeof(jackoff_chain_t));
+	if (!chain) {
+		jackoff_warn("Failed to allocate memory for the signal chain.");
+		return NULL;
+	}
+	
+	chain->client = client;
+	chain->channels = client->channel_count;
+	chain->sample_rate = capture_rate;
+	
+	chain->input = calloc(client->channel_count,
+		sizeof(jack_default_audio_sample_t*));
+	if (!chain->input) {
+		jackoff_destroy_chain(chain);
+		return NULL;
+	}
+	
+	if (settings->matrix) {
+		if (settings->matrix->inputs != client->channel_count) {
+			jackoff_warn("The channel matrix expects %lu channels, but %lu "
+				"are being recorded.", settings->matrix->inputs,
+				client->channel_count);
+			jackoff_destroy_chain(chain);
+			return NULL;
+		}
+		
+		chain->matrix = settings->matrix;
+		chain->channels = settings->matrix->outputs;
+		chain->mixed = allocate_buffers(chain->channels, read_size);
+		if (!chain->mixed) {
+			jackoff_destroy_chain(chain);
+			return NULL;
+		}
+	}
+	
+	if (settings->sample_rate && settings->sample_rate != capture_rate) {
+		chain->resampler = jackoff_create_resampler(chain->channels,
+			capture_rate, settings->sample_rate, read_size);
+		if (!chain->resampler) {
+			jackoff_destroy_chain(chain);
+			return NULL;
+		}
+		
+		chain->resampled = allocate_buffers(chain->channels,
+			jackoff_resampler_capacity(chain->resampler));
+		if (!chain->resampled) {
+			jackoff_destroy_chain(chain);
+			return NULL;
+		}
+		chain->sample_rate = settings->sample_rate;
+	}
+	
+	return chain;
+}
+
+void jackoff_destroy_chain(jackoff_chain_t* chain) {
+	if (chain->pending)
+		jackoff_client_consume(chain->client, chain->pending);
+	if (chain->input)
+		free(chain->input);
+	if (chain->mixed)
+		free_buffers(chain->mixed, chain->channels);
+	if (chain->resampled)
+		free_buffers(chain->resampled, chain->channels);
+	if (chain->resampler)
+		jackoff_destroy_resampler(chain->resampler);
+	free(chain);
+}
+
+size_t jackoff_chain_channels(const jackoff_chain_t* chain) {
+	return chain->channels;
+}
+
+/*
+ * The most frames that a single pull can hand back.
+ */
+size_t jackoff_chain_capacity(const jackoff_chain_t* chain) {
+	if (chain->resampler)
+		return jackoff_resampler_capacity(chain->resampler);
+	return read_size;
+}
+
+jack_nframes_t jackoff_chain_sample_rate(const jackoff_chain_t* chain) {
+	return chain->sample_rate;
+}
+
+/*
+ * Drains one block from the ring buffers and runs it through the chain. On
+ * return, *output points at planar buffers holding *frames frames of
+ * processed audio (which may be zero while a filter fills up). Returns the
+ * number of frames of progress made, or 0 if there is nothing to do yet.
+ */
+long jackoff_chain_pull(jackoff_chain_t* chain,
+	jack_default_audio_sample_t*** output, size_t* frames)
+{
+	jackoff_client_t* client = chain->client;
+	jack_default_audio_sample_t** stage = chain->input;
+	int finished;
+	size_t count;
+	
+	*frames = 0;
+	
+	if (chain->pending) {
+		jackoff_client_consume(client, chain->pending);
+		chain->pending = 0;
+	}
+	
+	finished = client->capture_finished || client->rate_changed;
+	count = jackoff_client_frames_available(client);
+	
+	// Wait until a whole block is available. Once the capture has finished,
+	// or reached a change of sample rate, take whatever is left so that the
+	// output ends on exactly the right frame, then flush any filters.
+	if (count < read_size) {
+		if (!finished)
+			return 0;
+		if (count == 0) {
+			if (chain->resampler) {
+				*output = chain->resampled;
+				*frames = jackoff_resampler_flush(chain->resampler,
+					chain->resampled);
+			}
+			return (long) *frames;
+		}
+	} else {
+		count = read_size;
+	}
+	
+	// Work on the audio where it sits in the transport. This may come up
+	// short of a full block where a ring wraps around or a block ends.
+	count = jackoff_client_peek(client, count, chain->input);
+	if (count == 0)
+		return 0;
+	chain->pending = count;
+	
+	// Mix down before resampling so the filter runs on as few channels as
+	// possible.
+	if (chain->matrix) {
+		jackoff_mix(chain->matrix, (const float**) stage, count, chain->mixed);
+		stage = chain->mixed;
+	}
+	
+	if (chain->resampler) {
+		*output = chain->resampled;
+		*frames = jackoff_resample(chain->resampler, (const float**) stage,
+			count, chain->resampled);
+	} else {
+		*output = stage;
+		*frames = count;
+	}
+	
+	return (long) count;
+}
+
+static jack_default_audio_sample_t** allocate_buffers(size_t channels,
+	size_t frames)
+{
+	jack_default_audio_sample_t** buffers;
+	size_t c;
+	
+	buffers = calloc(channels, sizeof(jack_default_audio_sample_t*));
+	if (!buffers) {
+		jackoff_warn("Failed to allocate channel buffers.");
+		return NULL;
+	}
+	
+	for (c = 0; c < channels; c++) {
+		buffers[c] = calloc(frames, sizeof(jack_default_audio_sample_t));
+		if (!buffers[c]) {
+			jackoff_warn("Failed to allocate channel buffer %lu.", c);
+			free_buffers(buffers, channels);
+			return NULL;
+		}
+	}
+	
+	return buffers;
+}
+
+static void free_buffers(jack_default_audio_sample_t** buffers,
+	size_t channels)
+{
+	size_t c;
+	
+	for (c = 0; c < channels; c++) {
+		if (buffers[c])
+			free(buffers[c]);
+	}
+	free(buffers);
+}
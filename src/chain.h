@@ -0,0 +1,41 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_CHAIN_H_
+#define _JACKOFF_CHAIN_H_
+
+#include "jackoff.h"
+
+typedef struct jackoff_chain jackoff_chain_t;
+
+/*
+ * The signal chain sits between the client's ring buffers and an encoder.
+ * It drains captured audio in blocks and runs it through any processing the
+ * settings ask for, handing the encoder planar buffers that it owns.
+ */
+jackoff_chain_t* jackoff_create_chain(jackoff_client_t* client,
+	const jackoff_settings_t* settings);
+void jackoff_destroy_chain(jackoff_chain_t* chain);
+size_t jackoff_chain_channels(const jackoff_chain_t* chain);
+size_t jackoff_chain_capacity(const jackoff_chain_t* chain);
+jack_nframes_t jackoff_chain_sample_rate(const jackoff_chain_t* chain);
+long jackoff_chain_pull(jackoff_chain_t* chain,
+	jack_default_audio_sample_t*** output, size_t* frames);
+
+#endif
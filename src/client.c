@@ -19,56 +19,199 @@
 
 #include "client.h"
 #include "logging.h"
+#include "metrics.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+// Huge pages are 2 MiB on the platforms we care about.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The spill thread moves at most this many frames per turn, and the writer
+// copies at most STAGING_FRAMES, so neither holds the spill lock for long.
+#define SPILL_CHUNK_FRAMES 4096
+#define STAGING_FRAMES 1024
+
+// A freewheeling callback waiting for the writer wakes at least this often
+// to see whether it should give up.
+#define FREEWHEEL_WAIT_NSEC 50000000
+
+// Room for this many unread frame time stamps. The callback only queues one
+// after a dropout, and the writer reads them every time it writes.
+#define FRAME_STAMPS 1024
 
 static int audio_available_callback(jack_nframes_t frame_count, void* arg);
 static void jackd_shutdown_callback(void* arg);
+static void freewheel_callback(int starting, void* arg);
+static int buffer_size_callback(jack_nframes_t frames, void* arg);
+static int sample_rate_callback(jack_nframes_t rate, void* arg);
 static void client_open_failed(jack_status_t status);
-static void get_input_port_name(size_t total, size_t index, char* buffer,
-	size_t buffer_length);
+static void get_input_port_name(const char* prefix, size_t total,
+	size_t index, char* buffer, size_t buffer_length);
+static void destroy_client(jackoff_client_t* client);
+static int capture_cycle(jackoff_client_t* client, jack_nframes_t frame_count);
+static jack_nframes_t cycle_offset(jackoff_client_t* client, jack_time_t when,
+	jack_nframes_t cycle_start, jack_nframes_t frame_count);
+static jack_ringbuffer_t* create_ring_buffer(size_t size, int flags,
+	size_t* mapping);
+static void free_ring_buffer(jack_ringbuffer_t* buffer, size_t mapping);
+static int write_ring_buffers(jackoff_client_t* client,
+	jack_nframes_t frame_count, jack_nframes_t first, jack_nframes_t end);
+static int write_block(jackoff_client_t* client, jack_nframes_t frame_count,
+	jack_nframes_t first, jack_nframes_t end, jack_nframes_t cycle_start);
+static void publish_block(jackoff_client_t* client);
+static size_t frames_held(jackoff_client_t* client);
+static void stamp_frame_time(jackoff_client_t* client, uint64_t frame_time);
+static void note_rate_change(jackoff_client_t* client, jack_nframes_t rate);
+static size_t ring_frames_available(jackoff_client_t* client);
+static void fill_staging(jackoff_client_t* client, size_t max_frames);
+static int wait_for_writer(jackoff_client_t* client, size_t frames);
+static void signal_progress(jackoff_host_t* host, pthread_cond_t* condition);
+static void timeout_to_deadline(long nanoseconds, struct timespec* deadline);
 
-jackoff_client_t* jackoff_create_client(const char* client_name,
-	jack_options_t jack_options, size_t channels, float buffer_duration)
+jackoff_host_t* jackoff_create_host(const char* client_name,
+	jack_options_t jack_options)
 {
-	jackoff_client_t* client;
-	jack_client_t* jack_client;
+	jackoff_host_t* host;
 	jack_status_t status;
-	char input_port_name[64];
-	size_t i;
-	jack_port_t* port;
-	jack_ringbuffer_t* buffer;
-	size_t buffer_size;
 	
-	client = calloc(1, sizeof(jackoff_client_t));
-	if (!client) {
+	host = calloc(1, sizeof(jackoff_host_t));
+	if (!host) {
 		jackoff_error("Failed to allocate memory for Jackoff client.");
 		return NULL;
 	}
 	
-	jack_client = jack_client_open(client_name, jack_options, &status);
-	if (!jack_client) {
-		free(client);
+	host->jack_client = jack_client_open(client_name, jack_options, &status);
+	if (!host->jack_client) {
+		free(host);
 		client_open_failed(status);
 		return NULL;
 	}
 	
 	jackoff_info("JACK client registered as \"%s\".",
-		jack_get_client_name(jack_client));
+		jack_get_client_name(host->jack_client));
+	
+	host->status = 1;
+	pthread_mutex_init(&host->progress_lock, NULL);
+	pthread_cond_init(&host->consumed, NULL);
+	pthread_cond_init(&host->captured, NULL);
+	host->sample_rate = jack_get_sample_rate(host->jack_client);
+	
+	jack_on_shutdown(host->jack_client, jackd_shutdown_callback, host);
+	jack_set_process_callback(host->jack_client, audio_available_callback,
+		host);
+	jack_set_freewheel_callback(host->jack_client, freewheel_callback, host);
+	jack_set_buffer_size_callback(host->jack_client, buffer_size_callback,
+		host);
+	jack_set_sample_rate_callback(host->jack_client, sample_rate_callback,
+		host);
+	
+	return host;
+}
+
+int jackoff_activate_host(jackoff_host_t* host) {
+	return jack_activate(host->jack_client);
+}
+
+void jackoff_destroy_host(jackoff_host_t* host) {
+	size_t i;
+	
+	if (!host) {
+		jackoff_warn("Tried to destroy a NULL client.");
+		return;
+	}
+	
+	for (i = 0; i < host->client_count; i++)
+		jackoff_unregister_client_ports(host->clients[i]);
+	
+	jack_client_close(host->jack_client);
+	
+	for (i = 0; i < host->client_count; i++)
+		destroy_client(host->clients[i]);
+	free(host->clients);
+	pthread_cond_destroy(&host->captured);
+	pthread_cond_destroy(&host->consumed);
+	pthread_mutex_destroy(&host->progress_lock);
+	free(host);
+}
+
+/*
+ * Adds a recording to the host, registering an input port for each of its
+ * channels. If a name is given, it prefixes the port names. Clients must be
+ * created before the host is activated.
+ */
+jackoff_client_t* jackoff_create_client(jackoff_host_t* host,
+	const char* name, size_t channels, float buffer_duration, int flags)
+{
+	jackoff_client_t* client;
+	jackoff_client_t** clients;
+	jack_client_t* jack_client = host->jack_client;
+	char input_port_name[128];
+	size_t i;
+	jack_port_t* port;
+	jack_ringbuffer_t* buffer;
+	size_t buffer_size;
+	jack_nframes_t period;
+	size_t block_count;
+	
+	client = calloc(1, sizeof(jackoff_client_t));
+	clients = realloc(host->clients,
+		(host->client_count + 1) * sizeof(jackoff_client_t*));
+	if (!client || !clients) {
+		jackoff_error("Failed to allocate memory for Jackoff client.");
+		free(client);
+		return NULL;
+	}
+	host->clients = clients;
+	host->clients[host->client_count++] = client;
 	
+	client->host = host;
 	client->jack_client = jack_client;
+	client->name = name;
 	client->channel_count = channels;
+	client->capture_rate = host->sample_rate;
+	client->sample_rate = host->sample_rate;
 	client->input_ports = calloc(channels, sizeof(jack_port_t*));
 	client->ring_buffers = calloc(channels, sizeof(jack_ringbuffer_t*));
+	client->ring_buffer_mappings = calloc(channels, sizeof(size_t));
+	client->frame_stamps = jack_ringbuffer_create(FRAME_STAMPS *
+		sizeof(jackoff_frame_stamp_t));
+	if (!client->frame_stamps)
+		jackoff_error("Failed to allocate the frame time stamps.");
+	
+	if (flags & JACKOFF_TRANSPORT_BLOCKS) {
+		// One block per period, with enough of them to cover the requested
+		// buffer duration. Should the period change later, the callback
+		// spreads longer ones over several blocks and gathers shorter ones
+		// into one, so nothing has to be reallocated.
+		period = jack_get_buffer_size(jack_client);
+		block_count = (size_t) (jack_get_sample_rate(jack_client) *
+			buffer_duration / period) + 2;
+		client->block_pool = jackoff_create_block_pool(channels, period,
+			block_count);
+		if (!client->block_pool) {
+			jackoff_error("Failed to create the capture block pool.");
+		} else if ((flags & JACKOFF_RING_LOCKED) &&
+			mlock(client->block_pool->memory,
+				client->block_pool->memory_size) != 0)
+		{
+			jackoff_warn("Failed to lock the block pool into memory: %s "
+				"(check RLIMIT_MEMLOCK).", strerror(errno));
+		}
+	}
 	
 	buffer_size = jack_get_sample_rate(jack_client) * buffer_duration *
 		sizeof(float);
-	jackoff_debug("Ring buffer size: %2.2f seconds; %lu bytes.",
-		buffer_duration, buffer_size);
+	if (!client->block_pool) {
+		jackoff_debug("Ring buffer size: %2.2f seconds; %lu bytes.",
+			buffer_duration, buffer_size);
+	}
 	
 	for (i = 0; i < channels; i++) {
-		get_input_port_name(channels, i, input_port_name, 64);
+		get_input_port_name(name, channels, i, input_port_name,
+			sizeof(input_port_name));
 		port = jack_port_register(jack_client, input_port_name,
 			JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
 		if (!port) {
@@ -77,7 +220,11 @@ jackoff_client_t* jackoff_create_client(const char* client_name,
 		}
 		client->input_ports[i] = port;
 		
-		buffer = jack_ringbuffer_create(buffer_size);
+		if (client->block_pool)
+			continue;
+		
+		buffer = create_ring_buffer(buffer_size, flags,
+			&client->ring_buffer_mappings[i]);
 		if (!buffer) {
 			jackoff_error("Failed to create JACK ring buffer for channel %lu.",
 				i);
@@ -85,10 +232,15 @@ jackoff_client_t* jackoff_create_client(const char* client_name,
 		client->ring_buffers[i] = buffer;
 	}
 	
-	client->status = 1;
+	if (client->block_pool) {
+		client->transport_frames = client->block_pool->capacity *
+			client->block_pool->count;
+	} else if (channels > 0) {
+		client->transport_frames = (client->ring_buffers[0]->size - 1) /
+			sizeof(jack_default_audio_sample_t);
+	}
 	
-	jack_on_shutdown(jack_client, jackd_shutdown_callback, client);
-	jack_set_process_callback(jack_client, audio_available_callback, client);
+	client->status = 1;
 	
 	return client;
 }
@@ -116,47 +268,140 @@ static void client_open_failed(jack_status_t status)
 	}
 }
 
-static void get_input_port_name(size_t total, size_t index, char* buffer,
-	size_t buffer_length)
+/*
+ * Creates a ring buffer, optionally backed by huge pages and/or locked into
+ * RAM. A huge-page ring is built by hand around an anonymous mapping; the
+ * JACK ring buffer functions only care about the public fields, so they work
+ * on it just the same. *mapping receives the length of that mapping, or 0 if
+ * JACK allocated the buffer.
+ */
+static jack_ringbuffer_t* create_ring_buffer(size_t size, int flags,
+	size_t* mapping)
 {
+	jack_ringbuffer_t* buffer = NULL;
+	size_t power_of_two;
+	void* memory;
+	
+	*mapping = 0;
+	
+	if (flags & JACKOFF_RING_HUGE_PAGES) {
+		for (power_of_two = 1; power_of_two < size; power_of_two <<= 1)
+			;
+		*mapping = (power_of_two + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		
+		memory = mmap(NULL, *mapping, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory == MAP_FAILED) {
+			jackoff_warn("Failed to put a ring buffer on huge pages: %s "
+				"(check /proc/sys/vm/nr_hugepages).", strerror(errno));
+			*mapping = 0;
+		} else {
+			buffer = calloc(1, sizeof(jack_ringbuffer_t));
+			if (!buffer) {
+				munmap(memory, *mapping);
+				*mapping = 0;
+				return NULL;
+			}
+			buffer->buf = memory;
+			buffer->size = power_of_two;
+			buffer->size_mask = power_of_two - 1;
+		}
+	}
+	
+	if (!buffer) {
+		buffer = jack_ringbuffer_create(size);
+		if (!buffer)
+			return NULL;
+	}
+	
+	if (flags & JACKOFF_RING_LOCKED) {
+		if (*mapping) {
+			if (mlock(buffer->buf, *mapping) == 0)
+				buffer->mlocked = 1;
+		} else {
+			jack_ringbuffer_mlock(buffer);
+		}
+		
+		if (!buffer->mlocked) {
+			jackoff_warn("Failed to lock a ring buffer into memory: %s "
+				"(check RLIMIT_MEMLOCK).", strerror(errno));
+		}
+	}
+	
+	return buffer;
+}
+
+static void free_ring_buffer(jack_ringbuffer_t* buffer, size_t mapping) {
+	if (!mapping) {
+		jack_ringbuffer_free(buffer);
+		return;
+	}
+	
+	munmap(buffer->buf, mapping);
+	free(buffer);
+}
+
+static void get_input_port_name(const char* prefix, size_t total,
+	size_t index, char* buffer, size_t buffer_length)
+{
+	const char* name;
+	char channel_name[32];
+	
 	if (total == 1) {
-		strncpy(buffer, "mono", buffer_length);
+		name = "mono";
 	} else if (total == 2) {
-		if (index == 0)
-			strncpy(buffer, "left", buffer_length);
-		else
-			strncpy(buffer, "right", buffer_length);
+		name = (index == 0) ? "left" : "right";
 	} else {
-		snprintf(buffer, buffer_length, "channel_%lu", (index + 1));
+		snprintf(channel_name, sizeof(channel_name), "channel_%lu",
+			(index + 1));
+		name = channel_name;
 	}
+	
+	if (prefix)
+		snprintf(buffer, buffer_length, "%s_%s", prefix, name);
+	else
+		snprintf(buffer, buffer_length, "%s", name);
 }
 
-int jackoff_activate_client(jackoff_client_t* client) {
-	return jack_activate(client->jack_client);
-}
-
-void jackoff_destroy_client(jackoff_client_t* client) {
+void jackoff_unregister_client_ports(jackoff_client_t* client) {
 	size_t i;
-	size_t channels;
 	
-	if (!client) {
-		jackoff_warn("Tried to destroy a NULL client.");
-		return;
+	for (i = 0; i < client->channel_count; i++) {
+		if (client->input_ports[i]) {
+			jack_port_unregister(client->jack_client, client->input_ports[i]);
+			client->input_ports[i] = NULL;
+		}
 	}
+}
+
+static void destroy_client(jackoff_client_t* client) {
+	size_t i;
+	size_t channels = client->channel_count;
 	
-	channels = client->channel_count;
+	free(client->input_ports);
 	
 	for (i = 0; i < channels; i++) {
-		jack_port_unregister(client->jack_client, client->input_ports[i]);
+		if (client->ring_buffers[i]) {
+			free_ring_buffer(client->ring_buffers[i],
+				client->ring_buffer_mappings[i]);
+		}
 	}
-	free(client->input_ports);
+	free(client->ring_buffers);
+	free(client->ring_buffer_mappings);
+	jack_ringbuffer_free(client->frame_stamps);
 	
-	jack_client_close(client->jack_client);
+	if (client->block_pool)
+		jackoff_destroy_block_pool(client->block_pool);
 	
-	for (i = 0; i < channels; i++) {
-		jack_ringbuffer_free(client->ring_buffers[i]);
+	if (client->spill) {
+		jackoff_destroy_spill(client->spill);
+		pthread_mutex_destroy(&client->spill_lock);
+	}
+	if (client->staging) {
+		for (i = 0; i < channels; i++)
+			free(client->staging[i]);
+		free(client->staging);
 	}
-	free(client->ring_buffers);
 	
 	free(client);
 }
@@ -196,10 +441,511 @@ void jackoff_connect_client_port(jackoff_client_t* client, size_t channel,
 	}
 }
 
+void jackoff_start_capture(jackoff_client_t* client, jack_time_t start_time,
+	jack_time_t stop_time, uint64_t duration)
+{
+	client->start_time = start_time;
+	client->stop_time = stop_time;
+	client->duration = duration;
+	
+	// Make sure the schedule is visible before the callback sees the client
+	// as armed.
+	__sync_synchronize();
+	client->armed = 1;
+}
+
+size_t jackoff_client_frames_available(jackoff_client_t* client) {
+	size_t available;
+	size_t limit = (size_t) -1;
+	
+	// Audio captured at a new sample rate waits until the writer has
+	// switched to it.
+	if (client->rate_changed) {
+		__sync_synchronize();
+		limit = client->switch_frame - client->frames_consumed;
+	}
+	
+	if (client->block_pool) {
+		available = __atomic_load_n(&client->frames_captured,
+			__ATOMIC_ACQUIRE) - client->frames_consumed;
+	} else if (client->spill) {
+		pthread_mutex_lock(&client->spill_lock);
+		available = (client->staged - client->staged_offset) +
+			jackoff_spill_count(client->spill) +
+			ring_frames_available(client);
+		pthread_mutex_unlock(&client->spill_lock);
+	} else {
+		available = ring_frames_available(client);
+	}
+	
+	return (available < limit) ? available : limit;
+}
+
+/*
+ * Points channels[c] at the oldest captured audio for each channel, in place
+ * in the transport, and returns how many contiguous frames (up to max_frames)
+ * can be read there. The audio stays put until it is consumed.
+ */
+size_t jackoff_client_peek(jackoff_client_t* client, size_t max_frames,
+	jack_default_audio_sample_t** channels)
+{
+	jack_ringbuffer_data_t vector[2];
+	size_t frames = max_frames;
+	size_t c;
+	
+	if (client->spill) {
+		if (client->staged_offset == client->staged)
+			fill_staging(client, max_frames);
+		
+		if (client->staged - client->staged_offset < frames)
+			frames = client->staged - client->staged_offset;
+		for (c = 0; c < client->channel_count; c++)
+			channels[c] = client->staging[c] + client->staged_offset;
+		return frames;
+	}
+	
+	if (client->block_pool) {
+		if (!client->current_block) {
+			client->current_block = jackoff_block_next(client->block_pool);
+			client->block_offset = 0;
+			if (!client->current_block)
+				return 0;
+		}
+		
+		if (client->current_block->frame_count - client->block_offset < frames)
+			frames = client->current_block->frame_count - client->block_offset;
+		for (c = 0; c < client->channel_count; c++) {
+			channels[c] = client->current_block->channels[c] +
+				client->block_offset;
+		}
+		return frames;
+	}
+	
+	// Every ring is written in lockstep, so they all wrap at the same frame.
+	for (c = 0; c < client->channel_count; c++) {
+		jack_ringbuffer_get_read_vector(client->ring_buffers[c], vector);
+		if (vector[0].len / sizeof(jack_default_audio_sample_t) < frames)
+			frames = vector[0].len / sizeof(jack_default_audio_sample_t);
+		channels[c] = (jack_default_audio_sample_t*) vector[0].buf;
+	}
+	return frames;
+}
+
+/*
+ * Releases frames returned by jackoff_client_peek back to the transport.
+ */
+void jackoff_client_consume(jackoff_client_t* client, size_t frames) {
+	size_t c;
+	
+	__atomic_store_n(&client->frames_consumed,
+		client->frames_consumed + frames, __ATOMIC_RELAXED);
+	
+	if (client->spill) {
+		client->staged_offset += frames;
+		return;
+	}
+	
+	if (client->block_pool) {
+		client->block_offset += frames;
+		if (client->block_offset >= client->current_block->frame_count) {
+			jackoff_block_release(client->block_pool, client->current_block);
+			client->current_block = NULL;
+			if (client->host->freewheeling)
+				signal_progress(client->host, &client->host->consumed);
+		}
+		return;
+	}
+	
+	for (c = 0; c < client->channel_count; c++) {
+		jack_ringbuffer_read_advance(client->ring_buffers[c],
+			frames * sizeof(jack_default_audio_sample_t));
+	}
+	
+	if (client->host->freewheeling)
+		signal_progress(client->host, &client->host->consumed);
+}
+
+/*
+ * Once the writer has read every frame captured before a change of sample
+ * rate, takes up the new rate and returns it; otherwise returns 0. The
+ * writer should then start a new recording, as the audio that follows is
+ * at the new rate.
+ */
+jack_nframes_t jackoff_client_rate_switch(jackoff_client_t* client) {
+	if (!client->rate_changed)
+		return 0;
+	__sync_synchronize();
+	if (client->frames_consumed != client->switch_frame)
+		return 0;
+	
+	client->sample_rate = client->switch_rate;
+	__sync_synchronize();
+	client->rate_changed = 0;
+	return client->sample_rate;
+}
+
+/*
+ * Returns the time on the host's frame_clock at which a frame, counted in
+ * frames captured, was captured. The writer asks about frames it has
+ * already read, in order, and the stamps up to each are used up.
+ */
+uint64_t jackoff_client_frame_time(jackoff_client_t* client, size_t captured)
+{
+	jackoff_frame_stamp_t stamp;
+	
+	while (jack_ringbuffer_peek(client->frame_stamps, (char*) &stamp,
+		sizeof(stamp)) == sizeof(stamp) && stamp.captured <= captured)
+	{
+		jack_ringbuffer_read_advance(client->frame_stamps, sizeof(stamp));
+		client->frame_stamp = stamp;
+	}
+	return client->frame_stamp.frame_time +
+		(captured - client->frame_stamp.captured);
+}
+
+/*
+ * Backs the client's ring buffers with a spill file big enough for the given
+ * number of seconds of audio. Must be done before the capture starts.
+ * Returns 0 on success.
+ */
+int jackoff_attach_spill(jackoff_client_t* client, const char* directory,
+	float duration)
+{
+	size_t channels = client->channel_count;
+	size_t frames;
+	size_t c;
+	
+	if (client->block_pool) {
+		jackoff_warn("The spill tier needs the ring transport.");
+		return -1;
+	}
+	
+	client->staging = calloc(channels, sizeof(jack_default_audio_sample_t*));
+	if (!client->staging) {
+		jackoff_warn("Failed to allocate the spill staging buffers.");
+		return -1;
+	}
+	for (c = 0; c < channels; c++) {
+		client->staging[c] = calloc(STAGING_FRAMES,
+			sizeof(jack_default_audio_sample_t));
+		if (!client->staging[c]) {
+			jackoff_warn("Failed to allocate the spill staging buffers.");
+			return -1;
+		}
+	}
+	
+	frames = (size_t) (jack_get_sample_rate(client->jack_client) * duration);
+	pthread_mutex_init(&client->spill_lock, NULL);
+	client->spill = jackoff_create_spill(directory, channels, frames);
+	if (!client->spill) {
+		pthread_mutex_destroy(&client->spill_lock);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Called by the spill thread. Once the rings are more than half full, moves
+ * their oldest audio into the spill file, a chunk at a time, until they are
+ * down to a quarter. Returns the number of frames moved.
+ */
+size_t jackoff_client_spill(jackoff_client_t* client) {
+	jackoff_spill_t* spill = client->spill;
+	jack_default_audio_sample_t* first;
+	jack_default_audio_sample_t* second;
+	size_t first_frames;
+	size_t frames;
+	size_t c;
+	
+	frames = ring_frames_available(client);
+	if (!client->spilling) {
+		if (frames <= client->transport_frames / 2)
+			return 0;
+		if (jackoff_spill_count(spill) == 0) {
+			jackoff_info("%s%sWriter is falling behind; spilling to disk.",
+				client->name ? client->name : "", client->name ? ": " : "");
+		}
+		client->spilling = 1;
+	} else if (frames <= client->transport_frames / 4) {
+		client->spilling = 0;
+		return 0;
+	}
+	
+	pthread_mutex_lock(&client->spill_lock);
+	frames = ring_frames_available(client);
+	if (frames > jackoff_spill_space(spill))
+		frames = jackoff_spill_space(spill);
+	if (frames > SPILL_CHUNK_FRAMES)
+		frames = SPILL_CHUNK_FRAMES;
+	
+	for (c = 0; c < client->channel_count; c++) {
+		jackoff_spill_regions(spill, c, spill->tail, frames, &first,
+			&first_frames, &second);
+		jack_ringbuffer_read(client->ring_buffers[c], (char*) first,
+			first_frames * sizeof(jack_default_audio_sample_t));
+		jack_ringbuffer_read(client->ring_buffers[c], (char*) second,
+			(frames - first_frames) * sizeof(jack_default_audio_sample_t));
+	}
+	spill->tail += frames;
+	pthread_mutex_unlock(&client->spill_lock);
+	
+	if (client->host->freewheeling)
+		signal_progress(client->host, &client->host->consumed);
+	return frames;
+}
+
+/*
+ * Marks the client as no longer read by any writer.
+ */
+void jackoff_abandon_client(jackoff_client_t* client) {
+	client->abandoned = 1;
+	signal_progress(client->host, &client->host->consumed);
+}
+
+/*
+ * How many cycles the process callback has run while freewheeling; taken
+ * before looking for audio, to pass to jackoff_wait_for_capture.
+ */
+unsigned long jackoff_capture_cycles(jackoff_host_t* host) {
+	unsigned long cycles;
+	
+	pthread_mutex_lock(&host->progress_lock);
+	cycles = host->freewheel_cycles;
+	pthread_mutex_unlock(&host->progress_lock);
+	return cycles;
+}
+
+/*
+ * Called by an idle writer while JACK freewheels: waits until the process
+ * callback has run another cycle since `cycles` was taken, or for at most
+ * `timeout` seconds.
+ */
+void jackoff_wait_for_capture(jackoff_host_t* host, unsigned long cycles,
+	float timeout)
+{
+	struct timespec deadline;
+	
+	timeout_to_deadline((long) (timeout * 1000000000.0), &deadline);
+	pthread_mutex_lock(&host->progress_lock);
+	while (host->freewheeling && host->freewheel_cycles == cycles) {
+		if (pthread_cond_timedwait(&host->captured, &host->progress_lock,
+			&deadline) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&host->progress_lock);
+}
+
+static size_t ring_frames_available(jackoff_client_t* client) {
+	size_t c;
+	size_t space;
+	size_t available = (size_t) -1;
+	
+	for (c = 0; c < client->channel_count; c++) {
+		space = jack_ringbuffer_read_space(client->ring_buffers[c]);
+		if (space < available)
+			available = space;
+	}
+	
+	return available / sizeof(jack_default_audio_sample_t);
+}
+
+/*
+ * Copies the oldest audio the client holds into the staging buffers: from
+ * the spill file while it has any, otherwise from the rings.
+ */
+static void fill_staging(jackoff_client_t* client, size_t max_frames) {
+	jackoff_spill_t* spill = client->spill;
+	jack_default_audio_sample_t* first;
+	jack_default_audio_sample_t* second;
+	size_t first_frames;
+	size_t frames;
+	size_t c;
+	int drained = 0;
+	
+	if (max_frames > STAGING_FRAMES)
+		max_frames = STAGING_FRAMES;
+	
+	pthread_mutex_lock(&client->spill_lock);
+	frames = jackoff_spill_count(spill);
+	if (frames > 0) {
+		if (frames > max_frames)
+			frames = max_frames;
+		for (c = 0; c < client->channel_count; c++) {
+			jackoff_spill_regions(spill, c, spill->head, frames, &first,
+				&first_frames, &second);
+			memcpy(client->staging[c], first,
+				first_frames * sizeof(jack_default_audio_sample_t));
+			memcpy(client->staging[c] + first_frames, second,
+				(frames - first_frames) * sizeof(jack_default_audio_sample_t));
+		}
+		spill->head += frames;
+		drained = (jackoff_spill_count(spill) == 0);
+	} else {
+		frames = ring_frames_available(client);
+		if (frames > max_frames)
+			frames = max_frames;
+		for (c = 0; c < client->channel_count; c++) {
+			jack_ringbuffer_read(client->ring_buffers[c],
+				(char*) client->staging[c],
+				frames * sizeof(jack_default_audio_sample_t));
+		}
+	}
+	pthread_mutex_unlock(&client->spill_lock);
+	
+	// Reading the rings freed space that a freewheeling callback may be
+	// waiting for.
+	if (frames > 0 && client->host->freewheeling)
+		signal_progress(client->host, &client->host->consumed);
+	
+	if (drained) {
+		jackoff_info("%s%sWriter has caught up with the spill file.",
+			client->name ? client->name : "", client->name ? ": " : "");
+	}
+	
+	client->staged = frames;
+	client->staged_offset = 0;
+}
+
+/*
+ * Converts a time on the JACK clock into an offset within the current cycle,
+ * clamped to [0, frame_count]. Frame times wrap around, so only a time close
+ * to the cycle is converted to frames and compared by signed difference; one
+ * further off is before or after the cycle by its microseconds alone.
+ */
+static jack_nframes_t cycle_offset(jackoff_client_t* client, jack_time_t when,
+	jack_nframes_t cycle_start, jack_nframes_t frame_count)
+{
+	jack_time_t cycle_time = jack_frames_to_time(client->jack_client,
+		cycle_start);
+	int32_t delta;
+	
+	if (when < cycle_time)
+		return 0;
+	if (when - cycle_time > 2 * (jack_time_t) frame_count * 1000000 /
+		client->host->sample_rate)
+		return frame_count;
+	
+	delta = (int32_t) (jack_time_to_frames(client->jack_client, when) -
+		cycle_start);
+	if (delta < 0)
+		return 0;
+	if ((jack_nframes_t) delta > frame_count)
+		return frame_count;
+	return (jack_nframes_t) delta;
+}
+
 static int audio_available_callback(jack_nframes_t frame_count, void* arg) {
-	jackoff_client_t* client = arg;
+	jackoff_host_t* host = arg;
+	jack_nframes_t frame_time = jack_last_frame_time(host->jack_client);
+	size_t i;
+	int result = 0;
+	
+	// Carry the 64-bit clock forward by however far the 32-bit frame time
+	// has moved, across a wrap or not.
+	host->frame_clock += (jack_nframes_t) (frame_time -
+		(jack_nframes_t) host->frame_clock);
+	
+	for (i = 0; i < host->client_count; i++)
+		result |= capture_cycle(host->clients[i], frame_count);
 	
-	size_t write_size = sizeof(jack_default_audio_sample_t) * frame_count;
+	if (host->freewheeling) {
+		pthread_mutex_lock(&host->progress_lock);
+		host->freewheel_cycles++;
+		pthread_cond_broadcast(&host->captured);
+		pthread_mutex_unlock(&host->progress_lock);
+	}
+	return result;
+}
+
+/*
+ * Captures one cycle's worth of audio for one recording.
+ */
+static int capture_cycle(jackoff_client_t* client, jack_nframes_t frame_count)
+{
+	uint64_t clock = client->host->frame_clock;
+	jack_nframes_t cycle_start = (jack_nframes_t) clock;
+	jack_nframes_t first = 0;
+	jack_nframes_t end = frame_count;
+	jack_nframes_t limit;
+	int64_t remaining;
+	size_t held;
+	
+	if (!client->armed || client->capture_finished)
+		return 0;
+	
+	if (client->host->sample_rate != client->capture_rate)
+		note_rate_change(client, client->host->sample_rate);
+	
+	if (!client->capture_started) {
+		if (client->start_time) {
+			first = cycle_offset(client, client->start_time, cycle_start,
+				frame_count);
+			if (first >= frame_count)
+				return 0; // not yet
+		}
+		client->start_frame = clock + first;
+		client->capture_started = 1;
+	}
+	
+	if (client->duration) {
+		remaining = (int64_t) (client->start_frame + client->duration - clock);
+		if (remaining < (int64_t) end)
+			end = (remaining > 0) ? (jack_nframes_t) remaining : 0;
+	}
+	
+	if (client->stop_time) {
+		limit = cycle_offset(client, client->stop_time, cycle_start,
+			frame_count);
+		if (limit < end)
+			end = limit;
+	}
+	
+	if (end > first) {
+		// Audio that doesn't follow on from the last captured, after a
+		// dropout or at the start, gets its place on JACK's clock noted.
+		if (!client->stamped || client->next_frame_time != clock + first)
+			stamp_frame_time(client, clock + first);
+		held = frames_held(client);
+		
+		if (client->block_pool) {
+			if (write_block(client, frame_count, first, end, cycle_start) < 0)
+				return 1;
+		} else {
+			if (write_ring_buffers(client, frame_count, first, end) < 0)
+				return 1;
+		}
+		client->next_frame_time = clock + first +
+			(frames_held(client) - held);
+		
+		if (client->counters) {
+			jackoff_count_max(client->counters,
+				JACKOFF_METRIC_FILL_HIGH_WATER,
+				client->frames_captured - __atomic_load_n(
+					&client->frames_consumed, __ATOMIC_RELAXED));
+		}
+	}
+	
+	if (end < frame_count) {
+		// The ring buffer writes above must be visible before the writer
+		// learns that no more audio is coming.
+		if (client->filling_block)
+			publish_block(client);
+		__sync_synchronize();
+		client->capture_finished = 1;
+	}
+	
+	return 0; // success
+}
+
+/*
+ * Copies frames [first, end) of this cycle into the ring buffers, or flags an
+ * overflow if they won't all fit. Returns -1 on failure.
+ */
+static int write_ring_buffers(jackoff_client_t* client,
+	jack_nframes_t frame_count, jack_nframes_t first, jack_nframes_t end)
+{
+	size_t write_size = sizeof(jack_default_audio_sample_t) * (end - first);
 	size_t channels = client->channel_count;
 	size_t c;
 	char* buffer;
@@ -208,8 +954,13 @@ static int audio_available_callback(jack_nframes_t frame_count, void* arg) {
 	
 	for (c = 0; c < channels; c++) {
 		space = jack_ringbuffer_write_space(client->ring_buffers[c]);
+		if (space < write_size && client->host->freewheeling &&
+			wait_for_writer(client, end - first) == 0)
+			space = jack_ringbuffer_write_space(client->ring_buffers[c]);
 		if (space < write_size) {
 			client->ring_buffer_overflowed = 1;
+			jackoff_count(client->counters, JACKOFF_METRIC_FRAMES_DROPPED,
+				end - first);
 			return 0;
 		}
 	}
@@ -217,22 +968,240 @@ static int audio_available_callback(jack_nframes_t frame_count, void* arg) {
 	for (c = 0; c < channels; c++) {
 		buffer = (char*) jack_port_get_buffer(client->input_ports[c],
 			frame_count);
+		buffer += sizeof(jack_default_audio_sample_t) * first;
 		written = jack_ringbuffer_write(client->ring_buffers[c], buffer,
 			write_size);
 		if (written < write_size) {
 			jackoff_warn("Failed to write to a ring buffer.");
-			return 1;
+			return -1;
 		}
 	}
 	
-	return 0; // success
+	__atomic_add_fetch(&client->frames_captured, end - first,
+		__ATOMIC_RELEASE);
+	jackoff_count(client->counters, JACKOFF_METRIC_FRAMES_CAPTURED,
+		end - first);
+	return 0;
+}
+
+/*
+ * Copies frames [first, end) of this cycle into blocks from the pool, or
+ * flags an overflow if the writer is holding every block. A block is
+ * published once it is full, so a period longer than the blocks fills
+ * several, and shorter ones share a block for as long as they follow on
+ * from each other.
+ */
+static int write_block(jackoff_client_t* client, jack_nframes_t frame_count,
+	jack_nframes_t first, jack_nframes_t end, jack_nframes_t cycle_start)
+{
+	jackoff_block_t* block = client->filling_block;
+	jack_default_audio_sample_t* buffer;
+	jack_nframes_t done, count;
+	size_t c;
+	
+	if (block && block->frame_time + block->frame_count != cycle_start + first)
+		publish_block(client);
+	
+	for (done = first; done < end; done += count) {
+		block = client->filling_block;
+		if (!block) {
+			block = jackoff_block_acquire(client->block_pool);
+			while (!block && client->host->freewheeling &&
+				wait_for_writer(client, 0) == 0)
+				block = jackoff_block_acquire(client->block_pool);
+			if (!block) {
+				client->ring_buffer_overflowed = 1;
+				jackoff_count(client->counters, JACKOFF_METRIC_FRAMES_DROPPED,
+					end - done);
+				return 0;
+			}
+			
+			block->frame_count = 0;
+			block->frame_time = cycle_start + done;
+			block->usecs = jack_frames_to_time(client->jack_client,
+				block->frame_time);
+			client->filling_block = block;
+		}
+		
+		count = client->block_pool->capacity - block->frame_count;
+		if (count > end - done)
+			count = end - done;
+		for (c = 0; c < client->channel_count; c++) {
+			buffer = (jack_default_audio_sample_t*) jack_port_get_buffer(
+				client->input_ports[c], frame_count);
+			memcpy(block->channels[c] + block->frame_count, buffer + done,
+				sizeof(jack_default_audio_sample_t) * count);
+		}
+		
+		block->frame_count += count;
+		if (block->frame_count == client->block_pool->capacity)
+			publish_block(client);
+	}
+	
+	return 0;
+}
+
+/*
+ * Hands the block being filled to the writer.
+ */
+static void publish_block(jackoff_client_t* client) {
+	jackoff_block_t* block = client->filling_block;
+	
+	jackoff_block_publish(client->block_pool, block);
+	__atomic_add_fetch(&client->frames_captured, block->frame_count,
+		__ATOMIC_RELEASE);
+	jackoff_count(client->counters, JACKOFF_METRIC_FRAMES_CAPTURED,
+		block->frame_count);
+	client->filling_block = NULL;
+}
+
+/*
+ * Counts the frames the callback has captured, including those in the block
+ * it hasn't published yet.
+ */
+static size_t frames_held(jackoff_client_t* client) {
+	return client->frames_captured +
+		(client->filling_block ? client->filling_block->frame_count : 0);
+}
+
+/*
+ * Queues a stamp saying that the next frame captured is at the given time.
+ * If the writer has let the queue fill up, the stamp is left out, and the
+ * writer goes on counting from the last one it has until there is room.
+ */
+static void stamp_frame_time(jackoff_client_t* client, uint64_t frame_time) {
+	jackoff_frame_stamp_t stamp;
+	
+	if (jack_ringbuffer_write_space(client->frame_stamps) < sizeof(stamp))
+		return;
+	stamp.captured = frames_held(client);
+	stamp.frame_time = frame_time;
+	jack_ringbuffer_write(client->frame_stamps, (const char*) &stamp,
+		sizeof(stamp));
+	client->stamped = 1;
+}
+
+/*
+ * Marks the end of the audio captured at the old sample rate. If the writer
+ * hasn't yet reached the last change, this one waits for it, and lands a
+ * little late.
+ */
+static void note_rate_change(jackoff_client_t* client, jack_nframes_t rate)
+{
+	if (client->rate_changed)
+		return;
+	
+	if (client->filling_block)
+		publish_block(client);
+	client->switch_frame = client->frames_captured;
+	client->switch_rate = rate;
+	client->capture_rate = rate;
+	
+	__sync_synchronize();
+	client->rate_changed = 1;
+}
+
+/*
+ * Waits, while JACK freewheels, until the writer has made room for `frames`
+ * more frames in every ring (or, for the block transport, has released a
+ * block). Returns 0 if there is room, or -1 if the wait was given up
+ * because freewheeling ended or nothing reads the transport any more.
+ */
+static int wait_for_writer(jackoff_client_t* client, size_t frames) {
+	jackoff_host_t* host = client->host;
+	size_t bytes = frames * sizeof(jack_default_audio_sample_t);
+	struct timespec deadline;
+	size_t c;
+	int room = 0;
+	
+	pthread_mutex_lock(&host->progress_lock);
+	while (host->freewheeling && host->status && !client->abandoned) {
+		if (client->block_pool) {
+			if (jackoff_block_available(client->block_pool)) {
+				room = 1;
+				break;
+			}
+		} else {
+			for (c = 0; c < client->channel_count; c++) {
+				if (jack_ringbuffer_write_space(client->ring_buffers[c]) <
+					bytes)
+					break;
+			}
+			if (c == client->channel_count) {
+				room = 1;
+				break;
+			}
+		}
+		
+		timeout_to_deadline(FREEWHEEL_WAIT_NSEC, &deadline);
+		pthread_cond_timedwait(&host->consumed, &host->progress_lock,
+			&deadline);
+	}
+	pthread_mutex_unlock(&host->progress_lock);
+	
+	return room ? 0 : -1;
+}
+
+static void signal_progress(jackoff_host_t* host, pthread_cond_t* condition)
+{
+	pthread_mutex_lock(&host->progress_lock);
+	pthread_cond_broadcast(condition);
+	pthread_mutex_unlock(&host->progress_lock);
+}
+
+static void timeout_to_deadline(long nanoseconds, struct timespec* deadline)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += nanoseconds / 1000000000;
+	deadline->tv_nsec += nanoseconds % 1000000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+static void freewheel_callback(int starting, void* arg) {
+	jackoff_host_t* host = arg;
+	
+	if (starting) {
+		jackoff_info("JACK is freewheeling; capture will wait for the writer "
+			"rather than drop audio.");
+	} else {
+		jackoff_info("JACK has stopped freewheeling.");
+	}
+	host->freewheeling = starting;
+	
+	// Let anyone waiting on the other side notice the change.
+	signal_progress(host, &host->consumed);
+	signal_progress(host, &host->captured);
+}
+
+/*
+ * Nothing is sized by the period: see write_block.
+ */
+static int buffer_size_callback(jack_nframes_t frames, void* arg) {
+	jackoff_debug("JACK's period is now %u frames.", frames);
+	return 0;
+}
+
+static int sample_rate_callback(jack_nframes_t rate, void* arg) {
+	jackoff_host_t* host = arg;
+	
+	if (rate != host->sample_rate) {
+		jackoff_info("JACK's sample rate is now %u Hz.", rate);
+		host->sample_rate = rate;
+	}
+	return 0;
 }
 
 static void jackd_shutdown_callback(void* arg) {
-	jackoff_client_t* client = arg;
+	jackoff_host_t* host = arg;
+	size_t i;
 	
-	if (client->status) {
+	if (host->status) {
 		jackoff_warn("jackd is shutting down; jackoff will now quit.");
-		client->status = 0;
+		host->status = 0;
+		for (i = 0; i < host->client_count; i++)
+			host->clients[i]->status = 0;
 	}
 }
@@ -23,22 +23,167 @@
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "blockpool.h"
+#include "spill.h"
 
+/* Flags controlling how captured audio is buffered. */
+#define JACKOFF_RING_LOCKED 1
+#define JACKOFF_RING_HUGE_PAGES 2
+#define JACKOFF_TRANSPORT_BLOCKS 4
+
+struct jackoff_counters;
+
+typedef struct jackoff_host jackoff_host_t;
+typedef struct jackoff_client jackoff_client_t;
+
+/*
+ * Where one captured frame sat on the host's frame_clock.
+ */
 typedef struct {
+	size_t captured; // in frames captured
+	uint64_t frame_time;
+} jackoff_frame_stamp_t;
+
+/*
+ * The JACK client. One host can capture any number of independent
+ * recordings: its process callback fans out to each of them in turn.
+ */
+struct jackoff_host {
 	jack_client_t* jack_client;
+	int status;
+	size_t client_count;
+	jackoff_client_t** clients;
+	
+	/* While JACK freewheels, the process callback has no deadline, so a
+	 * full transport makes it wait for the writer instead of dropping
+	 * audio, and the writer waits for captured audio instead of sleeping.
+	 * Both sides signal the other under progress_lock. */
+	volatile int freewheeling;
+	pthread_mutex_t progress_lock;
+	pthread_cond_t consumed;
+	pthread_cond_t captured;
+	unsigned long freewheel_cycles; // counted while freewheeling
+	
+	/* JACK's sample rate, as its callback last told us. */
+	volatile jack_nframes_t sample_rate;
+	
+	/* JACK's frame time at the start of the current cycle, extended to 64
+	 * bits so that schedules and durations can run past the point where the
+	 * 32-bit frame time wraps (about 12 hours at 48 kHz). Its low 32 bits
+	 * are JACK's frame time. */
+	uint64_t frame_clock;
+};
+
+/*
+ * The capture side of a single recording: its ports, transport and
+ * schedule.
+ */
+struct jackoff_client {
+	jackoff_host_t* host;
+	jack_client_t* jack_client;
+	const char* name;
 	size_t channel_count;
 	int status;
 	jack_port_t** input_ports;
 	jack_ringbuffer_t** ring_buffers;
+	size_t* ring_buffer_mappings; // nonzero for rings on huge pages
 	int ring_buffer_overflowed;
-} jackoff_client_t;
+	
+	/* The block transport, used instead of the ring buffers when the client
+	 * is created with JACKOFF_TRANSPORT_BLOCKS. */
+	jackoff_block_pool_t* block_pool;
+	jackoff_block_t* current_block;
+	size_t block_offset;
+	
+	/* Frames handed to and taken from the transport, for either kind, and
+	 * how many it can hold. */
+	size_t frames_captured;
+	size_t frames_consumed;
+	size_t transport_frames;
+	
+	/* The spill tier, if one is attached. While it is, the writer doesn't
+	 * read the rings in place: it copies a little at a time into the
+	 * staging buffers, under spill_lock, taking from the spill file first
+	 * while that holds anything. */
+	jackoff_spill_t* spill;
+	pthread_mutex_t spill_lock;
+	jack_default_audio_sample_t** staging;
+	size_t staged;
+	size_t staged_offset;
+	int spilling;
+	
+	/* The process callback's metrics for this recording, or NULL. */
+	struct jackoff_counters* counters;
+	
+	/* Capture schedule. Times are on the JACK clock (microseconds), durations
+	 * are in frames; zero means "not set". */
+	jack_time_t start_time;
+	jack_time_t stop_time;
+	uint64_t duration;
+	
+	/* Capture state, owned by the process callback once the client is armed.
+	 * start_frame is on the host's frame_clock. */
+	volatile int armed;
+	volatile int capture_started;
+	volatile int capture_finished;
+	uint64_t start_frame;
+	
+	/* Set once nothing will read the transport again, so that a freewheeling
+	 * callback doesn't wait for it. */
+	volatile int abandoned;
+	
+	/* Sample rate changes. The callback notes where in the captured audio
+	 * the rate changed, and the writer reads no further than that until it
+	 * has taken up the new rate with jackoff_client_rate_switch. The rest is
+	 * the writer's: the rate of the audio it is reading. */
+	jack_nframes_t capture_rate;
+	volatile int rate_changed;
+	size_t switch_frame; // in frames captured
+	jack_nframes_t switch_rate;
+	jack_nframes_t sample_rate;
+	
+	/* Where the captured audio sits on JACK's clock. Whenever the callback
+	 * captures audio that doesn't follow on from what it last captured (at
+	 * the start, and after every dropout), it queues a stamp; the writer
+	 * reads them back with jackoff_client_frame_time. next_frame_time is
+	 * the callback's, frame_stamp the writer's latest. */
+	jack_ringbuffer_t* frame_stamps;
+	uint64_t next_frame_time;
+	int stamped;
+	jackoff_frame_stamp_t frame_stamp;
+	
+	/* The block the callback is filling, when periods are shorter than the
+	 * blocks. */
+	jackoff_block_t* filling_block;
+};
+
+jackoff_host_t* jackoff_create_host(const char* client_name,
+	jack_options_t jack_options);
+int jackoff_activate_host(jackoff_host_t* host);
+void jackoff_destroy_host(jackoff_host_t* host);
 
-jackoff_client_t* jackoff_create_client(const char* client_name,
-	jack_options_t jack_options, size_t channels, float buffer_duration);
-int jackoff_activate_client(jackoff_client_t* client);
-void jackoff_destroy_client(jackoff_client_t* client);
+jackoff_client_t* jackoff_create_client(jackoff_host_t* host,
+	const char* name, size_t channels, float buffer_duration, int flags);
+void jackoff_unregister_client_ports(jackoff_client_t* client);
 void jackoff_auto_connect_client_ports(jackoff_client_t* client);
 void jackoff_connect_client_port(jackoff_client_t* client, size_t channel,
 	const char* output_port_name);
+void jackoff_start_capture(jackoff_client_t* client, jack_time_t start_time,
+	jack_time_t stop_time, uint64_t duration);
+size_t jackoff_client_frames_available(jackoff_client_t* client);
+size_t jackoff_client_peek(jackoff_client_t* client, size_t max_frames,
+	jack_default_audio_sample_t** channels);
+void jackoff_client_consume(jackoff_client_t* client, size_t frames);
+int jackoff_attach_spill(jackoff_client_t* client, const char* directory,
+	float duration);
+size_t jackoff_client_spill(jackoff_client_t* client);
+jack_nframes_t jackoff_client_rate_switch(jackoff_client_t* client);
+uint64_t jackoff_client_frame_time(jackoff_client_t* client, size_t captured);
+void jackoff_abandon_client(jackoff_client_t* client);
+unsigned long jackoff_capture_cycles(jackoff_host_t* host);
+void jackoff_wait_for_capture(jackoff_host_t* host, unsigned long cycles,
+	float timeout);
 
 #endif
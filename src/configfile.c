@@ -0,0 +1,316 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "configfile.h"
+#include "driver_stream.h"
+#include "writebehind.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define MAX_LINE_LENGTH 1024
+
+static char* strip(char* value);
+static int parse_flag(const char* value, int* flag);
+static int set_option(jackoff_recording_t* recording, const char* key,
+	char* value);
+
+/*
+ * Splits a comma-separated list of JACK port names in place.
+ */
+int jackoff_parse_ports(char* port_value, size_t* count, char*** ports) {
+	size_t n = 1;
+	char* c;
+	char* last_start;
+	char** list = NULL;
+	
+	last_start = port_value;
+	for (c = port_value; *c != 0; c++) {
+		if (*c == ',') {
+			list = realloc(list, n * sizeof(char*));
+			if (!list)
+				return 0;
+			list[n - 1] = last_start;
+			last_start = (c + 1);
+			*c = 0;
+			n++;
+		}
+	}
+	
+	list = realloc(list, n * sizeof(char*));
+	if (!list)
+		return 0;
+	list[n - 1] = last_start;
+	*ports = list;
+	*count = n;
+	return 1;
+}
+
+int jackoff_parse_dither(const char* value, jackoff_dither_t* dither) {
+	if (0 == strcmp(value, "tpdf")) {
+		*dither = JACKOFF_DITHER_TPDF;
+	} else if (0 == strcmp(value, "none")) {
+		*dither = JACKOFF_DITHER_NONE;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Fills in the channel count and bitrate of a recording that didn't set them
+ * and checks that its options agree with each other. Returns 0 on success.
+ */
+int jackoff_resolve_recording(jackoff_recording_t* recording) {
+	jackoff_settings_t* settings = &recording->settings;
+	const char* name = recording->name ? recording->name : "recording";
+	
+	if (recording->channels == 0) {
+		if (recording->port_count > 0)
+			recording->channels = recording->port_count;
+		else if (settings->matrix)
+			recording->channels = settings->matrix->inputs;
+		else
+			recording->channels = JACKOFF_DEFAULT_CHANNELS;
+	}
+	
+	if (settings->matrix && settings->matrix->inputs != recording->channels) {
+		jackoff_warn("%s: channel matrix expects %lu channels, not %lu", name,
+			settings->matrix->inputs, recording->channels);
+		return -1;
+	}
+	
+	if (recording->port_count > recording->channels) {
+		jackoff_warn("%s: %lu ports given for %lu channels", name,
+			recording->port_count, recording->channels);
+		return -1;
+	}
+	
+	if (settings->bitrate == -1) {
+		settings->bitrate = JACKOFF_DEFAULT_BITRATE_PER_CHANNEL * (int)
+			(settings->matrix ? settings->matrix->outputs :
+			recording->channels);
+	}
+	
+	if (!recording->file_path) {
+		jackoff_warn("%s: no output file given", name);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Reads a list of recordings from an INI-style file. Each [section] is one
+ * recording, named after the section; its keys are the long names of the
+ * matching command-line options (plus "file"), and anything not given is
+ * taken from the defaults. Returns NULL on error.
+ */
+jackoff_recording_t* jackoff_load_config(const char* path,
+	const jackoff_recording_t* defaults, size_t* count)
+{
+	FILE* file;
+	char line[MAX_LINE_LENGTH];
+	char* c;
+	char* key;
+	char* value;
+	jackoff_recording_t* recordings = NULL;
+	jackoff_recording_t* grown;
+	jackoff_recording_t* current = NULL;
+	size_t n = 0;
+	size_t line_number = 0;
+	size_t i;
+	
+	file = fopen(path, "r");
+	if (!file) {
+		jackoff_warn("Failed to open configuration file \"%s\".", path);
+		return NULL;
+	}
+	
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		line[strcspn(line, "#;\r\n")] = 0;
+		c = strip(line);
+		if (*c == 0)
+			continue;
+		
+		if (*c == '[') {
+			value = strchr(c, ']');
+			if (!value || value[1] != 0 || value == c + 1) {
+				jackoff_warn("%s:%lu: invalid section header.", path,
+					line_number);
+				goto fail;
+			}
+			*value = 0;
+			
+			grown = realloc(recordings, (n + 1) * sizeof(jackoff_recording_t));
+			if (!grown)
+				goto fail;
+			recordings = grown;
+			current = &recordings[n++];
+			*current = *defaults;
+			current->name = strdup(strip(c + 1));
+			if (!current->name)
+				goto fail;
+			continue;
+		}
+		
+		value = strchr(c, '=');
+		if (!value) {
+			jackoff_warn("%s:%lu: expected \"key = value\".", path,
+				line_number);
+			goto fail;
+		}
+		*value++ = 0;
+		key = strip(c);
+		value = strip(value);
+		
+		if (!current) {
+			jackoff_warn("%s:%lu: \"%s\" is outside of any recording.", path,
+				line_number, key);
+			goto fail;
+		}
+		if (!set_option(current, key, value)) {
+			jackoff_warn("%s:%lu: invalid %s \"%s\".", path, line_number, key,
+				value);
+			goto fail;
+		}
+	}
+	fclose(file);
+	
+	if (n == 0) {
+		jackoff_warn("%s: no recordings defined.", path);
+		free(recordings);
+		return NULL;
+	}
+	
+	for (i = 0; i < n; i++) {
+		if (jackoff_resolve_recording(&recordings[i]) != 0) {
+			free(recordings);
+			return NULL;
+		}
+	}
+	
+	*count = n;
+	return recordings;
+	
+	fail:
+	fclose(file);
+	free(recordings);
+	return NULL;
+}
+
+static char* strip(char* value) {
+	char* end;
+	
+	while (isspace((unsigned char) *value))
+		value++;
+	end = value + strlen(value);
+	while (end > value && isspace((unsigned char) end[-1]))
+		*--end = 0;
+	return value;
+}
+
+/*
+ * Reads "yes", "no", "true", "false", "on", "off", "1" or "0".
+ */
+static int parse_flag(const char* value, int* flag) {
+	if (0 == strcasecmp(value, "yes") || 0 == strcasecmp(value, "true") ||
+		0 == strcasecmp(value, "on") || 0 == strcmp(value, "1"))
+	{
+		*flag = 1;
+	} else if (0 == strcasecmp(value, "no") ||
+		0 == strcasecmp(value, "false") || 0 == strcasecmp(value, "off") ||
+		0 == strcmp(value, "0"))
+	{
+		*flag = 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Applies one key from a configuration section. Returns 0 if the key is
+ * unknown or its value is invalid.
+ */
+static int set_option(jackoff_recording_t* recording, const char* key,
+	char* value)
+{
+	jackoff_settings_t* settings = &recording->settings;
+	char* copy;
+	char* end;
+	
+	copy = strdup(value);
+	if (!copy)
+		return 0;
+	
+	if (0 == strcmp(key, "file")) {
+		recording->file_path = copy;
+		return 1;
+	} else if (0 == strcmp(key, "ports")) {
+		return jackoff_parse_ports(copy, &recording->port_count,
+			&recording->ports);
+	}
+	
+	if (0 == strcmp(key, "format")) {
+		recording->format = jackoff_get_output_format(value);
+		end = recording->format ? "" : value;
+	} else if (0 == strcmp(key, "matrix")) {
+		settings->matrix = jackoff_load_matrix(value);
+		end = settings->matrix ? "" : value;
+	} else if (0 == strcmp(key, "dither")) {
+		end = jackoff_parse_dither(value, &settings->dither) ? "" : value;
+	} else if (0 == strcmp(key, "backpressure")) {
+		end = jackoff_parse_backpressure(value, &settings->stream_backlog) ?
+			"" : value;
+	} else if (0 == strcmp(key, "channels")) {
+		recording->channels = (size_t) strtol(value, &end, 0);
+	} else if (0 == strcmp(key, "bitrate")) {
+		settings->bitrate = (int) strtol(value, &end, 0);
+	} else if (0 == strcmp(key, "sample-rate")) {
+		settings->sample_rate = (jack_nframes_t) strtol(value, &end, 0);
+	} else if (0 == strcmp(key, "write-buffer")) {
+		end = jackoff_parse_write_buffer(value, &settings->write_buffer,
+			&settings->write_thread) ? "" : value;
+	} else if (0 == strcmp(key, "seek-index")) {
+		settings->seek_interval = strtod(value, &end);
+	} else if (0 == strcmp(key, "loudness")) {
+		end = parse_flag(value, &settings->loudness) ? "" : value;
+	} else if (0 == strcmp(key, "peaks")) {
+		end = parse_flag(value, &settings->peaks) ? "" : value;
+	} else if (0 == strcmp(key, "manifest")) {
+		end = parse_flag(value, &settings->manifest) ? "" : value;
+	} else if (0 == strcmp(key, "duration")) {
+		recording->duration = strtod(value, &end);
+	} else if (0 == strcmp(key, "start-at")) {
+		recording->start_at = strtod(value, &end);
+	} else if (0 == strcmp(key, "stop-at")) {
+		recording->stop_at = strtod(value, &end);
+	} else {
+		end = value;
+	}
+	
+	free(copy);
+	return *value != 0 && *end == 0;
+}
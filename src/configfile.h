@@ -0,0 +1,31 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_CONFIGFILE_H_
+#define _JACKOFF_CONFIGFILE_H_
+
+#include "jackoff.h"
+
+int jackoff_parse_ports(char* port_value, size_t* count, char*** ports);
+int jackoff_parse_dither(const char* value, jackoff_dither_t* dither);
+int jackoff_resolve_recording(jackoff_recording_t* recording);
+jackoff_recording_t* jackoff_load_config(const char* path,
+	const jackoff_recording_t* defaults, size_t* count);
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "container.h"
+#include "crc32c.h"
+#include "logging.h"
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static void put_u16(unsigned char* p, uint16_t value);
+static void put_u32(unsigned char* p, uint32_t value);
+static void put_u64(unsigned char* p, uint64_t value);
+static uint16_t get_u16(const unsigned char* p);
+static uint32_t get_u32(const unsigned char* p);
+static uint64_t get_u64(const unsigned char* p);
+static int read_exactly(int fd, void* buffer, size_t size, off_t offset);
+static int read_index(jackoff_container_t* container, off_t file_size);
+static int walk_chunks(jackoff_container_t* container, off_t file_size);
+static int entry_fits(const jackoff_container_info_t* info,
+	const jackoff_chunk_entry_t* entry);
+static int add_entry(jackoff_container_t* container,
+	const jackoff_chunk_entry_t* entry);
+
+void jackoff_pack_container_header(const jackoff_container_info_t* info,
+	unsigned char* header)
+{
+	memset(header, 0, JACKOFF_CONTAINER_HEADER_SIZE);
+	memcpy(header, "JKOF", 4);
+	put_u16(header + 4, JACKOFF_CONTAINER_VERSION);
+	put_u16(header + 6, JACKOFF_CONTAINER_HEADER_SIZE);
+	put_u32(header + 8, info->channels);
+	put_u32(header + 12, info->sample_rate);
+	put_u32(header + 16, info->chunk_frames);
+}
+
+/*
+ * The largest payload a chunk can need, and the size of the scratch buffer
+ * that encoding and decoding use.
+ */
+size_t jackoff_chunk_bound(const jackoff_container_info_t* info) {
+	size_t raw = (size_t) info->channels * info->chunk_frames * sizeof(float);
+#ifdef HAVE_ZSTD
+	if (ZSTD_compressBound(raw) > raw)
+		return ZSTD_compressBound(raw);
+#endif
+	return raw;
+}
+
+/*
+ * Encodes frames of planar audio into a chunk payload, compressing it at
+ * the given zstd level if zstd is available and it helps. Fills in the
+ * entry's frames, size, checksum and codec, and returns the payload size.
+ */
+size_t jackoff_encode_chunk(const jackoff_container_info_t* info,
+	const float* const* channels, size_t frames, int level,
+	unsigned char* scratch, unsigned char* payload,
+	jackoff_chunk_entry_t* entry)
+{
+	size_t raw = info->channels * frames * sizeof(float);
+	unsigned char* planes;
+	uint32_t previous, bits, delta;
+	size_t c, i;
+#ifdef HAVE_ZSTD
+	size_t compressed;
+#endif
+	
+	for (c = 0; c < info->channels; c++) {
+		planes = scratch + c * frames * sizeof(float);
+		previous = 0;
+		for (i = 0; i < frames; i++) {
+			memcpy(&bits, &channels[c][i], sizeof(bits));
+			delta = bits - previous;
+			previous = bits;
+			planes[i] = (unsigned char) delta;
+			planes[frames + i] = (unsigned char) (delta >> 8);
+			planes[2 * frames + i] = (unsigned char) (delta >> 16);
+			planes[3 * frames + i] = (unsigned char) (delta >> 24);
+		}
+	}
+	
+	entry->frames = (uint32_t) frames;
+	entry->codec = JACKOFF_CODEC_STORED;
+	entry->size = (uint32_t) raw;
+	
+#ifdef HAVE_ZSTD
+	compressed = ZSTD_compress(payload, jackoff_chunk_bound(info), scratch,
+		raw, level);
+	if (!ZSTD_isError(compressed) && compressed < raw) {
+		entry->codec = JACKOFF_CODEC_ZSTD;
+		entry->size = (uint32_t) compressed;
+	}
+#else
+	(void) level;
+#endif
+	if (entry->codec == JACKOFF_CODEC_STORED)
+		memcpy(payload, scratch, raw);
+	
+	entry->checksum = jackoff_crc32c(0, payload, entry->size);
+	return entry->size;
+}
+
+void jackoff_pack_chunk_header(const jackoff_chunk_entry_t* entry,
+	unsigned char* header)
+{
+	memset(header, 0, JACKOFF_CHUNK_HEADER_SIZE);
+	memcpy(header, "CHNK", 4);
+	put_u32(header + 4, entry->frames);
+	put_u32(header + 8, entry->size);
+	header[12] = entry->codec;
+	put_u32(header + 16, entry->checksum);
+}
+
+/*
+ * Builds the index and footer that end a file. Returns a buffer of *size
+ * bytes that the caller must free, or NULL.
+ */
+unsigned char* jackoff_pack_index(const jackoff_chunk_entry_t* entries,
+	size_t count, uint64_t index_offset, uint64_t total_frames,
+	size_t* size)
+{
+	size_t index_size = JACKOFF_INDEX_HEADER_SIZE +
+		count * JACKOFF_INDEX_ENTRY_SIZE;
+	unsigned char* buffer;
+	unsigned char* p;
+	size_t i;
+	
+	buffer = calloc(1, index_size + JACKOFF_CONTAINER_FOOTER_SIZE);
+	if (!buffer)
+		return NULL;
+	
+	memcpy(buffer, "INDX", 4);
+	put_u32(buffer + 4, (uint32_t) count);
+	for (i = 0; i < count; i++) {
+		p = buffer + JACKOFF_INDEX_HEADER_SIZE + i * JACKOFF_INDEX_ENTRY_SIZE;
+		put_u64(p, entries[i].offset);
+		put_u64(p + 8, entries[i].first_frame);
+		put_u32(p + 16, entries[i].frames);
+		put_u32(p + 20, entries[i].size);
+		put_u32(p + 24, entries[i].checksum);
+		p[28] = entries[i].codec;
+	}
+	
+	p = buffer + index_size;
+	put_u64(p, index_offset);
+	put_u64(p + 8, total_frames);
+	put_u32(p + 16, jackoff_crc32c(0, buffer, index_size));
+	memcpy(p + 20, "JKOE", 4);
+	
+	*size = index_size + JACKOFF_CONTAINER_FOOTER_SIZE;
+	return buffer;
+}
+
+/*
+ * Opens a container for reading, loading its index, or rebuilding it from
+ * the chunks if the file never got one. Returns NULL on failure.
+ */
+jackoff_container_t* jackoff_open_container(const char* path) {
+	jackoff_container_t* container;
+	unsigned char header[JACKOFF_CONTAINER_HEADER_SIZE];
+	struct stat status;
+	
+	container = calloc(1, sizeof(jackoff_container_t));
+	if (!container) {
+		jackoff_warn("Failed to allocate memory for the container.");
+		return NULL;
+	}
+	
+	container->fd = open(path, O_RDONLY);
+	if (container->fd < 0) {
+		jackoff_warn("Failed to open \"%s\": %s", path, strerror(errno));
+		free(container);
+		return NULL;
+	}
+	
+	if (fstat(container->fd, &status) != 0 ||
+		read_exactly(container->fd, header, sizeof(header), 0) != 0 ||
+		memcmp(header, "JKOF", 4) != 0)
+	{
+		jackoff_warn("\"%s\" is not a jackoff container.", path);
+		goto fail;
+	}
+	if (get_u16(header + 4) != JACKOFF_CONTAINER_VERSION ||
+		get_u16(header + 6) != JACKOFF_CONTAINER_HEADER_SIZE)
+	{
+		jackoff_warn("\"%s\" uses an unknown container version.", path);
+		goto fail;
+	}
+	
+	container->info.channels = get_u32(header + 8);
+	container->info.sample_rate = get_u32(header + 12);
+	container->info.chunk_frames = get_u32(header + 16);
+	if (container->info.channels == 0 || container->info.chunk_frames == 0) {
+		jackoff_warn("\"%s\" has an invalid header.", path);
+		goto fail;
+	}
+	
+	if (read_index(container, status.st_size) == 0) {
+		container->indexed = 1;
+	} else {
+		jackoff_warn("\"%s\" has no valid index; reading its chunks in "
+			"order.", path);
+		if (walk_chunks(container, status.st_size) != 0)
+			goto fail;
+	}
+	
+	return container;
+	
+	fail:
+	jackoff_close_container(container);
+	return NULL;
+}
+
+void jackoff_close_container(jackoff_container_t* container) {
+	if (container->fd >= 0)
+		close(container->fd);
+	free(container->entries);
+	free(container);
+}
+
+/*
+ * Reads a chunk's payload. Safe to call from several threads at once.
+ */
+int jackoff_read_chunk(jackoff_container_t* container, size_t index,
+	unsigned char* payload)
+{
+	const jackoff_chunk_entry_t* entry = &container->entries[index];
+	
+	return read_exactly(container->fd, payload, entry->size,
+		(off_t) (entry->offset + JACKOFF_CHUNK_HEADER_SIZE));
+}
+
+/*
+ * Checks and decodes a chunk payload into planar buffers of at least
+ * entry->frames frames each. Returns 0 on success.
+ */
+int jackoff_decode_chunk(const jackoff_container_info_t* info,
+	const jackoff_chunk_entry_t* entry, const unsigned char* payload,
+	unsigned char* scratch, float* const* channels)
+{
+	size_t frames = entry->frames;
+	size_t raw = info->channels * frames * sizeof(float);
+	const unsigned char* planes;
+	const unsigned char* source;
+	uint32_t bits, delta;
+	size_t c, i;
+#ifdef HAVE_ZSTD
+	size_t decompressed;
+#endif
+	
+	if (jackoff_crc32c(0, payload, entry->size) != entry->checksum) {
+		jackoff_warn("Chunk at frame %llu is corrupt (checksum mismatch).",
+			(unsigned long long) entry->first_frame);
+		return -1;
+	}
+	
+	switch (entry->codec) {
+		case JACKOFF_CODEC_STORED:
+			if (entry->size != raw)
+				return -1;
+			source = payload;
+			break;
+#ifdef HAVE_ZSTD
+		case JACKOFF_CODEC_ZSTD:
+			decompressed = ZSTD_decompress(scratch, raw, payload, entry->size);
+			if (ZSTD_isError(decompressed) || decompressed != raw) {
+				jackoff_warn("Chunk at frame %llu failed to decompress.",
+					(unsigned long long) entry->first_frame);
+				return -1;
+			}
+			source = scratch;
+			break;
+#endif
+		default:
+			jackoff_warn("Chunk at frame %llu uses an unsupported codec (%d).",
+				(unsigned long long) entry->first_frame, entry->codec);
+			return -1;
+	}
+	
+	for (c = 0; c < info->channels; c++) {
+		planes = source + c * frames * sizeof(float);
+		bits = 0;
+		for (i = 0; i < frames; i++) {
+			delta = (uint32_t) planes[i] |
+				((uint32_t) planes[frames + i] << 8) |
+				((uint32_t) planes[2 * frames + i] << 16) |
+				((uint32_t) planes[3 * frames + i] << 24);
+			bits += delta;
+			memcpy(&channels[c][i], &bits, sizeof(bits));
+		}
+	}
+	
+	return 0;
+}
+
+static void put_u16(unsigned char* p, uint16_t value) {
+	p[0] = (unsigned char) value;
+	p[1] = (unsigned char) (value >> 8);
+}
+
+static void put_u32(unsigned char* p, uint32_t value) {
+	put_u16(p, (uint16_t) value);
+	put_u16(p + 2, (uint16_t) (value >> 16));
+}
+
+static void put_u64(unsigned char* p, uint64_t value) {
+	put_u32(p, (uint32_t) value);
+	put_u32(p + 4, (uint32_t) (value >> 32));
+}
+
+static uint16_t get_u16(const unsigned char* p) {
+	return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+	return (uint32_t) get_u16(p) | ((uint32_t) get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+	return (uint64_t) get_u32(p) | ((uint64_t) get_u32(p + 4) << 32);
+}
+
+static int read_exactly(int fd, void* buffer, size_t size, off_t offset) {
+	ssize_t result;
+	
+	while (size > 0) {
+		result = pread(fd, buffer, size, offset);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return -1;
+		buffer = (char*) buffer + result;
+		size -= (size_t) result;
+		offset += result;
+	}
+	return 0;
+}
+
+static int read_index(jackoff_container_t* container, off_t file_size) {
+	unsigned char footer[JACKOFF_CONTAINER_FOOTER_SIZE];
+	unsigned char* index;
+	unsigned char* p;
+	uint64_t index_offset;
+	size_t index_size;
+	size_t count, i;
+	jackoff_chunk_entry_t entry;
+	
+	if (file_size < JACKOFF_CONTAINER_HEADER_SIZE +
+		JACKOFF_CONTAINER_FOOTER_SIZE)
+		return -1;
+	if (read_exactly(container->fd, footer, sizeof(footer),
+		file_size - JACKOFF_CONTAINER_FOOTER_SIZE) != 0 ||
+		memcmp(footer + 20, "JKOE", 4) != 0)
+		return -1;
+	
+	index_offset = get_u64(footer);
+	if (index_offset < JACKOFF_CONTAINER_HEADER_SIZE ||
+		index_offset + JACKOFF_INDEX_HEADER_SIZE +
+		JACKOFF_CONTAINER_FOOTER_SIZE > (uint64_t) file_size)
+		return -1;
+	index_size = (size_t) (file_size - JACKOFF_CONTAINER_FOOTER_SIZE -
+		index_offset);
+	
+	index = malloc(index_size);
+	if (!index)
+		return -1;
+	if (read_exactly(container->fd, index, index_size,
+		(off_t) index_offset) != 0 || memcmp(index, "INDX", 4) != 0 ||
+		jackoff_crc32c(0, index, index_size) != get_u32(footer + 16))
+	{
+		free(index);
+		return -1;
+	}
+	
+	count = get_u32(index + 4);
+	if (JACKOFF_INDEX_HEADER_SIZE + count * JACKOFF_INDEX_ENTRY_SIZE !=
+		index_size)
+	{
+		free(index);
+		return -1;
+	}
+	
+	for (i = 0; i < count; i++) {
+		p = index + JACKOFF_INDEX_HEADER_SIZE + i * JACKOFF_INDEX_ENTRY_SIZE;
+		entry.offset = get_u64(p);
+		entry.first_frame = get_u64(p + 8);
+		entry.frames = get_u32(p + 16);
+		entry.size = get_u32(p + 20);
+		entry.checksum = get_u32(p + 24);
+		entry.codec = p[28];
+		if (!entry_fits(&container->info, &entry) ||
+			entry.offset + JACKOFF_CHUNK_HEADER_SIZE + entry.size >
+			index_offset || add_entry(container, &entry) != 0)
+		{
+			free(index);
+			container->count = 0;
+			return -1;
+		}
+	}
+	
+	free(index);
+	container->total_frames = get_u64(footer + 8);
+	return 0;
+}
+
+static int walk_chunks(jackoff_container_t* container, off_t file_size) {
+	unsigned char header[JACKOFF_CHUNK_HEADER_SIZE];
+	jackoff_chunk_entry_t entry;
+	uint64_t offset = JACKOFF_CONTAINER_HEADER_SIZE;
+	uint64_t frame = 0;
+	
+	while (offset + JACKOFF_CHUNK_HEADER_SIZE <= (uint64_t) file_size) {
+		if (read_exactly(container->fd, header, sizeof(header),
+			(off_t) offset) != 0 || memcmp(header, "CHNK", 4) != 0)
+			break;
+		
+		entry.offset = offset;
+		entry.first_frame = frame;
+		entry.frames = get_u32(header + 4);
+		entry.size = get_u32(header + 8);
+		entry.codec = header[12];
+		entry.checksum = get_u32(header + 16);
+		if (!entry_fits(&container->info, &entry))
+			break; // a damaged header; nothing after it can be trusted
+		if (offset + JACKOFF_CHUNK_HEADER_SIZE + entry.size >
+			(uint64_t) file_size)
+			break; // cut off mid-chunk
+		
+		if (add_entry(container, &entry) != 0)
+			return -1;
+		offset += JACKOFF_CHUNK_HEADER_SIZE + entry.size;
+		frame += entry.frames;
+	}
+	
+	container->total_frames = frame;
+	return 0;
+}
+
+/*
+ * Checks that a chunk's payload fits the buffers jackoff_chunk_bound sizes,
+ * before anything is read into them: the checksum is only checked after.
+ */
+static int entry_fits(const jackoff_container_info_t* info,
+	const jackoff_chunk_entry_t* entry)
+{
+	if (entry->frames > info->chunk_frames ||
+		entry->size > jackoff_chunk_bound(info))
+		return 0;
+	if (entry->codec == JACKOFF_CODEC_STORED &&
+		entry->size != (size_t) info->channels * entry->frames *
+		sizeof(float))
+		return 0;
+	return 1;
+}
+
+static int add_entry(jackoff_container_t* container,
+	const jackoff_chunk_entry_t* entry)
+{
+	jackoff_chunk_entry_t* entries;
+	
+	// capacity doubles from 16, so it runs out at each power of two
+	if (container->count == 0 || (container->count >= 16 &&
+		(container->count & (container->count - 1)) == 0))
+	{
+		entries = realloc(container->entries, (container->count ?
+			container->count * 2 : 16) * sizeof(jackoff_chunk_entry_t));
+		if (!entries)
+			return -1;
+		container->entries = entries;
+	}
+	container->entries[container->count++] = *entry;
+	return 0;
+}
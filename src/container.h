@@ -0,0 +1,104 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_CONTAINER_H_
+#define _JACKOFF_CONTAINER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * The native jackoff container: float audio in independently compressed
+ * chunks of a fixed number of frames. All integers are little-endian.
+ *
+ *   header   "JKOF", u16 version, u16 header size, u32 channels,
+ *            u32 sample rate, u32 frames per chunk, 12 reserved bytes
+ *   chunks   "CHNK", u32 frames, u32 payload size, u8 codec, 3 reserved,
+ *            u32 CRC-32C of the payload; then the payload
+ *   index    "INDX", u32 chunk count; then per chunk: u64 file offset,
+ *            u64 first frame, u32 frames, u32 payload size, u32 CRC-32C,
+ *            u8 codec, 3 reserved
+ *   footer   u64 index offset, u64 total frames, u32 CRC-32C of the
+ *            index, "JKOE"
+ *
+ * A payload holds each channel's samples as the differences between
+ * successive bit patterns, split into four planes by byte, which leaves
+ * long runs for the compressor. A file without an index (say, from a
+ * recording that was killed) can still be read by walking the chunks.
+ */
+
+#define JACKOFF_CONTAINER_VERSION 1
+#define JACKOFF_CONTAINER_HEADER_SIZE 32
+#define JACKOFF_CHUNK_HEADER_SIZE 20
+#define JACKOFF_INDEX_HEADER_SIZE 8
+#define JACKOFF_INDEX_ENTRY_SIZE 32
+#define JACKOFF_CONTAINER_FOOTER_SIZE 24
+#define JACKOFF_DEFAULT_CHUNK_FRAMES 16384
+
+typedef enum {
+	JACKOFF_CODEC_STORED = 0, // no compression after the transform
+	JACKOFF_CODEC_ZSTD = 1
+} jackoff_codec_t;
+
+typedef struct {
+	uint32_t channels;
+	uint32_t sample_rate;
+	uint32_t chunk_frames;
+} jackoff_container_info_t;
+
+typedef struct {
+	uint64_t offset; // of the chunk header
+	uint64_t first_frame;
+	uint32_t frames;
+	uint32_t size; // of the payload
+	uint32_t checksum;
+	uint8_t codec;
+} jackoff_chunk_entry_t;
+
+typedef struct {
+	int fd;
+	jackoff_container_info_t info;
+	jackoff_chunk_entry_t* entries;
+	size_t count;
+	uint64_t total_frames;
+	int indexed; // 0 if the chunks had to be walked
+} jackoff_container_t;
+
+void jackoff_pack_container_header(const jackoff_container_info_t* info,
+	unsigned char* header);
+size_t jackoff_chunk_bound(const jackoff_container_info_t* info);
+size_t jackoff_encode_chunk(const jackoff_container_info_t* info,
+	const float* const* channels, size_t frames, int level,
+	unsigned char* scratch, unsigned char* payload,
+	jackoff_chunk_entry_t* entry);
+void jackoff_pack_chunk_header(const jackoff_chunk_entry_t* entry,
+	unsigned char* header);
+unsigned char* jackoff_pack_index(const jackoff_chunk_entry_t* entries,
+	size_t count, uint64_t index_offset, uint64_t total_frames,
+	size_t* size);
+
+jackoff_container_t* jackoff_open_container(const char* path);
+void jackoff_close_container(jackoff_container_t* container);
+int jackoff_read_chunk(jackoff_container_t* container, size_t index,
+	unsigned char* payload);
+int jackoff_decode_chunk(const jackoff_container_info_t* info,
+	const jackoff_chunk_entry_t* entry, const unsigned char* payload,
+	unsigned char* scratch, float* const* channels);
+
+#endif
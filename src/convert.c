@@ -0,0 +1,236 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "convert.h"
+
+#include <math.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void convert(jackoff_converter_t* converter, const float* input,
+	size_t samples, short* short_output, int* int_output);
+static inline uint32_t next_random(uint32_t* state);
+static inline float random_to_unit(uint32_t bits);
+
+void jackoff_init_converter(jackoff_converter_t* converter, int bits,
+	jackoff_dither_t dither, uint32_t seed)
+{
+	uint32_t x;
+	int g, lane;
+	
+	converter->bits = bits;
+	if (dither == JACKOFF_DITHER_DEFAULT)
+		dither = (bits <= 16) ? JACKOFF_DITHER_TPDF : JACKOFF_DITHER_NONE;
+	converter->dither = dither;
+	
+	// Spread the seed over the generators; xorshift must never be seeded
+	// with zero.
+	for (g = 0; g < 2; g++) {
+		for (lane = 0; lane < JACKOFF_DITHER_LANES; lane++) {
+			x = seed + 0x9E3779B9u * (uint32_t) (g * JACKOFF_DITHER_LANES +
+				lane + 1);
+			x = (x ^ (x >> 16)) * 0x85EBCA6Bu;
+			x = (x ^ (x >> 13)) * 0xC2B2AE35u;
+			x ^= x >> 16;
+			converter->state[g][lane] = x ? x : 1;
+		}
+	}
+}
+
+void jackoff_convert_to_short(jackoff_converter_t* converter,
+	const float* input, size_t samples, short* output)
+{
+	convert(converter, input, samples, output, NULL);
+}
+
+/*
+ * Produces 24-bit samples left-justified in 32-bit integers, which is what
+ * sf_writef_int expects for 24-bit files.
+ */
+void jackoff_convert_to_int(jackoff_converter_t* converter,
+	const float* input, size_t samples, int* output)
+{
+	convert(converter, input, samples, NULL, output);
+}
+
+static void convert(jackoff_converter_t* converter, const float* input,
+	size_t samples, short* short_output, int* int_output)
+{
+	const float scale = (float) (1L << (converter->bits - 1));
+	const float low = -scale;
+	const float high = scale - 1.0f;
+	const int shift = 32 - converter->bits;
+	const int dither = (converter->dither == JACKOFF_DITHER_TPDF);
+	size_t i = 0;
+	int lane;
+	float value;
+	long rounded;
+	
+#if defined(__AVX2__)
+	__m256i state0 = _mm256_loadu_si256((__m256i*) converter->state[0]);
+	__m256i state1 = _mm256_loadu_si256((__m256i*) converter->state[1]);
+	__m256i exponent = _mm256_set1_epi32(0x3F800000);
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 v_scale = _mm256_set1_ps(scale);
+	__m256 v_low = _mm256_set1_ps(low);
+	__m256 v_high = _mm256_set1_ps(high);
+	__m256 v, u0, u1;
+	__m256i q;
+	
+	for (; i + JACKOFF_DITHER_LANES <= samples; i += JACKOFF_DITHER_LANES) {
+		v = _mm256_mul_ps(_mm256_loadu_ps(input + i), v_scale);
+		if (dither) {
+			state0 = _mm256_xor_si256(state0, _mm256_slli_epi32(state0, 13));
+			state0 = _mm256_xor_si256(state0, _mm256_srli_epi32(state0, 17));
+			state0 = _mm256_xor_si256(state0, _mm256_slli_epi32(state0, 5));
+			state1 = _mm256_xor_si256(state1, _mm256_slli_epi32(state1, 13));
+			state1 = _mm256_xor_si256(state1, _mm256_srli_epi32(state1, 17));
+			state1 = _mm256_xor_si256(state1, _mm256_slli_epi32(state1, 5));
+			u0 = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(
+				_mm256_srli_epi32(state0, 9), exponent)), one);
+			u1 = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(
+				_mm256_srli_epi32(state1, 9), exponent)), one);
+			v = _mm256_add_ps(v, _mm256_sub_ps(u0, u1));
+		}
+		v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q)); // NaN to 0
+		v = _mm256_min_ps(_mm256_max_ps(v, v_low), v_high);
+		q = _mm256_cvtps_epi32(v);
+		
+		if (short_output) {
+			_mm_storeu_si128((__m128i*) (short_output + i), _mm_packs_epi32(
+				_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1)));
+		} else {
+			_mm256_storeu_si256((__m256i*) (int_output + i),
+				_mm256_slli_epi32(q, shift));
+		}
+	}
+	
+	_mm256_storeu_si256((__m256i*) converter->state[0], state0);
+	_mm256_storeu_si256((__m256i*) converter->state[1], state1);
+#elif defined(__SSE2__)
+	__m128i state0[2], state1[2];
+	__m128i exponent = _mm_set1_epi32(0x3F800000);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 v_scale = _mm_set1_ps(scale);
+	__m128 v_low = _mm_set1_ps(low);
+	__m128 v_high = _mm_set1_ps(high);
+	__m128 v[2], u0, u1;
+	__m128i q[2];
+	int h;
+	
+	for (h = 0; h < 2; h++) {
+		state0[h] = _mm_loadu_si128((__m128i*) (converter->state[0] + 4 * h));
+		state1[h] = _mm_loadu_si128((__m128i*) (converter->state[1] + 4 * h));
+	}
+	
+	for (; i + JACKOFF_DITHER_LANES <= samples; i += JACKOFF_DITHER_LANES) {
+		for (h = 0; h < 2; h++) {
+			v[h] = _mm_mul_ps(_mm_loadu_ps(input + i + 4 * h), v_scale);
+			if (dither) {
+				state0[h] = _mm_xor_si128(state0[h],
+					_mm_slli_epi32(state0[h], 13));
+				state0[h] = _mm_xor_si128(state0[h],
+					_mm_srli_epi32(state0[h], 17));
+				state0[h] = _mm_xor_si128(state0[h],
+					_mm_slli_epi32(state0[h], 5));
+				state1[h] = _mm_xor_si128(state1[h],
+					_mm_slli_epi32(state1[h], 13));
+				state1[h] = _mm_xor_si128(state1[h],
+					_mm_srli_epi32(state1[h], 17));
+				state1[h] = _mm_xor_si128(state1[h],
+					_mm_slli_epi32(state1[h], 5));
+				u0 = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(
+					_mm_srli_epi32(state0[h], 9), exponent)), one);
+				u1 = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(
+					_mm_srli_epi32(state1[h], 9), exponent)), one);
+				v[h] = _mm_add_ps(v[h], _mm_sub_ps(u0, u1));
+			}
+			v[h] = _mm_and_ps(v[h], _mm_cmpord_ps(v[h], v[h])); // NaN to 0
+			v[h] = _mm_min_ps(_mm_max_ps(v[h], v_low), v_high);
+			q[h] = _mm_cvtps_epi32(v[h]);
+		}
+		
+		if (short_output) {
+			_mm_storeu_si128((__m128i*) (short_output + i),
+				_mm_packs_epi32(q[0], q[1]));
+		} else {
+			_mm_storeu_si128((__m128i*) (int_output + i),
+				_mm_slli_epi32(q[0], shift));
+			_mm_storeu_si128((__m128i*) (int_output + i + 4),
+				_mm_slli_epi32(q[1], shift));
+		}
+	}
+	
+	for (h = 0; h < 2; h++) {
+		_mm_storeu_si128((__m128i*) (converter->state[0] + 4 * h), state0[h]);
+		_mm_storeu_si128((__m128i*) (converter->state[1] + 4 * h), state1[h]);
+	}
+#endif
+	
+	// Whatever the vector kernels didn't cover, one lane at a time.
+	for (lane = 0; i < samples; i++) {
+		value = input[i] * scale;
+		if (dither) {
+			value += random_to_unit(next_random(&converter->state[0][lane])) -
+				random_to_unit(next_random(&converter->state[1][lane]));
+		}
+		if (isnan(value))
+			value = 0.0f;
+		else if (value < low)
+			value = low;
+		else if (value > high)
+			value = high;
+		rounded = lrintf(value);
+		
+		if (short_output)
+			short_output[i] = (short) rounded;
+		else
+			int_output[i] = (int) (rounded << shift);
+		
+		if (++lane == JACKOFF_DITHER_LANES)
+			lane = 0;
+	}
+}
+
+static inline uint32_t next_random(uint32_t* state) {
+	uint32_t x = *state;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+/*
+ * Turns random bits into a float in [0, 1) by filling the mantissa of a
+ * number in [1, 2).
+ */
+static inline float random_to_unit(uint32_t bits) {
+	union {
+		uint32_t i;
+		float f;
+	} u;
+	
+	u.i = (bits >> 9) | 0x3F800000u;
+	return u.f - 1.0f;
+}
@@ -0,0 +1,54 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_CONVERT_H_
+#define _JACKOFF_CONVERT_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define JACKOFF_DITHER_LANES 8
+
+typedef enum {
+	JACKOFF_DITHER_DEFAULT = -1, // TPDF at 16 bits, plain rounding above
+	JACKOFF_DITHER_NONE = 0,
+	JACKOFF_DITHER_TPDF
+} jackoff_dither_t;
+
+/*
+ * Converts float samples to integer PCM: scale, optional triangular (TPDF)
+ * dither of +/-1 LSB, round to nearest, clip. Infinities clip to full
+ * scale and NaN becomes 0. The dither noise comes from JACKOFF_DITHER_LANES
+ * independent xorshift generators, so output is reproducible from the seed
+ * whichever kernel the build uses.
+ */
+typedef struct {
+	int bits;
+	jackoff_dither_t dither;
+	uint32_t state[2][JACKOFF_DITHER_LANES];
+} jackoff_converter_t;
+
+void jackoff_init_converter(jackoff_converter_t* converter, int bits,
+	jackoff_dither_t dither, uint32_t seed);
+void jackoff_convert_to_short(jackoff_converter_t* converter,
+	const float* input, size_t samples, short* output);
+void jackoff_convert_to_int(jackoff_converter_t* converter,
+	const float* input, size_t samples, int* output);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u
+
+#if defined(__SSE4_2__)
+
+uint32_t jackoff_crc32c(uint32_t crc, const void* data, size_t length) {
+	const unsigned char* bytes = data;
+	uint64_t value;
+	uint64_t crc64;
+	
+	crc = ~crc;
+	while (length > 0 && ((uintptr_t) bytes & 7)) {
+		crc = _mm_crc32_u8(crc, *bytes++);
+		length--;
+	}
+	
+	crc64 = crc;
+	for (; length >= 8; length -= 8, bytes += 8) {
+		memcpy(&value, bytes, sizeof(value));
+		crc64 = _mm_crc32_u64(crc64, value);
+	}
+	crc = (uint32_t) crc64;
+	
+	while (length-- > 0)
+		crc = _mm_crc32_u8(crc, *bytes++);
+	return ~crc;
+}
+
+#else
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void build_table() {
+	uint32_t crc;
+	int i, j;
+	
+	for (i = 0; i < 256; i++) {
+		crc = (uint32_t) i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^
+				table[0][table[j - 1][i] & 0xFF];
+	}
+}
+
+/*
+ * Slicing-by-8: eight table lookups per eight bytes instead of one per
+ * byte.
+ */
+uint32_t jackoff_crc32c(uint32_t crc, const void* data, size_t length) {
+	const unsigned char* bytes = data;
+	
+	pthread_once(&table_once, build_table);
+	
+	crc = ~crc;
+	for (; length >= 8; length -= 8, bytes += 8) {
+		crc ^= (uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) |
+			((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+		crc = table[7][crc & 0xFF] ^ table[6][(crc >> 8) & 0xFF] ^
+			table[5][(crc >> 16) & 0xFF] ^ table[4][crc >> 24] ^
+			table[3][bytes[4]] ^ table[2][bytes[5]] ^
+			table[1][bytes[6]] ^ table[0][bytes[7]];
+	}
+	
+	while (length-- > 0)
+		crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xFF];
+	return ~crc;
+}
+
+#endif
+
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vector);
+static void gf2_square(uint32_t* square, const uint32_t* matrix);
+
+/*
+ * The checksum of two runs of bytes one after the other, from the checksum
+ * of each and the length of the second, without the bytes themselves. This
+ * is zlib's method: appending n zero bits to a CRC is a linear operator,
+ * applied here by repeated squaring.
+ */
+uint32_t jackoff_crc32c_combine(uint32_t first, uint32_t second,
+	uint64_t second_length)
+{
+	uint32_t even[32]; // operator for an even power of two zero bits
+	uint32_t odd[32]; // and for an odd one
+	uint32_t row;
+	int n;
+	
+	if (second_length == 0)
+		return first;
+	
+	// One zero bit.
+	odd[0] = CRC32C_POLYNOMIAL;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_square(even, odd); // two zero bits
+	gf2_square(odd, even); // four: one zero byte
+	
+	// Apply one zero byte, two, four and so on, wherever second_length has
+	// a bit set.
+	do {
+		gf2_square(even, odd);
+		if (second_length & 1)
+			first = gf2_times(even, first);
+		second_length >>= 1;
+		if (second_length == 0)
+			break;
+		
+		gf2_square(odd, even);
+		if (second_length & 1)
+			first = gf2_times(odd, first);
+		second_length >>= 1;
+	} while (second_length != 0);
+	
+	return first ^ second;
+}
+
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vector) {
+	uint32_t sum = 0;
+	
+	for (; vector; vector >>= 1, matrix++) {
+		if (vector & 1)
+			sum ^= *matrix;
+	}
+	return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* matrix) {
+	int n;
+	
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(matrix, matrix[n]);
+}
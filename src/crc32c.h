@@ -0,0 +1,34 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_CRC32C_H_
+#define _JACKOFF_CRC32C_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI and ext4. Pass 0 to start a new
+ * checksum, or a previous result to continue one.
+ */
+uint32_t jackoff_crc32c(uint32_t crc, const void* data, size_t length);
+uint32_t jackoff_crc32c_combine(uint32_t first, uint32_t second,
+	uint64_t second_length);
+
+#endif
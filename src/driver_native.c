@@ -0,0 +1,553 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "driver_native.h"
+#include "container.h"
+#include "threadpool.h"
+#include "loudness.h"
+#include "peaks.h"
+#include "manifest.h"
+#include "chain.h"
+#include "metrics.h"
+#include "realtime.h"
+#include "faults.h"
+#include "logging.h"
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// zstd's fastest level; higher ones cost far more time than they save here
+#define COMPRESSION_LEVEL 1
+
+// At most this many chunks of one recording are compressed at once. Each
+// slot holds three chunk-sized buffers, so a session mustn't grow with the
+// CPU count; at level 1, a few threads keep up with any channel count.
+#define MAX_CHUNKS_IN_FLIGHT 4
+
+typedef enum {
+	SLOT_FREE,
+	SLOT_BUSY, // being compressed by the pool
+	SLOT_DONE // compressed, waiting to be written
+} slot_state_t;
+
+struct native_session;
+
+/*
+ * A chunk's worth of audio on its way to the file. Slots are filled, then
+ * compressed by the pool, then written, always in the same circular order,
+ * so chunks reach the file in sequence however the pool finishes them.
+ */
+typedef struct chunk_slot {
+	struct native_session* session;
+	float* samples; // planar: each channel's chunk_frames in turn
+	float** channels;
+	unsigned char* scratch;
+	unsigned char* payload;
+	jackoff_chunk_entry_t entry;
+	slot_state_t state; // guarded by the session's lock
+} chunk_slot_t;
+
+typedef struct native_encoder {
+	struct jackoff_encoder encoder;
+	const jackoff_settings_t* settings;
+} native_encoder_t;
+
+typedef struct native_session {
+	struct jackoff_session session;
+	int fd;
+	jackoff_chain_t* chain;
+	jackoff_container_info_t info;
+	jackoff_loudness_t* loudness; // NULL if not measuring
+	jackoff_peaks_t* peaks; // NULL if there's no overview
+	jackoff_manifest_t* manifest; // NULL if not checksumming
+	
+	chunk_slot_t* slots;
+	size_t slot_count;
+	size_t filling; // slot receiving audio
+	size_t fill_frames;
+	size_t oldest; // next slot to write
+	size_t pending; // slots submitted and not yet written
+	size_t busy; // slots the pool hasn't finished; guarded by the lock
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	
+	jackoff_chunk_entry_t* entries;
+	size_t entry_count;
+	size_t entry_capacity;
+	uint64_t offset; // bytes in the file
+	uint64_t frames; // frames handed to chunks
+} native_session_t;
+
+/* One pool compresses for every native recording in the process. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static jackoff_thread_pool_t* pool = NULL;
+static size_t pool_users = 0;
+static size_t pool_threads = 0; // 0 for one per CPU
+static size_t pool_size = 0; // threads the pool was started with
+
+static jackoff_session_t* jackoff_native_open(jackoff_client_t* client,
+	jackoff_encoder_t* encoder, const char* file_path);
+static int jackoff_native_close(const jackoff_session_t* session);
+static long jackoff_native_write(const jackoff_session_t* session);
+static void jackoff_native_shutdown(const jackoff_encoder_t* encoder);
+
+static int allocate_slots(native_session_t* session);
+static void release_session(native_session_t* session);
+static int submit_chunk(native_session_t* session);
+static void compress_chunk(void* arg);
+static int write_chunks(native_session_t* session, size_t keep);
+static void wait_for_pool(native_session_t* session);
+static int write_all(native_session_t* session, const void* data,
+	size_t size);
+
+jackoff_encoder_t* jackoff_create_native_encoder(jackoff_client_t* client,
+	jackoff_format_t* format, const jackoff_settings_t* settings)
+{
+	native_encoder_t* encoder;
+	pthread_attr_t attr;
+	
+	encoder = calloc(1, sizeof(native_encoder_t));
+	if (!encoder) {
+		jackoff_error("Failed to allocate memory for native encoder.");
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&pool_lock);
+	if (!pool) {
+		// The workers compress under the normal scheduler, on any of the
+		// process's CPUs. With the writers' realtime priority they could
+		// starve the very writers they work for.
+		jackoff_init_thread_attr(&attr);
+		pool_size = pool_threads ? pool_threads :
+			jackoff_available_cpus(&attr);
+		pool = jackoff_create_thread_pool(pool_size, &attr);
+		pthread_attr_destroy(&attr);
+		if (pool)
+			pool_size = jackoff_thread_pool_size(pool);
+	}
+	if (pool)
+		pool_users++;
+	pthread_mutex_unlock(&pool_lock);
+	if (!pool) {
+		free(encoder);
+		jackoff_warn("Failed to start the compression threads.");
+		return NULL;
+	}
+	
+#ifndef HAVE_ZSTD
+	jackoff_warn("Built without zstd; native files will not be compressed.");
+#endif
+	
+	encoder->settings = settings;
+	
+	encoder->encoder.open = jackoff_native_open;
+	encoder->encoder.close = jackoff_native_close;
+	encoder->encoder.write = jackoff_native_write;
+	encoder->encoder.shutdown = jackoff_native_shutdown;
+	
+	return (jackoff_encoder_t*) encoder;
+}
+
+/*
+ * Sets how many threads compress native chunks. Takes effect if it is
+ * called before the first native encoder is created; 0 means one per CPU.
+ */
+void jackoff_set_compress_threads(size_t threads) {
+	pool_threads = threads;
+}
+
+
+static jackoff_session_t* jackoff_native_open(jackoff_client_t* client,
+	jackoff_encoder_t* base_encoder, const char* file_path)
+{
+	native_encoder_t* encoder = (native_encoder_t*) base_encoder;
+	native_session_t* session;
+	unsigned char header[JACKOFF_CONTAINER_HEADER_SIZE];
+	
+	session = calloc(1, sizeof(native_session_t));
+	if (!session) {
+		jackoff_error("Failed to allocate a native session.");
+		return NULL;
+	}
+	session->fd = -1;
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->finished, NULL);
+	
+	session->chain = jackoff_create_chain(client, encoder->settings);
+	if (!session->chain) {
+		release_session(session);
+		free(session);
+		jackoff_warn("Failed to set up the signal chain.");
+		return NULL;
+	}
+	
+	session->info.channels = (uint32_t) jackoff_chain_channels(session->chain);
+	session->info.sample_rate = jackoff_chain_sample_rate(session->chain);
+	session->info.chunk_frames = JACKOFF_DEFAULT_CHUNK_FRAMES;
+	
+	// One slot per compression thread keeps them all busy, up to a limit,
+	// plus the one being filled.
+	session->slot_count = ((pool_size < MAX_CHUNKS_IN_FLIGHT) ? pool_size :
+		MAX_CHUNKS_IN_FLIGHT) + 1;
+	if (allocate_slots(session) != 0) {
+		release_session(session);
+		free(session);
+		jackoff_warn("Failed to allocate the chunk buffers.");
+		return NULL;
+	}
+	
+	// A manifest reads back any block it couldn't take in passing, such as
+	// after a failed write, so it needs the file readable.
+	session->fd = open(file_path, (encoder->settings->manifest ? O_RDWR :
+		O_WRONLY) | O_CREAT | O_TRUNC, 0666);
+	if (session->fd < 0) {
+		jackoff_warn("Failed to open output file \"%s\": %s", file_path,
+			strerror(errno));
+		release_session(session);
+		free(session);
+		return NULL;
+	}
+	
+	if (encoder->settings->manifest) {
+		session->manifest = jackoff_create_manifest(file_path);
+		if (!session->manifest)
+			jackoff_warn("Recording \"%s\" without a manifest.", file_path);
+	}
+	
+	jackoff_pack_container_header(&session->info, header);
+	if (write_all(session, header, sizeof(header)) != 0) {
+		jackoff_warn("Failed to write the file header: %s", strerror(errno));
+		release_session(session);
+		free(session);
+		return NULL;
+	}
+	
+	if (encoder->settings->loudness) {
+		session->loudness = jackoff_create_loudness(session->info.channels,
+			session->info.sample_rate);
+		if (!session->loudness)
+			jackoff_warn("Recording \"%s\" without measuring loudness.",
+				file_path);
+	}
+	
+	if (encoder->settings->peaks) {
+		session->peaks = jackoff_create_peaks(file_path,
+			session->info.channels, session->info.sample_rate);
+		if (!session->peaks)
+			jackoff_warn("Recording \"%s\" without an overview.", file_path);
+	}
+	
+	jackoff_debug("Created a new native session recording to \"%s\" with "
+		"%lu chunk buffers.", file_path, session->slot_count);
+	return (jackoff_session_t*) session;
+}
+
+static int jackoff_native_close(const jackoff_session_t* base_session) {
+	native_session_t* session = (native_session_t*) base_session;
+	unsigned char* index;
+	size_t index_size;
+	int result = 0;
+	
+	if (session->fill_frames > 0 && submit_chunk(session) != 0)
+		result = -1;
+	if (result == 0 && write_chunks(session, 0) != 0)
+		result = -1;
+	
+	if (result == 0) {
+		index = jackoff_pack_index(session->entries, session->entry_count,
+			session->offset, session->frames, &index_size);
+		if (!index || write_all(session, index, index_size) != 0) {
+			jackoff_warn("Failed to write the chunk index: %s",
+				index ? strerror(errno) : "out of memory");
+			result = -1;
+		}
+		free(index);
+	}
+	
+	// The file is only ever appended to, so the manifest has it all.
+	if (session->manifest &&
+		jackoff_finish_manifest(session->manifest, session->fd) != 0)
+		result = -1;
+	session->manifest = NULL;
+	
+	if (close(session->fd) != 0) {
+		jackoff_warn("Failed to close output file: %s", strerror(errno));
+		result = -1;
+	}
+	session->fd = -1;
+	
+	if (session->loudness && jackoff_finish_loudness(session->loudness,
+		base_session->file_path) != 0)
+		result = -1;
+	session->loudness = NULL;
+	if (session->peaks && jackoff_close_peaks(session->peaks) != 0)
+		result = -1;
+	session->peaks = NULL;
+	
+	release_session(session);
+	return result;
+}
+
+static long jackoff_native_write(const jackoff_session_t* base_session) {
+	native_session_t* session = (native_session_t*) base_session;
+	
+	jack_default_audio_sample_t** channel_buffers;
+	chunk_slot_t* slot;
+	size_t frames, copied, count;
+	size_t c;
+	long result;
+	
+	if (write_chunks(session, session->slot_count) != 0)
+		return -1;
+	
+	result = jackoff_chain_pull(session->chain, &channel_buffers, &frames);
+	if (result <= 0 || frames == 0)
+		return result;
+	
+	if (session->loudness)
+		jackoff_measure_loudness(session->loudness, channel_buffers, frames);
+	if (session->peaks &&
+		jackoff_add_peaks(session->peaks, channel_buffers, frames) != 0)
+	{
+		jackoff_close_peaks(session->peaks);
+		session->peaks = NULL;
+	}
+	
+	for (copied = 0; copied < frames; copied += count) {
+		slot = &session->slots[session->filling];
+		count = session->info.chunk_frames - session->fill_frames;
+		if (count > frames - copied)
+			count = frames - copied;
+		
+		for (c = 0; c < session->info.channels; c++) {
+			memcpy(slot->channels[c] + session->fill_frames,
+				channel_buffers[c] + copied, count * sizeof(float));
+		}
+		
+		session->fill_frames += count;
+		if (session->fill_frames == session->info.chunk_frames &&
+			submit_chunk(session) != 0)
+			return -1;
+	}
+	
+	return result;
+}
+
+static void jackoff_native_shutdown(const jackoff_encoder_t* encoder) {
+	pthread_mutex_lock(&pool_lock);
+	if (--pool_users == 0) {
+		jackoff_destroy_thread_pool(pool);
+		pool = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int allocate_slots(native_session_t* session) {
+	chunk_slot_t* slot;
+	size_t channels = session->info.channels;
+	size_t frames = session->info.chunk_frames;
+	size_t bound = jackoff_chunk_bound(&session->info);
+	size_t i, c;
+	
+	session->slots = calloc(session->slot_count, sizeof(chunk_slot_t));
+	if (!session->slots)
+		return -1;
+	
+	for (i = 0; i < session->slot_count; i++) {
+		slot = &session->slots[i];
+		slot->session = session;
+		slot->samples = malloc(channels * frames * sizeof(float));
+		slot->channels = malloc(channels * sizeof(float*));
+		slot->scratch = malloc(bound);
+		slot->payload = malloc(bound);
+		if (!slot->samples || !slot->channels || !slot->scratch ||
+			!slot->payload)
+			return -1;
+		for (c = 0; c < channels; c++)
+			slot->channels[c] = slot->samples + c * frames;
+	}
+	
+	return 0;
+}
+
+/*
+ * Frees everything the session owns, but not the session itself.
+ */
+static void release_session(native_session_t* session) {
+	size_t i;
+	
+	// Compression tasks point into the slots.
+	wait_for_pool(session);
+	
+	if (session->fd >= 0)
+		close(session->fd);
+	if (session->chain)
+		jackoff_destroy_chain(session->chain);
+	if (session->slots) {
+		for (i = 0; i < session->slot_count; i++) {
+			free(session->slots[i].samples);
+			free(session->slots[i].channels);
+			free(session->slots[i].scratch);
+			free(session->slots[i].payload);
+		}
+		free(session->slots);
+	}
+	free(session->entries);
+	if (session->loudness)
+		jackoff_destroy_loudness(session->loudness);
+	if (session->peaks)
+		jackoff_close_peaks(session->peaks);
+	if (session->manifest)
+		jackoff_destroy_manifest(session->manifest);
+	pthread_cond_destroy(&session->finished);
+	pthread_mutex_destroy(&session->lock);
+}
+
+/*
+ * Hands the slot being filled to the pool and moves on to the next one,
+ * writing out finished chunks first if every slot is in use.
+ */
+static int submit_chunk(native_session_t* session) {
+	chunk_slot_t* slot = &session->slots[session->filling];
+	
+	slot->entry.first_frame = session->frames;
+	slot->entry.frames = (uint32_t) session->fill_frames;
+	session->frames += session->fill_frames;
+	session->fill_frames = 0;
+	
+	pthread_mutex_lock(&session->lock);
+	slot->state = SLOT_BUSY;
+	session->busy++;
+	pthread_mutex_unlock(&session->lock);
+	session->pending++;
+	
+	if (jackoff_submit_task(pool, compress_chunk, slot) != 0)
+		compress_chunk(slot);
+	
+	session->filling = (session->filling + 1) % session->slot_count;
+	return write_chunks(session, session->slot_count - 1);
+}
+
+static void compress_chunk(void* arg) {
+	chunk_slot_t* slot = arg;
+	native_session_t* session = slot->session;
+	
+	jackoff_encode_chunk(&session->info, (const float* const*) slot->channels,
+		slot->entry.frames, COMPRESSION_LEVEL, slot->scratch, slot->payload,
+		&slot->entry);
+	
+	pthread_mutex_lock(&session->lock);
+	slot->state = SLOT_DONE;
+	session->busy--;
+	pthread_cond_broadcast(&session->finished);
+	pthread_mutex_unlock(&session->lock);
+}
+
+/*
+ * Writes compressed chunks to the file in order, waiting for the pool
+ * while more than `keep` chunks are outstanding.
+ */
+static int write_chunks(native_session_t* session, size_t keep) {
+	unsigned char header[JACKOFF_CHUNK_HEADER_SIZE];
+	jackoff_chunk_entry_t* entries;
+	chunk_slot_t* slot;
+	uint64_t started;
+	int ready;
+	
+	while (session->pending > 0) {
+		slot = &session->slots[session->oldest];
+		pthread_mutex_lock(&session->lock);
+		while (slot->state != SLOT_DONE && session->pending > keep)
+			pthread_cond_wait(&session->finished, &session->lock);
+		ready = (slot->state == SLOT_DONE);
+		pthread_mutex_unlock(&session->lock);
+		if (!ready)
+			break;
+		
+		if (session->entry_count == session->entry_capacity) {
+			entries = realloc(session->entries, (session->entry_capacity ?
+				session->entry_capacity * 2 : 64) *
+				sizeof(jackoff_chunk_entry_t));
+			if (!entries) {
+				jackoff_warn("Failed to grow the chunk index.");
+				return -1;
+			}
+			session->entries = entries;
+			session->entry_capacity = session->entry_capacity ?
+				session->entry_capacity * 2 : 64;
+		}
+		
+		slot->entry.offset = session->offset;
+		jackoff_pack_chunk_header(&slot->entry, header);
+		
+		started = jackoff_write_started();
+		if (jackoff_inject_fault(NULL) != 0 ||
+			write_all(session, header, sizeof(header)) != 0 ||
+			write_all(session, slot->payload, slot->entry.size) != 0)
+		{
+			jackoff_warn("Failed to write audio to disk: %s",
+				strerror(errno));
+			return -1;
+		}
+		jackoff_count_write(started, sizeof(header) + slot->entry.size);
+		
+		session->entries[session->entry_count++] = slot->entry;
+		slot->state = SLOT_FREE;
+		session->oldest = (session->oldest + 1) % session->slot_count;
+		session->pending--;
+	}
+	
+	return 0;
+}
+
+static void wait_for_pool(native_session_t* session) {
+	pthread_mutex_lock(&session->lock);
+	while (session->busy > 0)
+		pthread_cond_wait(&session->finished, &session->lock);
+	pthread_mutex_unlock(&session->lock);
+}
+
+static int write_all(native_session_t* session, const void* data,
+	size_t size)
+{
+	ssize_t written;
+	
+	while (size > 0) {
+		written = write(session->fd, data, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+		if (session->manifest) {
+			jackoff_manifest_write(session->manifest, session->offset, data,
+				(size_t) written);
+		}
+		data = (const char*) data + written;
+		size -= (size_t) written;
+		session->offset += (uint64_t) written;
+	}
+	return 0;
+}
@@ -19,27 +19,49 @@
 
 #include "jackoff.h"
 #include "driver_sndfile.h"
+#include "chain.h"
+#include "seekindex.h"
+#include "writebehind.h"
+#include "loudness.h"
+#include "peaks.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "faults.h"
 #include "logging.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sndfile.h>
 
-// Write 256 samples to disk at a time
-static const jack_nframes_t read_size = 256;
+// A seed for the dither generators, so that output is reproducible
+#define DITHER_SEED 0x4A41434Bu
 
 typedef struct sndfile_encoder {
 	struct jackoff_encoder encoder;
-	SF_INFO info;
+	SF_INFO info; // a template; sessions fill in the sample rate
+	const jackoff_settings_t* settings;
+	int pcm_bits; // 16 or 24 if we convert to integers ourselves; else 0
 } sndfile_encoder_t;
 
 typedef struct sndfile_session {
 	struct jackoff_session session;
 	SNDFILE* sndfile;
+	SF_INFO info;
+	int fd; // ours; libsndfile doesn't close it
+	jackoff_write_behind_t* write_behind; // NULL to let libsndfile write
+	jackoff_seek_index_t* seek_index; // NULL if there isn't one
+	jackoff_loudness_t* loudness; // NULL if not measuring
+	jackoff_peaks_t* peaks; // NULL if there's no overview
+	jackoff_manifest_t* manifest; // NULL if not checksumming
+	sf_count_t frames_written;
+	jackoff_chain_t* chain;
 	jack_default_audio_sample_t* interleaved_buffer;
-	jack_default_audio_sample_t** channel_buffers;
+	jackoff_converter_t converter;
+	void* pcm_buffer;
 } sndfile_session_t;
 
 static jackoff_session_t* jackoff_sndfile_open(jackoff_client_t* client,
@@ -49,7 +71,7 @@ static long jackoff_sndfile_write(const jackoff_session_t* session);
 static void jackoff_sndfile_shutdown(const jackoff_encoder_t* encoder);
 
 jackoff_encoder_t* jackoff_create_sndfile_encoder(jackoff_client_t* client,
-	jackoff_format_t* format, int bitrate)
+	jackoff_format_t* format, const jackoff_settings_t* settings)
 {
 	sndfile_encoder_t* encoder;
 	char sndfile_version[128];
@@ -61,13 +83,29 @@ jackoff_encoder_t* jackoff_create_sndfile_encoder(jackoff_client_t* client,
 	}
 	
 	encoder->info.format = format->options;
+	encoder->settings = settings;
+	
+	// libsndfile's own float-to-integer conversion is plain scalar code
+	// with no dither, so we hand it integers for the PCM formats.
+	switch (format->options & SF_FORMAT_SUBMASK) {
+		case SF_FORMAT_PCM_16:
+			encoder->pcm_bits = 16;
+			break;
+		case SF_FORMAT_PCM_24:
+			encoder->pcm_bits = 24;
+			break;
+		default:
+			encoder->pcm_bits = 0;
+	}
 	
 	sf_command(NULL, SFC_GET_LIB_VERSION, sndfile_version,
 		sizeof(sndfile_version));
 	jackoff_debug("Created a new encoder with %s.", sndfile_version);
 	
-	encoder->info.samplerate = jack_get_sample_rate(client->jack_client);
-	encoder->info.channels = (int) client->channel_count;
+	if (settings->matrix)
+		encoder->info.channels = (int) settings->matrix->outputs;
+	else
+		encoder->info.channels = (int) client->channel_count;
 	
 	encoder->encoder.open = jackoff_sndfile_open;
 	encoder->encoder.close = jackoff_sndfile_close;
@@ -82,6 +120,8 @@ static jackoff_session_t* jackoff_sndfile_open(jackoff_client_t* client,
 {
 	sndfile_encoder_t* encoder = (sndfile_encoder_t*) base_encoder;
 	sndfile_session_t* session;
+	size_t write_buffer = encoder->settings->write_buffer;
+	int to_stdout = (0 == strcmp(file_path, "-"));
 	
 	session = calloc(1, sizeof(sndfile_session_t));
 	if (!session) {
@@ -89,21 +129,137 @@ static jackoff_session_t* jackoff_sndfile_open(jackoff_client_t* client,
 		return NULL;
 	}
 	
-	session->channel_buffers = calloc(client->channel_count,
-		sizeof(jack_default_audio_sample_t*));
-	if (!session->channel_buffers) {
+	session->chain = jackoff_create_chain(client, encoder->settings);
+	if (!session->chain) {
+		free(session);
+		jackoff_warn("Failed to set up the signal chain.");
+		return NULL;
+	}
+	
+	session->interleaved_buffer = calloc(
+		jackoff_chain_capacity(session->chain) *
+		jackoff_chain_channels(session->chain),
+		sizeof(jack_default_audio_sample_t));
+	if (!session->interleaved_buffer) {
+		jackoff_destroy_chain(session->chain);
 		free(session);
-		jackoff_error("Failed to allocate channel buffers.");
+		jackoff_warn("Failed to allocate the interleaving buffer.");
+		return NULL;
 	}
 	
-	session->sndfile = sf_open(file_path, SFM_WRITE, &encoder->info);
+	if (encoder->pcm_bits) {
+		jackoff_init_converter(&session->converter, encoder->pcm_bits,
+			encoder->settings->dither, DITHER_SEED);
+		session->pcm_buffer = calloc(jackoff_chain_capacity(session->chain) *
+			jackoff_chain_channels(session->chain),
+			(encoder->pcm_bits == 16) ? sizeof(short) : sizeof(int));
+		if (!session->pcm_buffer) {
+			jackoff_destroy_chain(session->chain);
+			free(session->interleaved_buffer);
+			free(session);
+			jackoff_warn("Failed to allocate the PCM conversion buffer.");
+			return NULL;
+		}
+	}
+	
+	// The rate comes from the chain, not the encoder: it can change when
+	// JACK's does, from one session to the next.
+	session->info = encoder->info;
+	session->info.samplerate = jackoff_chain_sample_rate(session->chain);
+	
+	// Standard output gets libsndfile's writes directly: the write-behind
+	// buffer and the manifest need a file they can read back, and there's
+	// nowhere to put the sidecars.
+	if (to_stdout && (encoder->settings->manifest ||
+		encoder->settings->seek_interval > 0 || encoder->settings->peaks))
+	{
+		jackoff_warn("Writing to standard output without a manifest, seek "
+			"index or overview.");
+	}
+	
+	// Checksums are taken from libsndfile's writes on their way through
+	// the write-behind buffer, so there has to be one.
+	if (encoder->settings->manifest && !to_stdout) {
+		session->manifest = jackoff_create_manifest(file_path);
+		if (!session->manifest)
+			jackoff_warn("Recording \"%s\" without a manifest.", file_path);
+		else if (write_buffer == 0)
+			write_buffer = JACKOFF_DEFAULT_WRITE_BUFFER;
+	}
+	
+	// The file is opened here rather than by libsndfile, so that its
+	// writes can go through our write-behind buffer, and so that the seek
+	// index can learn how far into it each block lands.
+	if (to_stdout) {
+		session->fd = -1;
+		session->sndfile = sf_open_fd(STDOUT_FILENO, SFM_WRITE,
+			&session->info, SF_FALSE);
+	} else {
+		session->fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	}
+	if (session->fd >= 0 && write_buffer > 0) {
+		session->write_behind = jackoff_create_write_behind(session->fd,
+			write_buffer, encoder->settings->write_thread);
+		if (session->write_behind) {
+			if (session->manifest) {
+				jackoff_write_behind_checksum(session->write_behind,
+					session->manifest);
+			}
+			session->sndfile = sf_open_virtual(jackoff_write_behind_io(),
+				SFM_WRITE, &session->info, session->write_behind);
+		}
+	} else if (session->fd >= 0) {
+		session->sndfile = sf_open_fd(session->fd, SFM_WRITE, &session->info,
+			SF_FALSE);
+	}
+	if (!session->sndfile && to_stdout) {
+		// Most formats patch their header at the end, which a pipe can't
+		// take.
+		jackoff_warn("This format can't be written to standard output: %s",
+			sf_strerror(NULL));
+	} else if (!session->sndfile) {
+		jackoff_warn("Failed to open output file: %s", (session->fd < 0) ?
+			strerror(errno) : sf_strerror(NULL));
+	}
 	if (!session->sndfile) {
-		jackoff_warn("Failed to open output file: %s", sf_strerror(NULL));
-		free(session->channel_buffers);
+		if (session->write_behind)
+			jackoff_destroy_write_behind(session->write_behind);
+		if (session->fd >= 0)
+			close(session->fd);
+		if (session->manifest)
+			jackoff_destroy_manifest(session->manifest);
+		jackoff_destroy_chain(session->chain);
+		free(session->interleaved_buffer);
+		if (session->pcm_buffer)
+			free(session->pcm_buffer);
 		free(session);
 		return NULL;
 	}
 	
+	if (encoder->settings->seek_interval > 0 && !to_stdout) {
+		session->seek_index = jackoff_create_seek_index(client, file_path,
+			session->info.samplerate, encoder->settings->seek_interval);
+		if (!session->seek_index)
+			jackoff_warn("Recording \"%s\" without a seek index.", file_path);
+	}
+	
+	if (encoder->settings->loudness) {
+		session->loudness = jackoff_create_loudness(
+			jackoff_chain_channels(session->chain),
+			jackoff_chain_sample_rate(session->chain));
+		if (!session->loudness)
+			jackoff_warn("Recording \"%s\" without measuring loudness.",
+				file_path);
+	}
+	
+	if (encoder->settings->peaks && !to_stdout) {
+		session->peaks = jackoff_create_peaks(file_path,
+			jackoff_chain_channels(session->chain),
+			jackoff_chain_sample_rate(session->chain));
+		if (!session->peaks)
+			jackoff_warn("Recording \"%s\" without an overview.", file_path);
+	}
+	
 	jackoff_debug("Created a new libsndfile session recording to \"%s\".",
 		file_path);
 	return (jackoff_session_t*) session;
@@ -111,81 +267,143 @@ static jackoff_session_t* jackoff_sndfile_open(jackoff_client_t* client,
 
 static int jackoff_sndfile_close(const jackoff_session_t* base_session) {
 	sndfile_session_t* session = (sndfile_session_t*) base_session;
-	size_t i;
+	
+	int result = 0;
 	
 	sf_write_sync(session->sndfile);
 	if (sf_close(session->sndfile) != 0) {
 		jackoff_warn("Failed to close output file: %s",
 			sf_strerror(session->sndfile));
-		return -1;
+		result = -1;
 	}
-	
-	if (session->channel_buffers) {
-		for (i = 0; i < base_session->client->channel_count; i++) {
-			if (session->channel_buffers[i])
-				free(session->channel_buffers[i]);
-		}
-		free(session->channel_buffers);
+	if (session->write_behind &&
+		jackoff_destroy_write_behind(session->write_behind) != 0)
+		result = -1;
+	if (session->manifest &&
+		jackoff_finish_manifest(session->manifest, session->fd) != 0)
+		result = -1;
+	if (session->fd >= 0 && close(session->fd) != 0) {
+		jackoff_warn("Failed to close output file: %s", strerror(errno));
+		result = -1;
 	}
+	if (session->seek_index &&
+		jackoff_close_seek_index(session->seek_index) != 0)
+		result = -1;
+	if (session->loudness && jackoff_finish_loudness(session->loudness,
+		base_session->file_path) != 0)
+		result = -1;
+	if (session->peaks && jackoff_close_peaks(session->peaks) != 0)
+		result = -1;
+	
+	if (session->chain)
+		jackoff_destroy_chain(session->chain);
 	
 	if (session->interleaved_buffer)
 		free(session->interleaved_buffer);
+	if (session->pcm_buffer)
+		free(session->pcm_buffer);
 	
-	return 0;
+	return result;
 }
 
 static long jackoff_sndfile_write(const jackoff_session_t* base_session) {
 	sndfile_session_t* session = (sndfile_session_t*) base_session;
+	sndfile_encoder_t* encoder = (sndfile_encoder_t*) base_session->encoder;
 	
-	size_t desired = read_size * sizeof(jack_default_audio_sample_t);
+	jack_default_audio_sample_t** channel_buffers;
+	size_t frames;
 	sf_count_t frames_written = 0;
-	size_t i, c, bytes_read = 0;
-	jackoff_client_t* client = base_session->client;
-	size_t channels = client->channel_count;
+	size_t i, c;
+	size_t channels = jackoff_chain_channels(session->chain);
+	size_t sample_size;
+	uint64_t started = 0;
+	off_t offset;
+	long result;
+	
+	result = jackoff_chain_pull(session->chain, &channel_buffers, &frames);
+	if (result <= 0 || frames == 0)
+		return result;
+	
+	if (session->loudness)
+		jackoff_measure_loudness(session->loudness, channel_buffers, frames);
+	// An overview that can't be written is given up on, not the recording.
+	if (session->peaks &&
+		jackoff_add_peaks(session->peaks, channel_buffers, frames) != 0)
+	{
+		jackoff_close_peaks(session->peaks);
+		session->peaks = NULL;
+	}
 	
-	// Check to make sure there's enough space in the ring buffers.
 	for (c = 0; c < channels; c++) {
-		if (jack_ringbuffer_read_space(client->ring_buffers[c]) < desired) {
-			// Try again later.
-			return 0;
+		for (i = 0; i < frames; i++) {
+			session->interleaved_buffer[(i * channels) + c] =
+				channel_buffers[c][i];
 		}
 	}
 	
-	for (c = 0; c < channels; c++) {
-		session->channel_buffers[c] = (jack_default_audio_sample_t*)
-			realloc(session->channel_buffers[c], desired);
-		if (!session->channel_buffers[c]) {
-			jackoff_error("Failed to reallocate channel buffer %lu.", c);
+	if (encoder->pcm_bits) {
+		sample_size = (encoder->pcm_bits == 16) ? sizeof(short) : sizeof(int);
+		if (encoder->pcm_bits == 16) {
+			jackoff_convert_to_short(&session->converter,
+				session->interleaved_buffer, frames * channels,
+				session->pcm_buffer);
+		} else {
+			jackoff_convert_to_int(&session->converter,
+				session->interleaved_buffer, frames * channels,
+				session->pcm_buffer);
 		}
-		
-		bytes_read = jack_ringbuffer_read(client->ring_buffers[c],
-			(char*) session->channel_buffers[c], desired);
-		if (bytes_read != desired) {
-			jackoff_error("Failed to read desired # of bytes from RB %lu.",
-				c);
+	} else {
+		sample_size = sizeof(jack_default_audio_sample_t);
+	}
+	
+	// Where libsndfile is about to append is at or before where this
+	// block's data will start, whatever the encoder holds back.
+	if (session->seek_index) {
+		if (session->write_behind)
+			offset = jackoff_write_behind_tell(session->write_behind);
+		else
+			offset = lseek(session->fd, 0, SEEK_CUR);
+		if (offset >= 0) {
+			jackoff_seek_index_mark(session->seek_index,
+				(uint64_t) session->frames_written, (uint64_t) offset);
 		}
 	}
 	
-	session->interleaved_buffer = (jack_default_audio_sample_t*)
-		realloc(session->interleaved_buffer, desired * channels);
-	if (!session->interleaved_buffer)
-		jackoff_error("Failed to reallocate interleaved buffer.");
-	for (c = 0; c < channels; c++) {
-		for (i = 0; i < read_size; i++) {
-			session->interleaved_buffer[(i * channels) + c] =
-				session->channel_buffers[c][i];
+	// A write-behind buffer times its own writes to the file, and takes
+	// any injected faults there; without one, libsndfile writes to it from
+	// inside these calls.
+	if (!session->write_behind) {
+		started = jackoff_write_started();
+		if (jackoff_inject_fault(NULL) != 0) {
+			jackoff_warn("Failed to write audio to disk: %s",
+				strerror(errno));
+			return -1;
 		}
 	}
+	switch (encoder->pcm_bits) {
+		case 16:
+			frames_written = sf_writef_short(session->sndfile,
+				session->pcm_buffer, frames);
+			break;
+		case 24:
+			frames_written = sf_writef_int(session->sndfile,
+				session->pcm_buffer, frames);
+			break;
+		default:
+			frames_written = sf_writef_float(session->sndfile,
+				session->interleaved_buffer, frames);
+	}
+	if (!session->write_behind)
+		jackoff_count_write(started, frames_written * channels * sample_size);
 	
-	frames_written = sf_writef_float(session->sndfile,
-		session->interleaved_buffer, read_size);
-	if (frames_written != read_size) {
+	if (frames_written != frames) {
 		jackoff_warn("Failed to write audio to disk: %s",
 			sf_strerror(session->sndfile));
 		return -1;
 	}
+	session->frames_written += frames_written;
 	
-	return frames_written;
+	return result;
 }
 
 static void jackoff_sndfile_shutdown(const jackoff_encoder_t* encoder) {
@@ -23,6 +23,6 @@
 #include "jackoff.h"
 
 jackoff_encoder_t* jackoff_create_sndfile_encoder(jackoff_client_t* client,
-	jackoff_format_t* format, int bitrate);
+	jackoff_format_t* format, const jackoff_settings_t* settings);
 
 #endif
@@ -0,0 +1,527 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "jackoff.h"
+#include "driver_stream.h"
+#include "chain.h"
+#include "metrics.h"
+#include "faults.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Buffers are at least this big, and a whole number of pages.
+#define MIN_STREAM_BUFFER_SIZE 65536
+#define DITHER_SEED 0x4A41434Bu
+
+// How long closing waits for a pipe's reader to take what was spliced into
+// it, and how often it looks.
+#define DRAIN_TIMEOUT_MSEC 10000
+#define DRAIN_POLL_MSEC 10
+
+/*
+ * A page-aligned run of output bytes. Once it has been spliced into a pipe,
+ * the pipe refers to its pages instead of holding a copy, so it can't be
+ * reused until the reader has consumed up to its end.
+ */
+typedef struct stream_buffer {
+	char* data;
+	size_t length; // bytes filled
+	size_t offset; // bytes handed to the output so far
+	unsigned long long end; // stream position just past its last byte
+	struct stream_buffer* next;
+} stream_buffer_t;
+
+typedef struct stream_encoder {
+	struct jackoff_encoder encoder;
+	const jackoff_settings_t* settings;
+	int bits; // 16 for integer PCM, 32 for float
+} stream_encoder_t;
+
+typedef struct stream_session {
+	struct jackoff_session session;
+	int fd;
+	int is_pipe;
+	int use_splice;
+	jackoff_chain_t* chain;
+	jack_default_audio_sample_t* interleaved_buffer;
+	jackoff_converter_t converter;
+	
+	size_t buffer_size;
+	size_t buffer_limit; // how many buffers may exist at once
+	size_t buffer_count;
+	stream_buffer_t* free_buffers;
+	stream_buffer_t* queue_head; // oldest buffer not yet reclaimed
+	stream_buffer_t* queue_tail; // the one being filled
+	
+	unsigned long long position; // bytes queued
+	unsigned long long written; // bytes handed to the output
+	unsigned long long frames_dropped;
+	int dropping;
+	int spliced; // nonzero once any pages have been spliced into the pipe
+} stream_session_t;
+
+static jackoff_session_t* jackoff_stream_open(jackoff_client_t* client,
+	jackoff_encoder_t* encoder, const char* file_path);
+static int jackoff_stream_close(const jackoff_session_t* session);
+static long jackoff_stream_write(const jackoff_session_t* session);
+static void jackoff_stream_shutdown(const jackoff_encoder_t* encoder);
+
+static int open_output(const char* file_path);
+static void free_buffers(stream_session_t* session);
+static stream_buffer_t* get_buffer(stream_session_t* session);
+static void reclaim_buffers(stream_session_t* session);
+static void* queue_space(stream_session_t* session, size_t size);
+static int flush_buffers(stream_session_t* session, int blocking);
+static int drain_pipe(stream_session_t* session);
+
+jackoff_encoder_t* jackoff_create_stream_encoder(jackoff_client_t* client,
+	jackoff_format_t* format, const jackoff_settings_t* settings)
+{
+	stream_encoder_t* encoder;
+	
+	encoder = calloc(1, sizeof(stream_encoder_t));
+	if (!encoder) {
+		jackoff_error("Failed to allocate memory for stream encoder.");
+		return NULL;
+	}
+	
+	encoder->settings = settings;
+	encoder->bits = format->options;
+	
+	encoder->encoder.open = jackoff_stream_open;
+	encoder->encoder.close = jackoff_stream_close;
+	encoder->encoder.write = jackoff_stream_write;
+	encoder->encoder.shutdown = jackoff_stream_shutdown;
+	
+	return (jackoff_encoder_t*) encoder;
+}
+
+/*
+ * Parses a backpressure policy: "drop" throws away audio as soon as the
+ * reader falls behind, and "buffer" or "buffer:MB" holds up to that much
+ * output back first (JACKOFF_DEFAULT_STREAM_BACKLOG when no size is given).
+ */
+int jackoff_parse_backpressure(const char* value, size_t* backlog) {
+	char* end;
+	double megabytes;
+	
+	if (0 == strcmp(value, "drop")) {
+		*backlog = 0;
+		return 1;
+	} else if (0 == strcmp(value, "buffer")) {
+		*backlog = JACKOFF_DEFAULT_STREAM_BACKLOG;
+		return 1;
+	} else if (0 == strncmp(value, "buffer:", 7)) {
+		megabytes = strtod(value + 7, &end);
+		if (end == value + 7 || *end != 0 || megabytes < 0)
+			return 0;
+		*backlog = (size_t) (megabytes * 1024 * 1024);
+		return 1;
+	}
+	return 0;
+}
+
+static jackoff_session_t* jackoff_stream_open(jackoff_client_t* client,
+	jackoff_encoder_t* base_encoder, const char* file_path)
+{
+	stream_encoder_t* encoder = (stream_encoder_t*) base_encoder;
+	stream_session_t* session;
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t frame_bytes;
+	size_t pipe_size = 0;
+	int result;
+	
+	session = calloc(1, sizeof(stream_session_t));
+	if (!session) {
+		jackoff_error("Failed to allocate a stream session.");
+		return NULL;
+	}
+	
+	session->chain = jackoff_create_chain(client, encoder->settings);
+	if (!session->chain) {
+		free(session);
+		jackoff_warn("Failed to set up the signal chain.");
+		return NULL;
+	}
+	
+	session->interleaved_buffer = calloc(
+		jackoff_chain_capacity(session->chain) *
+		jackoff_chain_channels(session->chain),
+		sizeof(jack_default_audio_sample_t));
+	if (!session->interleaved_buffer) {
+		jackoff_destroy_chain(session->chain);
+		free(session);
+		jackoff_warn("Failed to allocate the interleaving buffer.");
+		return NULL;
+	}
+	
+	if (encoder->bits == 16) {
+		jackoff_init_converter(&session->converter, 16,
+			encoder->settings->dither, DITHER_SEED);
+	}
+	
+	session->fd = open_output(file_path);
+	if (session->fd < 0) {
+		jackoff_destroy_chain(session->chain);
+		free(session->interleaved_buffer);
+		free(session);
+		return NULL;
+	}
+	
+#ifdef F_GETPIPE_SZ
+	result = fcntl(session->fd, F_GETPIPE_SZ);
+	if (result > 0) {
+		session->is_pipe = session->use_splice = 1;
+		pipe_size = (size_t) result;
+	}
+#else
+	(void) result;
+#endif
+	
+	// Every buffer must hold one pull from the chain. The limit covers what
+	// the pipe can hold (those buffers aren't ours again until the reader
+	// takes them), the allowed backlog, and the buffer being filled.
+	frame_bytes = jackoff_chain_channels(session->chain) * (encoder->bits / 8);
+	session->buffer_size = jackoff_chain_capacity(session->chain) *
+		frame_bytes;
+	if (session->buffer_size < MIN_STREAM_BUFFER_SIZE)
+		session->buffer_size = MIN_STREAM_BUFFER_SIZE;
+	session->buffer_size = (session->buffer_size + page_size - 1) /
+		page_size * page_size;
+	session->buffer_limit = 2 +
+		(pipe_size + encoder->settings->stream_backlog) /
+		session->buffer_size;
+	
+	jackoff_debug("Streaming to \"%s\" through up to %lu buffers of %lu "
+		"bytes%s.", file_path, session->buffer_limit, session->buffer_size,
+		session->is_pipe ? " (spliced)" : "");
+	return (jackoff_session_t*) session;
+}
+
+static int jackoff_stream_close(const jackoff_session_t* base_session) {
+	stream_session_t* session = (stream_session_t*) base_session;
+	int flags;
+	int result = 0;
+	
+	// Whatever is still queued is sent with blocking writes; the capture is
+	// over, so there's nothing left to fall behind on.
+	flags = fcntl(session->fd, F_GETFL);
+	if (flags != -1)
+		fcntl(session->fd, F_SETFL, flags & ~O_NONBLOCK);
+	if (flush_buffers(session, 1) != 0)
+		result = -1;
+	
+	if (session->frames_dropped > 0) {
+		jackoff_warn("Stream reader was too slow; %llu frames were dropped "
+			"in total.", session->frames_dropped);
+	}
+	
+	// The pipe refers to the pages of spliced buffers until the reader has
+	// taken them, so they can't be freed or reused before then. Should the
+	// reader go away or stop reading, they are left allocated instead.
+	if (session->spliced && drain_pipe(session) != 0) {
+		jackoff_warn("Stream reader didn't take the end of the stream; "
+			"leaving its buffers to the pipe.");
+		session->queue_head = session->queue_tail = NULL;
+	}
+	
+	if (session->fd != STDOUT_FILENO && close(session->fd) != 0) {
+		jackoff_warn("Failed to close output stream: %s", strerror(errno));
+		result = -1;
+	}
+	
+	free_buffers(session);
+	if (session->chain)
+		jackoff_destroy_chain(session->chain);
+	if (session->interleaved_buffer)
+		free(session->interleaved_buffer);
+	
+	return result;
+}
+
+static long jackoff_stream_write(const jackoff_session_t* base_session) {
+	stream_session_t* session = (stream_session_t*) base_session;
+	stream_encoder_t* encoder = (stream_encoder_t*) base_session->encoder;
+	
+	jack_default_audio_sample_t** channel_buffers;
+	size_t frames;
+	size_t i, c;
+	size_t channels = jackoff_chain_channels(session->chain);
+	size_t bytes;
+	void* space;
+	jack_default_audio_sample_t* interleaved;
+	long result;
+	
+	if (flush_buffers(session, 0) != 0)
+		return -1;
+	
+	result = jackoff_chain_pull(session->chain, &channel_buffers, &frames);
+	if (result <= 0 || frames == 0)
+		return result;
+	
+	bytes = frames * channels * (encoder->bits / 8);
+	space = queue_space(session, bytes);
+	if (!space) {
+		// The reader has fallen too far behind. Audio is thrown away here
+		// rather than left in the capture buffers, where it would overflow
+		// them.
+		if (!session->dropping) {
+			jackoff_warn("Stream reader is falling behind; dropping audio.");
+			session->dropping = 1;
+		}
+		session->frames_dropped += frames;
+		jackoff_count(jackoff_thread_counters, JACKOFF_METRIC_FRAMES_DROPPED,
+			frames);
+		return result;
+	} else if (session->dropping) {
+		jackoff_warn("Stream reader caught up; %llu frames dropped so far.",
+			session->frames_dropped);
+		session->dropping = 0;
+	}
+	
+	// Float output is interleaved straight into the stream buffer.
+	interleaved = (encoder->bits == 32) ? space : session->interleaved_buffer;
+	for (c = 0; c < channels; c++) {
+		for (i = 0; i < frames; i++)
+			interleaved[(i * channels) + c] = channel_buffers[c][i];
+	}
+	if (encoder->bits == 16) {
+		jackoff_convert_to_short(&session->converter, interleaved,
+			frames * channels, space);
+	}
+	
+	if (flush_buffers(session, 0) != 0)
+		return -1;
+	return result;
+}
+
+static void jackoff_stream_shutdown(const jackoff_encoder_t* encoder) {
+	// We don't actually need to do anything here.
+}
+
+/*
+ * Opens the output for non-blocking writes: "-" is standard output, and
+ * anything else is a FIFO or file. Opening a FIFO waits for its reader.
+ */
+static int open_output(const char* file_path) {
+	int fd;
+	int flags;
+	
+	if (0 == strcmp(file_path, "-")) {
+		fd = STDOUT_FILENO;
+	} else {
+		fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			jackoff_warn("Failed to open output stream \"%s\": %s", file_path,
+				strerror(errno));
+			return -1;
+		}
+	}
+	
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		jackoff_warn("Failed to make the output stream non-blocking: %s",
+			strerror(errno));
+		if (fd != STDOUT_FILENO)
+			close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static void free_buffers(stream_session_t* session) {
+	stream_buffer_t* buffer;
+	stream_buffer_t* next;
+	
+	for (buffer = session->queue_head; buffer; buffer = next) {
+		next = buffer->next;
+		free(buffer->data);
+		free(buffer);
+	}
+	for (buffer = session->free_buffers; buffer; buffer = next) {
+		next = buffer->next;
+		free(buffer->data);
+		free(buffer);
+	}
+	session->queue_head = session->queue_tail = session->free_buffers = NULL;
+}
+
+static stream_buffer_t* get_buffer(stream_session_t* session) {
+	stream_buffer_t* buffer;
+	
+	reclaim_buffers(session);
+	
+	buffer = session->free_buffers;
+	if (buffer) {
+		session->free_buffers = buffer->next;
+	} else if (session->buffer_count < session->buffer_limit) {
+		buffer = calloc(1, sizeof(stream_buffer_t));
+		if (!buffer)
+			return NULL;
+		if (posix_memalign((void**) &buffer->data,
+			(size_t) sysconf(_SC_PAGESIZE), session->buffer_size) != 0)
+		{
+			free(buffer);
+			return NULL;
+		}
+		session->buffer_count++;
+	} else {
+		return NULL;
+	}
+	
+	buffer->length = buffer->offset = 0;
+	buffer->next = NULL;
+	if (session->queue_tail)
+		session->queue_tail->next = buffer;
+	else
+		session->queue_head = buffer;
+	session->queue_tail = buffer;
+	return buffer;
+}
+
+/*
+ * Returns fully-written buffers to the free list. For a pipe, that waits
+ * until the reader has consumed them: FIONREAD says how much of what we've
+ * spliced is still sitting in the pipe.
+ */
+static void reclaim_buffers(stream_session_t* session) {
+	stream_buffer_t* buffer;
+	unsigned long long consumed = session->written;
+	int unread;
+	
+	if (session->is_pipe && ioctl(session->fd, FIONREAD, &unread) == 0)
+		consumed -= (unsigned long long) unread;
+	
+	while ((buffer = session->queue_head) && buffer != session->queue_tail &&
+		buffer->offset == buffer->length && buffer->end <= consumed)
+	{
+		session->queue_head = buffer->next;
+		buffer->next = session->free_buffers;
+		session->free_buffers = buffer;
+	}
+}
+
+/*
+ * Reserves room for the given number of bytes at the end of the queue, or
+ * returns NULL if the backpressure limit has been reached.
+ */
+static void* queue_space(stream_session_t* session, size_t size) {
+	stream_buffer_t* buffer = session->queue_tail;
+	void* space;
+	
+	if (!buffer || buffer->length + size > session->buffer_size) {
+		buffer = get_buffer(session);
+		if (!buffer)
+			return NULL;
+	}
+	
+	space = buffer->data + buffer->length;
+	buffer->length += size;
+	session->position += size;
+	buffer->end = session->position;
+	return space;
+}
+
+/*
+ * Hands queued output to the stream, stopping when it would block unless
+ * asked to wait. Pipes get the buffers' pages with vmsplice; anything else
+ * gets a plain write.
+ */
+static int flush_buffers(stream_session_t* session, int blocking) {
+	stream_buffer_t* buffer;
+	struct iovec iov;
+	uint64_t started;
+	ssize_t result;
+	
+	for (buffer = session->queue_head; buffer; buffer = buffer->next) {
+		while (buffer->offset < buffer->length) {
+			iov.iov_base = buffer->data + buffer->offset;
+			iov.iov_len = buffer->length - buffer->offset;
+			started = jackoff_write_started();
+			
+			if (jackoff_inject_fault(&iov.iov_len) != 0) {
+				result = -1;
+			} else if (session->use_splice) {
+				result = vmsplice(session->fd, &iov, 1,
+					blocking ? 0 : SPLICE_F_NONBLOCK);
+				if (result < 0 && errno == EINVAL) {
+					// vmsplice isn't available; stop trying it.
+					session->use_splice = 0;
+					continue;
+				}
+				if (result > 0)
+					session->spliced = 1;
+			} else {
+				result = write(session->fd, iov.iov_base, iov.iov_len);
+			}
+			
+			if (result < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 0;
+				if (errno == EINTR)
+					continue;
+				jackoff_warn("Failed to write to the output stream: %s",
+					strerror(errno));
+				return -1;
+			}
+			jackoff_count_write(started, (size_t) result);
+			buffer->offset += (size_t) result;
+			session->written += (unsigned long long) result;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Waits until the reader has consumed everything in the pipe. Returns 0
+ * once it has, or -1 if the reader went away or took longer than
+ * DRAIN_TIMEOUT_MSEC.
+ */
+static int drain_pipe(stream_session_t* session) {
+	struct pollfd descriptor;
+	int unread;
+	int waited;
+	
+	for (waited = 0; ; waited += DRAIN_POLL_MSEC) {
+		if (ioctl(session->fd, FIONREAD, &unread) != 0)
+			return -1;
+		if (unread == 0)
+			return 0;
+		
+		// A pipe with no reader left polls as an error.
+		descriptor.fd = session->fd;
+		descriptor.events = 0;
+		if (poll(&descriptor, 1, 0) > 0 && (descriptor.revents & POLLERR))
+			return -1;
+		if (waited >= DRAIN_TIMEOUT_MSEC)
+			return -1;
+		usleep(DRAIN_POLL_MSEC * 1000);
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_STREAM_H_
+#define _JACKOFF_STREAM_H_
+
+#include "jackoff.h"
+
+jackoff_encoder_t* jackoff_create_stream_encoder(jackoff_client_t* client,
+	jackoff_format_t* format, const jackoff_settings_t* settings);
+int jackoff_parse_backpressure(const char* value, size_t* backlog);
+
+#endif
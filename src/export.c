@@ -0,0 +1,394 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * jackoff-export: converts a native jackoff file to a standard format,
+ * decoding its chunks in parallel.
+ */
+
+#include "jackoff.h"
+#include "container.h"
+#include "threadpool.h"
+#include "logging.h"
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sndfile.h>
+
+typedef struct {
+	const char* name;
+	const char* description;
+	int format;
+} export_format_t;
+
+static export_format_t export_formats[] = {
+	{"wav", "WAV (32-bit float)", SF_FORMAT_WAV | SF_FORMAT_FLOAT},
+	{"wav16", "WAV (16-bit PCM)", SF_FORMAT_WAV | SF_FORMAT_PCM_16},
+	{"wav24", "WAV (24-bit PCM)", SF_FORMAT_WAV | SF_FORMAT_PCM_24},
+	{"aiff", "AIFF (32-bit float)", SF_FORMAT_AIFF | SF_FORMAT_FLOAT},
+	{"caf", "Core Audio (32-bit float)", SF_FORMAT_CAF | SF_FORMAT_FLOAT},
+	{"flac", "FLAC (24-bit PCM)", SF_FORMAT_FLAC | SF_FORMAT_PCM_24},
+	{NULL, NULL, 0}
+};
+
+typedef struct decode_task {
+	struct decoder* decoder;
+	size_t chunk;
+	unsigned char* payload;
+	unsigned char* scratch;
+	float* samples;
+	float** channels;
+	int result;
+} decode_task_t;
+
+typedef struct decoder {
+	jackoff_container_t* container;
+	jackoff_thread_pool_t* pool;
+	decode_task_t* tasks;
+	size_t task_count;
+	size_t remaining; // tasks of the current batch still running
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+} decoder_t;
+
+static void show_usage_info(char* prog_name);
+static export_format_t* get_export_format(const char* name);
+static decoder_t* create_decoder(jackoff_container_t* container,
+	size_t threads);
+static void destroy_decoder(decoder_t* decoder);
+static void decode_chunk(void* arg);
+static size_t find_chunk(const jackoff_container_t* container,
+	uint64_t frame);
+
+static const char* short_options = "f:s:d:j:vqh";
+static const struct option long_options[] = {
+	{"format", required_argument, NULL, 'f'},
+	{"start", required_argument, NULL, 's'},
+	{"duration", required_argument, NULL, 'd'},
+	{"threads", required_argument, NULL, 'j'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"quiet", no_argument, NULL, 'q'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/* The logger calls this on errors; there's nothing to wind down here. */
+void jackoff_shutdown() {
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	export_format_t* format = &export_formats[0];
+	double start = 0.0, duration = 0.0;
+	size_t threads = 0;
+	jackoff_container_t* container;
+	decoder_t* decoder;
+	decode_task_t* task;
+	SNDFILE* output;
+	SF_INFO info;
+	float* interleaved;
+	uint64_t first_frame, end_frame, frame;
+	size_t channels, chunk, batch, i, j, c, skip, frames;
+	int clipping = SF_TRUE;
+	int option, long_index;
+	
+	while (1) {
+		option = getopt_long(argc, argv, short_options, long_options,
+			&long_index);
+		
+		if (option == -1)
+			break;
+		
+		switch (option) {
+			case 'f':
+				format = get_export_format(optarg);
+				if (!format) {
+					jackoff_error("unknown output format \"%s\"", optarg);
+				}
+				break;
+			case 's':
+				start = strtod(optarg, NULL);
+				break;
+			case 'd':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'j':
+				threads = (size_t) strtol(optarg, NULL, 0);
+				break;
+			case 'v':
+				jackoff_set_log_cutoff(JACKOFF_LOG_DEBUG);
+				break;
+			case 'q':
+				jackoff_set_log_cutoff(JACKOFF_LOG_WARNING);
+				break;
+			default:
+				show_usage_info(argv[0]);
+				return 10;
+		}
+	}
+	
+	if (argc - optind != 2) {
+		show_usage_info(argv[0]);
+		return 10;
+	}
+	argc -= optind;
+	argv += optind;
+	
+	container = jackoff_open_container(argv[0]);
+	if (!container) {
+		jackoff_error("error reading \"%s\"", argv[0]);
+	}
+	channels = container->info.channels;
+	
+	first_frame = (uint64_t) (start * container->info.sample_rate);
+	end_frame = container->total_frames;
+	if (duration > 0 && first_frame +
+		(uint64_t) (duration * container->info.sample_rate) < end_frame)
+		end_frame = first_frame +
+			(uint64_t) (duration * container->info.sample_rate);
+	if (first_frame >= end_frame) {
+		jackoff_error("nothing to export after %.3f seconds", start);
+	}
+	
+	decoder = create_decoder(container, threads ? threads :
+		jackoff_available_cpus(NULL));
+	interleaved = malloc(container->info.chunk_frames * channels *
+		sizeof(float));
+	if (!decoder || !interleaved) {
+		jackoff_error("failed to set up the decoder");
+	}
+	
+	memset(&info, 0, sizeof(info));
+	info.format = format->format;
+	info.channels = (int) channels;
+	info.samplerate = (int) container->info.sample_rate;
+	output = sf_open(argv[1], SFM_WRITE, &info);
+	if (!output) {
+		jackoff_error("Failed to open output file: %s", sf_strerror(NULL));
+	}
+	sf_command(output, SFC_SET_CLIPPING, &clipping, sizeof(clipping));
+	
+	jackoff_info("Exporting %llu frames of %lu-channel audio in %lu chunks.",
+		(unsigned long long) (end_frame - first_frame), channels,
+		container->count);
+	
+	// Decode a batch of chunks at once, then write them out in order.
+	chunk = find_chunk(container, first_frame);
+	frame = first_frame;
+	while (frame < end_frame && chunk < container->count) {
+		batch = decoder->task_count;
+		if (batch > container->count - chunk)
+			batch = container->count - chunk;
+		
+		decoder->remaining = batch;
+		for (i = 0; i < batch; i++) {
+			decoder->tasks[i].chunk = chunk + i;
+			if (jackoff_submit_task(decoder->pool, decode_chunk,
+				&decoder->tasks[i]) != 0)
+				decode_chunk(&decoder->tasks[i]);
+		}
+		pthread_mutex_lock(&decoder->lock);
+		while (decoder->remaining > 0)
+			pthread_cond_wait(&decoder->finished, &decoder->lock);
+		pthread_mutex_unlock(&decoder->lock);
+		
+		for (i = 0; i < batch && frame < end_frame; i++) {
+			task = &decoder->tasks[i];
+			if (task->result != 0) {
+				sf_close(output);
+				jackoff_error("chunk %lu of \"%s\" is unreadable",
+					task->chunk, argv[0]);
+			}
+			
+			skip = (size_t) (frame -
+				container->entries[task->chunk].first_frame);
+			frames = container->entries[task->chunk].frames - skip;
+			if (frames > end_frame - frame)
+				frames = (size_t) (end_frame - frame);
+			
+			for (c = 0; c < channels; c++) {
+				for (j = 0; j < frames; j++) {
+					interleaved[(j * channels) + c] =
+						task->channels[c][skip + j];
+				}
+			}
+			if (sf_writef_float(output, interleaved, frames) !=
+				(sf_count_t) frames)
+			{
+				jackoff_error("Failed to write audio: %s",
+					sf_strerror(output));
+			}
+			frame += frames;
+		}
+		chunk += batch;
+	}
+	
+	if (sf_close(output) != 0) {
+		jackoff_error("Failed to close output file.");
+	}
+	
+	destroy_decoder(decoder);
+	free(interleaved);
+	jackoff_close_container(container);
+	return 0;
+}
+
+static void show_usage_info(char* prog_name) {
+	export_format_t* format;
+	
+	printf("%s\n\n", PACKAGE_STRING);
+	printf("Usage: %s [options] <native file> <output filename>\n",
+		prog_name);
+	printf("  -f FORMAT, --format=FORMAT          output format\n");
+	printf("  -s SECONDS, --start=SECONDS         start exporting at the "
+		"given offset\n");
+	printf("  -d SECONDS, --duration=SECONDS      export only the given "
+		"length\n");
+	printf("  -j N, --threads=N                   number of threads "
+		"decoding [one per CPU]\n");
+	printf("  -v, --verbose                       include debug output\n");
+	printf("  -q, --quiet                         don't say a lot\n");
+	printf("  -h, --help                          show this help and exit\n");
+	
+	printf("\nSupported output formats:\n");
+	for (format = &export_formats[0]; format->name; format++) {
+		printf("  %-6s       %s", format->name, format->description);
+		if (format == &export_formats[0])
+			printf("     [default]");
+		printf("\n");
+	}
+}
+
+static export_format_t* get_export_format(const char* name) {
+	export_format_t* format;
+	for (format = &export_formats[0]; format->name; format++) {
+		if (0 == strcmp(format->name, name))
+			return format;
+	}
+	return NULL;
+}
+
+static decoder_t* create_decoder(jackoff_container_t* container,
+	size_t threads)
+{
+	decoder_t* decoder;
+	decode_task_t* task;
+	size_t channels = container->info.channels;
+	size_t frames = container->info.chunk_frames;
+	size_t bound = jackoff_chunk_bound(&container->info);
+	size_t i, c;
+	
+	decoder = calloc(1, sizeof(decoder_t));
+	if (!decoder)
+		return NULL;
+	decoder->container = container;
+	pthread_mutex_init(&decoder->lock, NULL);
+	pthread_cond_init(&decoder->finished, NULL);
+	
+	// Two chunks per thread, so none of them idle while the batch's
+	// stragglers finish.
+	decoder->task_count = threads * 2;
+	decoder->tasks = calloc(decoder->task_count, sizeof(decode_task_t));
+	decoder->pool = jackoff_create_thread_pool(threads, NULL);
+	if (!decoder->tasks || !decoder->pool) {
+		destroy_decoder(decoder);
+		return NULL;
+	}
+	
+	for (i = 0; i < decoder->task_count; i++) {
+		task = &decoder->tasks[i];
+		task->decoder = decoder;
+		task->payload = malloc(bound);
+		task->scratch = malloc(bound);
+		task->samples = malloc(channels * frames * sizeof(float));
+		task->channels = malloc(channels * sizeof(float*));
+		if (!task->payload || !task->scratch || !task->samples ||
+			!task->channels)
+		{
+			destroy_decoder(decoder);
+			return NULL;
+		}
+		for (c = 0; c < channels; c++)
+			task->channels[c] = task->samples + c * frames;
+	}
+	
+	return decoder;
+}
+
+static void destroy_decoder(decoder_t* decoder) {
+	size_t i;
+	
+	if (decoder->pool)
+		jackoff_destroy_thread_pool(decoder->pool);
+	if (decoder->tasks) {
+		for (i = 0; i < decoder->task_count; i++) {
+			free(decoder->tasks[i].payload);
+			free(decoder->tasks[i].scratch);
+			free(decoder->tasks[i].samples);
+			free(decoder->tasks[i].channels);
+		}
+		free(decoder->tasks);
+	}
+	pthread_cond_destroy(&decoder->finished);
+	pthread_mutex_destroy(&decoder->lock);
+	free(decoder);
+}
+
+static void decode_chunk(void* arg) {
+	decode_task_t* task = arg;
+	decoder_t* decoder = task->decoder;
+	jackoff_container_t* container = decoder->container;
+	
+	task->result = jackoff_read_chunk(container, task->chunk, task->payload);
+	if (task->result == 0) {
+		task->result = jackoff_decode_chunk(&container->info,
+			&container->entries[task->chunk], task->payload, task->scratch,
+			task->channels);
+	}
+	
+	pthread_mutex_lock(&decoder->lock);
+	decoder->remaining--;
+	pthread_cond_broadcast(&decoder->finished);
+	pthread_mutex_unlock(&decoder->lock);
+}
+
+/*
+ * The chunk holding the given frame, found by bisecting the index.
+ */
+static size_t find_chunk(const jackoff_container_t* container,
+	uint64_t frame)
+{
+	size_t low = 0, high = container->count;
+	size_t middle;
+	
+	while (high - low > 1) {
+		middle = low + (high - low) / 2;
+		if (container->entries[middle].first_frame <= frame)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
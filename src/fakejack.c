@@ -0,0 +1,354 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "fakejack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define MAX_PORTS 64
+
+struct _jack_port {
+	char name[128];
+	int source; // the fake:capture port connected to it, or -1
+	int registered;
+	jack_default_audio_sample_t* buffer;
+};
+
+struct _jack_client {
+	char name[64];
+	jack_nframes_t sample_rate;
+	jack_nframes_t period;
+	
+	JackProcessCallback process;
+	void* process_arg;
+	
+	pthread_mutex_t lock; // over the ports and the cycle times
+	struct _jack_port ports[MAX_PORTS];
+	size_t port_count;
+	jack_nframes_t cycle_frame;
+	jack_time_t cycle_usecs;
+	
+	pthread_t thread;
+	int active;
+	volatile int stopping;
+};
+
+static jack_nframes_t configured_rate = 48000;
+static jack_nframes_t configured_period = 256;
+static jack_nframes_t configured_first_frame = 0;
+static char source_names[FAKE_JACK_SOURCES][32];
+static const char* source_list[FAKE_JACK_SOURCES + 1];
+
+static void* engine_thread(void* arg);
+static void fill_inputs(jack_client_t* client);
+
+/*
+ * Sets up the graph the next client will find. The frame time starts at
+ * first_frame, so a test can begin just short of where it wraps.
+ */
+void fake_jack_configure(jack_nframes_t sample_rate, jack_nframes_t period,
+	jack_nframes_t first_frame)
+{
+	configured_rate = sample_rate;
+	configured_period = period;
+	configured_first_frame = first_frame;
+}
+
+/*
+ * What the given source plays at the given frame time: a ramp that climbs
+ * by 1/FAKE_JACK_RAMP a frame, offset for each source. Every value is exact
+ * in single precision, and the ramp is continuous where frame times wrap.
+ */
+float fake_jack_sample(size_t source, jack_nframes_t frame) {
+	return (float) ((frame + source * 256) % FAKE_JACK_RAMP) /
+		FAKE_JACK_RAMP - 0.5f;
+}
+
+jack_client_t* jack_client_open(const char* client_name,
+	jack_options_t options, jack_status_t* status, ...)
+{
+	jack_client_t* client = calloc(1, sizeof(jack_client_t));
+	size_t i;
+	
+	if (!client) {
+		*status = JackFailure;
+		return NULL;
+	}
+	
+	snprintf(client->name, sizeof(client->name), "%s", client_name);
+	client->sample_rate = configured_rate;
+	client->period = configured_period;
+	client->cycle_frame = configured_first_frame;
+	client->cycle_usecs = jack_get_time();
+	pthread_mutex_init(&client->lock, NULL);
+	
+	for (i = 0; i < FAKE_JACK_SOURCES; i++) {
+		snprintf(source_names[i], sizeof(source_names[i]),
+			"fake:capture_%lu", i + 1);
+		source_list[i] = source_names[i];
+	}
+	*status = 0;
+	return client;
+}
+
+int jack_client_close(jack_client_t* client) {
+	size_t i;
+	
+	if (client->active) {
+		client->stopping = 1;
+		pthread_join(client->thread, NULL);
+	}
+	for (i = 0; i < client->port_count; i++)
+		free(client->ports[i].buffer);
+	pthread_mutex_destroy(&client->lock);
+	free(client);
+	return 0;
+}
+
+char* jack_get_client_name(jack_client_t* client) {
+	return client->name;
+}
+
+int jack_activate(jack_client_t* client) {
+	if (pthread_create(&client->thread, NULL, engine_thread, client) != 0)
+		return -1;
+	client->active = 1;
+	return 0;
+}
+
+void jack_on_shutdown(jack_client_t* client, JackShutdownCallback function,
+	void* arg)
+{
+	// The stand-in never goes away.
+}
+
+int jack_set_process_callback(jack_client_t* client,
+	JackProcessCallback callback, void* arg)
+{
+	client->process = callback;
+	client->process_arg = arg;
+	return 0;
+}
+
+int jack_set_freewheel_callback(jack_client_t* client,
+	JackFreewheelCallback callback, void* arg)
+{
+	return 0;
+}
+
+int jack_set_buffer_size_callback(jack_client_t* client,
+	JackBufferSizeCallback callback, void* arg)
+{
+	return 0;
+}
+
+int jack_set_sample_rate_callback(jack_client_t* client,
+	JackSampleRateCallback callback, void* arg)
+{
+	return 0;
+}
+
+void jack_set_error_function(void (*function)(const char*)) {
+}
+
+void jack_set_info_function(void (*function)(const char*)) {
+}
+
+jack_nframes_t jack_get_sample_rate(jack_client_t* client) {
+	return client->sample_rate;
+}
+
+jack_nframes_t jack_get_buffer_size(jack_client_t* client) {
+	return client->period;
+}
+
+int jack_client_real_time_priority(jack_client_t* client) {
+	return -1;
+}
+
+jack_port_t* jack_port_register(jack_client_t* client, const char* port_name,
+	const char* port_type, unsigned long flags, unsigned long buffer_size)
+{
+	jack_port_t* port;
+	char name[sizeof(port->name)];
+	
+	pthread_mutex_lock(&client->lock);
+	if (client->port_count == MAX_PORTS) {
+		pthread_mutex_unlock(&client->lock);
+		return NULL;
+	}
+	port = &client->ports[client->port_count];
+	port->buffer = calloc(client->period,
+		sizeof(jack_default_audio_sample_t));
+	if (!port->buffer) {
+		pthread_mutex_unlock(&client->lock);
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "%s:%s", client->name, port_name);
+	memcpy(port->name, name, sizeof(name));
+	port->source = -1;
+	port->registered = 1;
+	client->port_count++;
+	pthread_mutex_unlock(&client->lock);
+	return port;
+}
+
+/*
+ * The port stops being fed, but its buffer lasts until the client closes:
+ * a process callback that is running can still be reading it.
+ */
+int jack_port_unregister(jack_client_t* client, jack_port_t* port) {
+	pthread_mutex_lock(&client->lock);
+	port->registered = 0;
+	port->source = -1;
+	pthread_mutex_unlock(&client->lock);
+	return 0;
+}
+
+void* jack_port_get_buffer(jack_port_t* port, jack_nframes_t frames) {
+	return port->buffer;
+}
+
+const char* jack_port_name(const jack_port_t* port) {
+	return port->name;
+}
+
+int jack_connect(jack_client_t* client, const char* source_port,
+	const char* destination_port)
+{
+	size_t source, i;
+	
+	for (source = 0; source < FAKE_JACK_SOURCES; source++) {
+		if (0 == strcmp(source_names[source], source_port))
+			break;
+	}
+	if (source == FAKE_JACK_SOURCES)
+		return -1;
+	
+	pthread_mutex_lock(&client->lock);
+	for (i = 0; i < client->port_count; i++) {
+		if (client->ports[i].registered &&
+			0 == strcmp(client->ports[i].name, destination_port))
+		{
+			client->ports[i].source = (int) source;
+			pthread_mutex_unlock(&client->lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&client->lock);
+	return -1;
+}
+
+/*
+ * Only the stand-in's own outputs can be listed; the caller frees the list.
+ */
+const char** jack_get_ports(jack_client_t* client,
+	const char* port_name_pattern, const char* type_name_pattern,
+	unsigned long flags)
+{
+	const char** ports;
+	
+	if (!(flags & JackPortIsOutput))
+		return NULL;
+	ports = malloc(sizeof(source_list));
+	if (ports)
+		memcpy(ports, source_list, sizeof(source_list));
+	return ports;
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t* client) {
+	return client->cycle_frame;
+}
+
+jack_time_t jack_frames_to_time(const jack_client_t* client,
+	jack_nframes_t frames)
+{
+	int64_t offset = (int32_t) (frames - client->cycle_frame);
+	
+	return client->cycle_usecs + offset * 1000000 / client->sample_rate;
+}
+
+jack_nframes_t jack_time_to_frames(const jack_client_t* client,
+	jack_time_t usecs)
+{
+	int64_t offset = (int64_t) (usecs - client->cycle_usecs);
+	
+	return client->cycle_frame +
+		(jack_nframes_t) (offset * client->sample_rate / 1000000);
+}
+
+jack_time_t jack_get_time() {
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (jack_time_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Runs a cycle every period, on time, until the client is closed.
+ */
+static void* engine_thread(void* arg) {
+	jack_client_t* client = arg;
+	long period_nsec = (long) ((uint64_t) client->period * 1000000000 /
+		client->sample_rate);
+	struct timespec deadline;
+	
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	while (!client->stopping) {
+		pthread_mutex_lock(&client->lock);
+		client->cycle_usecs = (jack_time_t) deadline.tv_sec * 1000000 +
+			deadline.tv_nsec / 1000;
+		fill_inputs(client);
+		pthread_mutex_unlock(&client->lock);
+		
+		if (client->process)
+			client->process(client->period, client->process_arg);
+		client->cycle_frame += client->period;
+		
+		deadline.tv_nsec += period_nsec;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+			NULL) == EINTR)
+			;
+	}
+	return NULL;
+}
+
+static void fill_inputs(jack_client_t* client) {
+	jack_port_t* port;
+	jack_nframes_t i;
+	size_t p;
+	
+	for (p = 0; p < client->port_count; p++) {
+		port = &client->ports[p];
+		for (i = 0; i < client->period; i++) {
+			port->buffer[i] = (port->source < 0) ? 0.0f :
+				fake_jack_sample((size_t) port->source,
+				client->cycle_frame + i);
+		}
+	}
+}
@@ -0,0 +1,40 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_FAKEJACK_H_
+#define _JACKOFF_FAKEJACK_H_
+
+#include <jack/jack.h>
+
+/*
+ * A stand-in for the JACK server, linked into the tests in place of the
+ * client library. Its graph has FAKE_JACK_SOURCES output ports, named
+ * "fake:capture_1" and up, and a thread that runs the process callback
+ * every period at the pace of the wall clock. Each source plays a ramp
+ * that fake_jack_sample describes, so a reader can tell where any
+ * captured sample came from.
+ */
+#define FAKE_JACK_SOURCES 16
+#define FAKE_JACK_RAMP 4096
+
+void fake_jack_configure(jack_nframes_t sample_rate, jack_nframes_t period,
+	jack_nframes_t first_frame);
+float fake_jack_sample(size_t source, jack_nframes_t frame);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "faults.h"
+#include "jackoff.h"
+#include "logging.h"
+
+#ifdef JACKOFF_FAULT_INJECTION
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct {
+	unsigned long stall_min; // milliseconds
+	unsigned long stall_max;
+	unsigned long every;
+	unsigned long fail;
+	unsigned long cut;
+	unsigned int seed;
+} fault_plan_t;
+
+static fault_plan_t plan;
+static pthread_once_t plan_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t seed_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long calls = 0;
+
+static void load_plan();
+
+/*
+ * Called just before a write of *length bytes to the output. Stalls if this
+ * call is due a stall, and returns -1 with errno set to EIO if it is due a
+ * failure; returns 0 otherwise. If the call is due a short write, *length
+ * is halved; callers whose writes can't be cut short pass NULL.
+ */
+int jackoff_inject_fault(size_t* length) {
+	unsigned long call;
+	unsigned long stall;
+	
+	pthread_once(&plan_once, load_plan);
+	call = __sync_add_and_fetch(&calls, 1);
+	
+	if (plan.fail && call % plan.fail == 0) {
+		errno = EIO;
+		return -1;
+	}
+	
+	if (plan.cut && length && *length > 1 && call % plan.cut == 0)
+		*length /= 2;
+	
+	if (plan.stall_max && call % plan.every == 0) {
+		stall = plan.stall_min;
+		if (plan.stall_max > plan.stall_min) {
+			pthread_mutex_lock(&seed_lock);
+			stall += (unsigned long) rand_r(&plan.seed) %
+				(plan.stall_max - plan.stall_min + 1);
+			pthread_mutex_unlock(&seed_lock);
+		}
+		usleep(stall * 1000);
+	}
+	
+	return 0;
+}
+
+static void load_plan() {
+	const char* spec = getenv("JACKOFF_FAULTS");
+	char* copy;
+	char* setting;
+	char* value;
+	char* saved;
+	
+	plan.every = 1;
+	plan.seed = 1;
+	if (!spec || !(copy = strdup(spec)))
+		return;
+	
+	for (setting = strtok_r(copy, ",", &saved); setting;
+		setting = strtok_r(NULL, ",", &saved))
+	{
+		value = strchr(setting, '=');
+		if (!value) {
+			jackoff_warn("Ignoring fault setting \"%s\".", setting);
+			continue;
+		}
+		*value++ = 0;
+		
+		if (0 == strcmp(setting, "stall")) {
+			plan.stall_min = strtoul(value, &value, 10);
+			plan.stall_max = (*value == '-') ?
+				strtoul(value + 1, NULL, 10) : plan.stall_min;
+		} else if (0 == strcmp(setting, "every")) {
+			plan.every = strtoul(value, NULL, 10);
+			if (plan.every == 0)
+				plan.every = 1;
+		} else if (0 == strcmp(setting, "fail")) {
+			plan.fail = strtoul(value, NULL, 10);
+		} else if (0 == strcmp(setting, "short")) {
+			plan.cut = strtoul(value, NULL, 10);
+		} else if (0 == strcmp(setting, "seed")) {
+			plan.seed = (unsigned int) strtoul(value, NULL, 10);
+		} else {
+			jackoff_warn("Ignoring fault setting \"%s\".", setting);
+		}
+	}
+	free(copy);
+	
+	jackoff_warn("Injecting faults: stalls of %lu-%lu ms on 1 in %lu "
+		"writes; failing 1 in %lu; cutting short 1 in %lu.", plan.stall_min,
+		plan.stall_max, plan.every, plan.fail, plan.cut);
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_FAULTS_H_
+#define _JACKOFF_FAULTS_H_
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+/*
+ * Fault injection for the output path, compiled in only with
+ * --enable-fault-injection. The JACKOFF_FAULTS environment variable picks
+ * the faults as comma-separated settings:
+ *
+ *   stall=MS or stall=MIN-MAX   block each faulted write for that long
+ *   every=N                     fault one write call in N (default 1)
+ *   fail=N                      fail one write call in N with EIO
+ *   short=N                     cut one write call in N to half its length
+ *   seed=N                      seed for the stall lengths
+ *
+ * e.g. JACKOFF_FAULTS=stall=100-2000,every=200 reproduces the occasional
+ * multi-second disk stall, whose effect shows up in the metrics.
+ *
+ * The hooks sit on the system calls that reach the file or pipe: the
+ * write-behind buffer's pwrite for the libsndfile formats, and the stream
+ * and native formats' own writes. Only with -W 0, where libsndfile writes
+ * to the file itself, is each sf_writef call faulted instead.
+ */
+#ifdef JACKOFF_FAULT_INJECTION
+int jackoff_inject_fault(size_t* length);
+#else
+#define jackoff_inject_fault(length) 0
+#endif
+
+#endif
@@ -20,14 +20,23 @@
 #include "jackoff.h"
 #include "logging.h"
 #include "driver_sndfile.h"
+#include "driver_stream.h"
+#include "driver_native.h"
+#include "realtime.h"
+#include "writer.h"
+#include "configfile.h"
+#include "writebehind.h"
+#include "metrics.h"
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <time.h>
+#include <sys/time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sndfile.h>
@@ -57,22 +66,23 @@ jackoff_format_t available_formats[] = {
 	{"wav32", "WAV (32-bit float)", jackoff_create_sndfile_encoder,
 		SF_FORMAT_WAV | SF_FORMAT_FLOAT},
 #endif
+	{"raw", "Raw PCM stream (16-bit)", jackoff_create_stream_encoder, 16},
+	{"raw32", "Raw PCM stream (32-bit float)", jackoff_create_stream_encoder,
+		32},
+	{"native", "Jackoff chunked float (lossless, compressed)",
+		jackoff_create_native_encoder, 0},
 	{NULL, NULL, NULL, 0}
 };
 
 volatile int running = 0;
 
 static void handle_signal(int signum);
+#ifndef JACKOFF_NO_MAIN
 static void show_usage_info(char* prog_name);
+#endif
 static void handle_jack_error(const char* message);
 static void handle_jack_info(const char* message);
-
-struct port_info {
-	size_t count;
-	char** ports;
-};
-
-static int parse_ports(char* port_value, struct port_info* info);
+static jack_time_t wall_clock_to_jack_time(double when);
 
 jackoff_format_t* jackoff_get_output_format(const char* name) {
 	jackoff_format_t* format;
@@ -84,10 +94,10 @@ jackoff_format_t* jackoff_get_output_format(const char* name) {
 }
 
 jackoff_encoder_t* jackoff_create_encoder(jackoff_client_t* client,
-	jackoff_format_t* format, int bitrate)
+	jackoff_format_t* format, const jackoff_settings_t* settings)
 {
 	jackoff_encoder_t* encoder = format->create_encoder(client, format,
-		bitrate);
+		settings);
 	return encoder;
 }
 
@@ -102,6 +112,8 @@ jackoff_session_t* jackoff_open_session(jackoff_client_t* client,
 {
 	jackoff_session_t* session = encoder->open(client, encoder, file_path);
 	
+	if (!session)
+		return NULL;
 	session->client = client;
 	session->encoder = encoder;
 	session->file_path = file_path;
@@ -132,88 +144,176 @@ void jackoff_shutdown()
 	}
 }
 
-int run(size_t port_count, const char** ports, const char* client_name,
-	const char* file_path, jackoff_format_t* format, int bitrate,
-	size_t channels, float buffer_duration, time_t recording_duration,
-	jack_options_t options)
+int jackoff_is_running()
+{
+	return running;
+}
+
+static void abandon_recordings(jackoff_recording_t* recordings, size_t count,
+	jackoff_host_t* host, jackoff_metrics_t* metrics)
 {
-	jackoff_client_t* client;
-	jackoff_encoder_t* encoder;
-	jackoff_session_t* session;
-	time_t stop_time = (time_t) 0;
 	size_t i;
-	long result;
+	
+	for (i = 0; i < count; i++)
+		jackoff_finish_recording(&recordings[i]);
+	jackoff_destroy_metrics(metrics);
+	jackoff_destroy_host(host);
+}
+
+int run(jackoff_recording_t* recordings, size_t count,
+	const char* client_name, jack_options_t options, float buffer_duration,
+	size_t writer_threads, const jackoff_thread_policy_t* writer_policy,
+	int capture_flags, const char* metrics_path, const char* spill_dir,
+	float spill_duration)
+{
+	jackoff_host_t* host;
+	jackoff_metrics_t* metrics = NULL;
+	jackoff_spiller_t* spiller = NULL;
+	jackoff_recording_t* recording;
+	jack_nframes_t sample_rate;
+	jack_time_t start_time;
+	jack_time_t stop_time;
+	uint64_t duration_frames;
+	size_t i, j;
+	int waiting = 0;
+	int failed = 0;
 	
 	jack_set_error_function(handle_jack_error);
 	jack_set_info_function(handle_jack_info);
 	
-	if (recording_duration) {
-		stop_time = time(NULL) + recording_duration;
+	host = jackoff_create_host(client_name, options);
+	if (!host)
+		return 1;
+	
+	for (i = 0; i < count; i++) {
+		recording = &recordings[i];
+		recording->client = jackoff_create_client(host, recording->name,
+			recording->channels, buffer_duration, capture_flags);
+		if (!recording->client) {
+			jackoff_destroy_host(host);
+			return 1;
+		}
 	}
 	
-	client = jackoff_create_client(client_name, options, channels, buffer_duration);
+	if (metrics_path) {
+		metrics = jackoff_create_metrics(recordings, count, writer_threads);
+		for (i = 0; metrics && i < count; i++) {
+			recordings[i].client->counters = jackoff_metrics_counters(metrics,
+				0, i);
+		}
+	}
 	
-	if (jackoff_activate_client(client) != 0) {
-		jackoff_destroy_client(client);
+	if (jackoff_activate_host(host) != 0) {
+		jackoff_destroy_host(host);
 		jackoff_error("Failed to activate JACK client.");
 	}
 	
+	// With a spill tier, memory is locked once the sessions are open
+	// instead, and without MCL_FUTURE, so that the spill files aren't
+	// pinned into RAM when they're mapped. The writer policy is taken up by
+	// the writer threads alone, once they start.
+	if ((capture_flags & JACKOFF_RING_LOCKED) && !spill_dir)
+		jackoff_lock_memory(1);
+	
 	signal(SIGTERM, handle_signal);
 	signal(SIGINT, handle_signal);
 	signal(SIGHUP, handle_signal);
+	signal(SIGPIPE, SIG_IGN); // a stream reader going away is an error
 	
-	if (port_count == 0) {
-		jackoff_auto_connect_client_ports(client);
-	} else {
-		for (i = 0; i < port_count; i++) {
-			jackoff_connect_client_port(client, i, ports[i]);
+	sample_rate = jack_get_sample_rate(host->jack_client);
+	for (i = 0; i < count; i++) {
+		recording = &recordings[i];
+		
+		if (recording->port_count == 0) {
+			jackoff_auto_connect_client_ports(recording->client);
+		} else {
+			for (j = 0; j < recording->port_count; j++) {
+				jackoff_connect_client_port(recording->client, j,
+					recording->ports[j]);
+			}
 		}
+		
+		recording->encoder = jackoff_create_encoder(recording->client,
+			recording->format, &recording->settings);
+		if (!recording->encoder) {
+			abandon_recordings(recordings, count, host, metrics);
+			return 1;
+		}
+		
+		recording->session = jackoff_open_session(recording->client,
+			recording->encoder, recording->file_path);
+		if (!recording->session) {
+			abandon_recordings(recordings, count, host, metrics);
+			return 2;
+		}
+		recording->opened_at = jackoff_metrics_clock();
 	}
 	
-	encoder = jackoff_create_encoder(client, format, bitrate);
-	if (!encoder) {
-		jackoff_destroy_client(client);
-		return 1;
-	}
-	
-	session = jackoff_open_session(client, encoder, file_path);
-	if (!session) {
-		jackoff_destroy_encoder(encoder);
-		jackoff_destroy_client(client);
-		return 2;
+	if (spill_dir) {
+		if (capture_flags & JACKOFF_RING_LOCKED)
+			jackoff_lock_memory(0);
+		
+		for (i = 0; i < count; i++) {
+			if (jackoff_attach_spill(recordings[i].client, spill_dir,
+				spill_duration) != 0)
+			{
+				abandon_recordings(recordings, count, host, metrics);
+				return 1;
+			}
+		}
+		spiller = jackoff_start_spiller(host, buffer_duration / 8);
 	}
 	
 	running = 1;
-	jackoff_info("Recording.");
-	while (running && (stop_time == 0 || time(NULL) < stop_time)) {
-		if (client->ring_buffer_overflowed) {
-			jackoff_warn("Ring buffer overflow; some audio was not written.");
-			client->ring_buffer_overflowed = 0;
-		}
+	for (i = 0; i < count; i++) {
+		recording = &recordings[i];
+		start_time = stop_time = 0;
+		duration_frames = 0;
 		
-		if (!client->status) {
-			break;
+		if (recording->duration * sample_rate >=
+			(double) JACKOFF_MAX_DURATION_FRAMES)
+		{
+			duration_frames = JACKOFF_MAX_DURATION_FRAMES;
+			jackoff_warn("%s%sA duration of %g seconds can't be counted; "
+				"recording for %g seconds instead.",
+				recording->name ? recording->name : "",
+				recording->name ? ": " : "", recording->duration,
+				(double) duration_frames / sample_rate);
+		} else if (recording->duration > 0) {
+			duration_frames = (uint64_t) (recording->duration *
+				sample_rate + 0.5);
 		}
-		
-		result = jackoff_write_session(session);
-		if (result == 0) {
-			// Sleep for 1/4th the ring buffer duration.
-			jackoff_debug("Sleeping for %.04fms.", (buffer_duration / 4));
-			usleep(1000000 * (buffer_duration / 4));
-		} else if (result == -1) {
-			jackoff_close_session(session);
-			jackoff_destroy_encoder(encoder);
-			jackoff_destroy_client(client);
-			jackoff_error("Encoding error. Shutting down.");
-			return 3;
+		if (recording->start_at > 0) {
+			start_time = wall_clock_to_jack_time(recording->start_at);
+			waiting = 1;
 		}
+		if (recording->stop_at > 0)
+			stop_time = wall_clock_to_jack_time(recording->stop_at);
+		
+		jackoff_start_capture(recording->client, start_time, stop_time,
+			duration_frames);
 	}
+	if (waiting)
+		jackoff_info("Waiting to start recording.");
+	else
+		jackoff_info("Recording.");
 	
-	jackoff_close_session(session);
-	jackoff_destroy_encoder(encoder);
-	jackoff_destroy_client(client);
+	if (metrics) {
+		jackoff_start_metrics_file(metrics, metrics_path,
+			JACKOFF_METRICS_INTERVAL);
+	}
+	
+	jackoff_run_writers(recordings, count, writer_threads, writer_policy,
+		host, buffer_duration / 4, metrics);
+	jackoff_stop_spiller(spiller);
 	
-	return 0;
+	abandon_recordings(recordings, count, host, metrics);
+	for (i = 0; i < count; i++) {
+		if (recordings[i].failed)
+			failed = 1;
+	}
+	
+	return failed ? 3 : 0;
 }
 
 static void handle_signal(int signum) {
@@ -235,16 +335,40 @@ static void handle_signal(int signum) {
 	jackoff_shutdown();
 }
 
-static const char* short_options = "an:f:b:c:d:R:p:Svqh";
+// The tests drive run() themselves, and build this file without main().
+#ifndef JACKOFF_NO_MAIN
+static const char* short_options = "an:f:F:b:r:c:m:D:B:d:s:e:R:T:p:LHP:C:w:j:M:x:X:I:W:lkKSvqh";
 static const struct option long_options[] = {
 	{"auto-connect", no_argument, NULL, 'a'},
 	{"client-name", required_argument, NULL, 'n'},
 	{"format", required_argument, NULL, 'f'},
+	{"config", required_argument, NULL, 'F'},
 	{"bitrate", required_argument, NULL, 'b'},
+	{"sample-rate", required_argument, NULL, 'r'},
 	{"channels", required_argument, NULL, 'c'},
+	{"matrix", required_argument, NULL, 'm'},
+	{"dither", required_argument, NULL, 'D'},
+	{"backpressure", required_argument, NULL, 'B'},
 	{"duration", required_argument, NULL, 'd'},
+	{"start-at", required_argument, NULL, 's'},
+	{"stop-at", required_argument, NULL, 'e'},
 	{"buffer-duration", required_argument, NULL, 'R'},
+	{"transport", required_argument, NULL, 'T'},
 	{"ports", required_argument, NULL, 'p'},
+	{"lock-memory", no_argument, NULL, 'L'},
+	{"huge-pages", no_argument, NULL, 'H'},
+	{"writer-priority", required_argument, NULL, 'P'},
+	{"writer-cpus", required_argument, NULL, 'C'},
+	{"writer-threads", required_argument, NULL, 'w'},
+	{"compress-threads", required_argument, NULL, 'j'},
+	{"metrics", required_argument, NULL, 'M'},
+	{"spill-dir", required_argument, NULL, 'x'},
+	{"spill-duration", required_argument, NULL, 'X'},
+	{"seek-index", required_argument, NULL, 'I'},
+	{"write-buffer", required_argument, NULL, 'W'},
+	{"loudness", no_argument, NULL, 'l'},
+	{"peaks", no_argument, NULL, 'k'},
+	{"manifest", no_argument, NULL, 'K'},
 	{"no-start-server", no_argument, NULL, 'S'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"quiet", no_argument, NULL, 'q'},
@@ -256,16 +380,26 @@ int main(int argc, char* argv[]) {
 	int auto_connect = 1;
 	char* client_name = JACKOFF_DEFAULT_CLIENT_NAME;
 	char* format_name = JACKOFF_DEFAULT_FORMAT;
-	char* filename = NULL;
-	int bitrate = -1;
-	size_t channels = 0;
+	char* config_path = NULL;
+	char* metrics_path = NULL;
+	char* spill_dir = NULL;
+	float spill_duration = JACKOFF_DEFAULT_SPILL_DURATION;
+	jackoff_recording_t defaults;
+	jackoff_recording_t* recordings;
+	size_t recording_count;
 	float buffer_duration = JACKOFF_DEFAULT_RING_BUFFER_DURATION;
-	jackoff_format_t* output_format;
 	jack_options_t jack_options = JackNullOption;
-	time_t duration = 0;
-	struct port_info manual_ports;
-	manual_ports.count = 0;
-	manual_ports.ports = NULL;
+	jackoff_thread_policy_t writer_policy;
+	size_t writer_threads = 1;
+	int capture_flags = 0;
+	memset(&writer_policy, 0, sizeof(writer_policy));
+	memset(&defaults, 0, sizeof(defaults));
+	defaults.settings.bitrate = -1;
+	defaults.settings.sample_rate = 0;
+	defaults.settings.matrix = NULL;
+	defaults.settings.dither = JACKOFF_DITHER_DEFAULT;
+	defaults.settings.stream_backlog = JACKOFF_DEFAULT_STREAM_BACKLOG;
+	defaults.settings.write_buffer = JACKOFF_DEFAULT_WRITE_BUFFER;
 	
 	int option, long_index;
 	while (1) {
@@ -285,23 +419,125 @@ int main(int argc, char* argv[]) {
 			case 'f':
 				format_name = optarg;
 				break;
+			case 'F':
+				config_path = optarg;
+				break;
 			case 'b':
-				bitrate = (int) strtol(optarg, NULL, 0);
+				defaults.settings.bitrate = (int) strtol(optarg, NULL, 0);
+				break;
+			case 'r':
+				defaults.settings.sample_rate = (jack_nframes_t) strtol(optarg,
+					NULL, 0);
 				break;
 			case 'c':
-				channels = (size_t) strtol(optarg, NULL, 0);
+				defaults.channels = (size_t) strtol(optarg, NULL, 0);
+				break;
+			case 'm':
+				defaults.settings.matrix = jackoff_load_matrix(optarg);
+				if (!defaults.settings.matrix) {
+					jackoff_error("error loading channel matrix");
+				}
+				break;
+			case 'D':
+				if (!jackoff_parse_dither(optarg, &defaults.settings.dither)) {
+					jackoff_error("unknown dither \"%s\"", optarg);
+				}
+				break;
+			case 'B':
+				if (!jackoff_parse_backpressure(optarg,
+					&defaults.settings.stream_backlog))
+				{
+					jackoff_error("invalid backpressure policy \"%s\"", optarg);
+				}
 				break;
 			case 'd':
-				duration = (time_t) strtol(optarg, NULL, 0);
+				defaults.duration = strtod(optarg, NULL);
+				break;
+			case 's':
+				defaults.start_at = strtod(optarg, NULL);
+				break;
+			case 'e':
+				defaults.stop_at = strtod(optarg, NULL);
 				break;
 			case 'R':
 				buffer_duration = (float) strtod(optarg, NULL);
 				break;
+			case 'T':
+				if (0 == strcmp(optarg, "blocks")) {
+					capture_flags |= JACKOFF_TRANSPORT_BLOCKS;
+				} else if (0 == strcmp(optarg, "ring")) {
+					capture_flags &= ~JACKOFF_TRANSPORT_BLOCKS;
+				} else {
+					jackoff_error("unknown transport \"%s\"", optarg);
+				}
+				break;
 			case 'p':
-				if (!parse_ports(optarg, &manual_ports)) {
+				if (!jackoff_parse_ports(optarg, &defaults.port_count,
+					&defaults.ports))
+				{
 					jackoff_error("error parsing manual port list");
 				}
 				break;
+			case 'L':
+				capture_flags |= JACKOFF_RING_LOCKED;
+				break;
+			case 'H':
+				capture_flags |= JACKOFF_RING_HUGE_PAGES;
+				break;
+			case 'P':
+				if (!jackoff_parse_thread_priority(optarg, &writer_policy)) {
+					jackoff_error("invalid writer priority \"%s\"", optarg);
+				}
+				break;
+			case 'C':
+				if (!jackoff_parse_cpu_set(optarg, &writer_policy)) {
+					jackoff_error("invalid CPU list \"%s\"", optarg);
+				}
+				break;
+			case 'w':
+				writer_threads = (size_t) strtol(optarg, NULL, 0);
+				if (writer_threads < 1) {
+					jackoff_error("need at least one writer thread");
+				}
+				break;
+			case 'j':
+				jackoff_set_compress_threads((size_t) strtol(optarg, NULL, 0));
+				break;
+			case 'M':
+				metrics_path = optarg;
+				break;
+			case 'x':
+				spill_dir = optarg;
+				break;
+			case 'X':
+				spill_duration = (float) strtod(optarg, NULL);
+				if (spill_duration <= 0) {
+					jackoff_error("invalid spill duration \"%s\"", optarg);
+				}
+				break;
+			case 'I':
+				defaults.settings.seek_interval = strtod(optarg, NULL);
+				if (defaults.settings.seek_interval <= 0) {
+					jackoff_error("invalid seek index interval \"%s\"", optarg);
+				}
+				break;
+			case 'W':
+				if (!jackoff_parse_write_buffer(optarg,
+					&defaults.settings.write_buffer,
+					&defaults.settings.write_thread))
+				{
+					jackoff_error("invalid write buffer \"%s\"", optarg);
+				}
+				break;
+			case 'l':
+				defaults.settings.loudness = 1;
+				break;
+			case 'k':
+				defaults.settings.peaks = 1;
+				break;
+			case 'K':
+				defaults.settings.manifest = 1;
+				break;
 			case 'S':
 				jack_options |= JackNoStartServer;
 				break;
@@ -317,33 +553,40 @@ int main(int argc, char* argv[]) {
 		}
 	}
 	
-	if (channels == 0) {
-		if (manual_ports.count > 0)
-			channels = manual_ports.count;
-		else
-			channels = JACKOFF_DEFAULT_CHANNELS;
-	}
-	
-	if (bitrate == -1) {
-		bitrate = JACKOFF_DEFAULT_BITRATE_PER_CHANNEL * (int) channels;
+	defaults.format = jackoff_get_output_format(format_name);
+	if (!defaults.format) {
+		jackoff_error("unknown output format \"%s\"", format_name);
 	}
 	
 	argc -= optind;
 	argv += optind;
-	if (argc != 1) {
-		jackoff_error("must provide the name of a file to record to");
+	if (config_path) {
+		if (argc != 0) {
+			jackoff_error("the output files are named in the configuration "
+				"file");
+		}
+		
+		recordings = jackoff_load_config(config_path, &defaults,
+			&recording_count);
+		if (!recordings) {
+			jackoff_error("error loading configuration file");
+		}
 	} else {
-		filename = argv[0];
-	}
-	
-	output_format = jackoff_get_output_format(format_name);
-	if (!output_format) {
-		jackoff_error("unknown output format \"%s\"", format_name);
+		if (argc != 1) {
+			jackoff_error("must provide the name of a file to record to");
+		}
+		
+		defaults.file_path = argv[0];
+		if (jackoff_resolve_recording(&defaults) != 0) {
+			jackoff_error("invalid recording options");
+		}
+		recordings = &defaults;
+		recording_count = 1;
 	}
 	
-	return run(manual_ports.count, (const char**) manual_ports.ports,
-		client_name, filename, output_format, bitrate, channels,
-		buffer_duration, duration, jack_options);
+	return run(recordings, recording_count, client_name, jack_options,
+		buffer_duration, writer_threads, &writer_policy, capture_flags,
+		metrics_path, spill_dir, spill_duration);
 }
 
 static void show_usage_info(char* prog_name) {
@@ -351,6 +594,7 @@ static void show_usage_info(char* prog_name) {
 	
 	printf("%s\n\n", PACKAGE_STRING);
 	printf("Usage: %s [options] <output filename>\n", prog_name);
+	printf("       %s [options] -F <configuration file>\n", prog_name);
 	printf("  -a, --auto-connect                  automatically connect "
 		"JACK ports\n");
 	printf("  -p PORTS, --ports=PORTS             comma-separated list of "
@@ -358,11 +602,70 @@ static void show_usage_info(char* prog_name) {
 	printf("                                      to record from\n");
 	printf("  -n, --client-name                   JACK client name\n");
 	printf("  -f FORMAT, --format=FORMAT          output format\n");
+	printf("  -F FILE, --config=FILE              make the recordings listed "
+		"in FILE\n");
+	printf("  -r RATE, --sample-rate=RATE         sample rate of the "
+		"recording\n");
 	printf("  -c CHANNELS, --channels=CHANNELS    number of channels\n");
+	printf("  -m FILE, --matrix=FILE              mix channels down using the "
+		"gain\n");
+	printf("                                      matrix in FILE\n");
+	printf("  -D TYPE, --dither=TYPE              \"tpdf\" or \"none\" when "
+		"writing PCM\n");
+	printf("                                      [tpdf at 16 bits, else "
+		"none]\n");
+	printf("  -B POLICY, --backpressure=POLICY    when a stream reader is "
+		"slow, \"drop\" audio\n");
+	printf("                                      or \"buffer:MB\" first "
+		"[buffer:16]\n");
 	printf("  -d SECONDS, --duration=SECONDS      stop recording after the "
 		"given time\n");
+	printf("  -s TIME, --start-at=TIME            start recording at the "
+		"given UNIX time\n");
+	printf("  -e TIME, --stop-at=TIME             stop recording at the "
+		"given UNIX time\n");
 	printf("  -R SECONDS, --buffer=SECONDS        length of the ring "
 		"buffer\n");
+	printf("  -L, --lock-memory                   lock buffers into RAM\n");
+	printf("  -H, --huge-pages                    put the ring buffers on huge "
+		"pages\n");
+	printf("  -P PRIO, --writer-priority=PRIO     realtime priority of the "
+		"writer; prefix\n");
+	printf("                                      with rr: for SCHED_RR\n");
+	printf("  -C CPUS, --writer-cpus=CPUS         pin the writer to a CPU list "
+		"or to\n");
+	printf("                                      a NUMA node (e.g. node0)\n");
+	printf("  -w N, --writer-threads=N            number of threads writing "
+		"audio [1]\n");
+	printf("  -j N, --compress-threads=N          number of threads "
+		"compressing native\n");
+	printf("                                      files [one per CPU]\n");
+	printf("  -T TYPE, --transport=TYPE           hand audio to the writer in "
+		"a \"ring\"\n");
+	printf("                                      buffer or in \"blocks\" "
+		"[ring]\n");
+	printf("  -M FILE, --metrics=FILE             keep Prometheus metrics in "
+		"FILE\n");
+	printf("  -x DIR, --spill-dir=DIR             spill audio to a file in DIR "
+		"when the\n");
+	printf("                                      writer falls behind\n");
+	printf("  -X SECONDS, --spill-duration=SECONDS  size of the spill file "
+		"[600]\n");
+	printf("  -I SECONDS, --seek-index=SECONDS    write a seek index with an "
+		"entry every\n");
+	printf("                                      SECONDS (libsndfile "
+		"formats)\n");
+	printf("  -W MB, --write-buffer=MB            gather libsndfile's writes "
+		"into MB; prefix\n");
+	printf("                                      with thread: to write from "
+		"a thread [1]\n");
+	printf("  -l, --loudness                      measure EBU R128 loudness "
+		"and true peak\n");
+	printf("                                      into FILE.loudness\n");
+	printf("  -k, --peaks                         write a waveform overview "
+		"to FILE.peaks\n");
+	printf("  -K, --manifest                      checksum the file into "
+		"FILE.manifest\n");
 	printf("  -S, --no-start-server               don't start jackd if it "
 		"isn't running\n");
 	printf("  -v, --verbose                       include debug output\n");
@@ -377,33 +680,7 @@ static void show_usage_info(char* prog_name) {
 		printf("\n");
 	}
 }
-
-static int parse_ports(char* port_value, struct port_info* info) {
-	size_t count = 1;
-	char* c;
-	char* last_start;
-	info->ports = NULL;
-	
-	last_start = port_value;
-	for (c = port_value; *c != 0; c++) {
-		if (*c == ',') {
-			info->ports = realloc(info->ports, count * sizeof(char*));
-			if (!info->ports)
-				return 0;
-			info->ports[count - 1] = last_start;
-			last_start = (c + 1);
-			*c = 0;
-			count++;
-		}
-	}
-	
-	info->ports = realloc(info->ports, count * sizeof(char*));
-	if (!info->ports)
-		return 0;
-	info->ports[count - 1] = last_start;
-	info->count = count;
-	return 1;
-}
+#endif
 
 static void handle_jack_error(const char* message) {
 	jackoff_warn("JACK: %s", message);
@@ -412,3 +689,20 @@ static void handle_jack_error(const char* message) {
 static void handle_jack_info(const char* message) {
 	jackoff_info("JACK: %s", message);
 }
+
+/*
+ * Converts a wall-clock time (seconds since the epoch) into a time on the JACK
+ * clock, which the process callback can turn into an exact frame. Times in the
+ * past map to "now".
+ */
+static jack_time_t wall_clock_to_jack_time(double when) {
+	struct timeval now;
+	jack_time_t jack_now = jack_get_time();
+	double delta;
+	
+	gettimeofday(&now, NULL);
+	delta = when - (now.tv_sec + now.tv_usec / 1000000.0);
+	if (delta <= 0)
+		return jack_now;
+	return jack_now + (jack_time_t) (delta * 1000000.0);
+}
@@ -22,7 +22,10 @@
 
 //#include "config.h"
 #include "client.h"
+#include "mixer.h"
+#include "convert.h"
 
+#include <stdint.h>
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
@@ -31,20 +34,76 @@
 #define JACKOFF_DEFAULT_BITRATE_PER_CHANNEL 128
 #define JACKOFF_DEFAULT_CHANNELS 2
 #define JACKOFF_DEFAULT_RING_BUFFER_DURATION 2.0
-#define JACKOFF_WRITE_BUFFER_SIZE 4098
+#define JACKOFF_DEFAULT_WRITE_BUFFER (1024 * 1024)
+#define JACKOFF_DEFAULT_STREAM_BACKLOG (16 * 1024 * 1024)
+#define JACKOFF_METRICS_INTERVAL 5.0
+#define JACKOFF_DEFAULT_SPILL_DURATION 600.0
+#define JACKOFF_MAX_DURATION_FRAMES ((uint64_t) 1 << 62)
 
 typedef struct jackoff_output_format jackoff_format_t;
 typedef struct jackoff_session jackoff_session_t;
 typedef struct jackoff_encoder jackoff_encoder_t;
+typedef struct jackoff_settings jackoff_settings_t;
+typedef struct jackoff_recording jackoff_recording_t;
 
 struct jackoff_output_format {
 	const char* name;
 	const char* description;
 	jackoff_encoder_t* (*create_encoder)(jackoff_client_t* client,
-		jackoff_format_t* format, int bitrate);
+		jackoff_format_t* format, const jackoff_settings_t* settings);
 	int options;
 };
 
+/*
+ * Options that control how captured audio is processed and encoded.
+ */
+struct jackoff_settings {
+	int bitrate;
+	jack_nframes_t sample_rate; // output rate; 0 to record at JACK's rate
+	const jackoff_matrix_t* matrix; // mixdown; NULL to record every channel
+	jackoff_dither_t dither; // for formats that store integer PCM
+	size_t stream_backlog; // bytes a stream may hold for a slow reader
+	double seek_interval; // seconds between seek index entries; 0 for none
+	size_t write_buffer; // bytes libsndfile's writes are gathered into
+	int write_thread; // nonzero to write the buffer from its own thread
+	int loudness; // nonzero to measure loudness into "<file>.loudness"
+	int peaks; // nonzero to write a waveform overview to "<file>.peaks"
+	int manifest; // nonzero to checksum the file into "<file>.manifest"
+};
+
+
+/*
+ * One recording: where its audio comes from, how and where it is written,
+ * and when. Any number of them can share a process and a JACK client.
+ */
+struct jackoff_recording {
+	const char* name;
+	const char* file_path;
+	jackoff_format_t* format;
+	jackoff_settings_t settings;
+	size_t channels;
+	size_t port_count;
+	char** ports;
+	double duration; // seconds; 0 for no limit
+	double start_at; // UNIX times; 0 for none
+	double stop_at;
+	
+	jackoff_client_t* client;
+	jackoff_encoder_t* encoder;
+	jackoff_session_t* session;
+	int claimed; // by a writer thread
+	volatile int done;
+	int failed;
+	uint64_t opened_at; // CLOCK_MONOTONIC nanoseconds; 0 if never
+	uint64_t closed_at;
+	uint64_t behind_since; // when the writer fell behind; 0 if it hasn't
+	
+	/* When JACK's sample rate changes, the recording goes on in a new file
+	 * beside the first, numbered from 2. */
+	unsigned int segments; // files begun after file_path
+	char* segment_path; // NULL while recording to file_path
+	size_t segment_start; // frames read before the current file
+};
 
 struct jackoff_encoder {
 	jackoff_session_t* (*open)(jackoff_client_t* client,
@@ -63,7 +122,7 @@ struct jackoff_session {
 jackoff_format_t* jackoff_get_output_format(const char* name);
 
 jackoff_encoder_t* jackoff_create_encoder(jackoff_client_t* client,
-	jackoff_format_t* format, int bitrate);
+	jackoff_format_t* format, const jackoff_settings_t* settings);
 void jackoff_destroy_encoder(jackoff_encoder_t* encoder);
 
 jackoff_session_t* jackoff_open_session(jackoff_client_t* client,
@@ -72,5 +131,6 @@ int jackoff_close_session(jackoff_session_t* session);
 long jackoff_write_session(jackoff_session_t* session);
 
 void jackoff_shutdown();
+int jackoff_is_running();
 
 #endif
@@ -0,0 +1,502 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "loudness.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Loudness is measured over 400 ms blocks and 3 s windows, both stepping by
+// 100 ms; the sub-block ring holds enough 100 ms steps for the longer one.
+#define SUB_BLOCKS_PER_BLOCK 4
+#define SUB_BLOCKS_PER_WINDOW 30
+#define ABSOLUTE_GATE -70.0
+#define INTEGRATED_RELATIVE_GATE -10.0
+#define RANGE_RELATIVE_GATE -20.0
+#define RANGE_LOW_PERCENTILE 0.10
+#define RANGE_HIGH_PERCENTILE 0.95
+
+// Histogram bins: 0.1 LU each from the absolute gate up to +10 LUFS.
+#define HISTOGRAM_STEP 0.1
+#define HISTOGRAM_BINS 800
+
+// True peak is found by 4x oversampling through this 48-tap filter, split
+// into four 12-tap phases (the one given in BS.1770-4, Annex 2). The table
+// is laid out by tap, one column per phase, so that all four phases of an
+// output sample come out of one vector multiply-add per tap.
+#define TRUE_PEAK_TAPS 12
+#define TRUE_PEAK_PHASES 4
+#define TRUE_PEAK_BLOCK 1024
+
+static const float true_peak_filter[TRUE_PEAK_TAPS][TRUE_PEAK_PHASES]
+	__attribute__((aligned(16))) =
+{
+	{0.0017089843750f, -0.0291748046875f, -0.0189208984375f, -0.0083007812500f},
+	{0.0109863281250f, 0.0292968750000f, 0.0330810546875f, 0.0148925781250f},
+	{-0.0196533203125f, -0.0517578125000f, -0.0582275390625f, -0.0266113281250f},
+	{0.0332031250000f, 0.0891113281250f, 0.1015625000000f, 0.0476074218750f},
+	{-0.0594482421875f, -0.1665039062500f, -0.2003173828125f, -0.1022949218750f},
+	{0.1373291015625f, 0.4650878906250f, 0.7797851562500f, 0.9721679687500f},
+	{0.9721679687500f, 0.7797851562500f, 0.4650878906250f, 0.1373291015625f},
+	{-0.1022949218750f, -0.2003173828125f, -0.1665039062500f, -0.0594482421875f},
+	{0.0476074218750f, 0.1015625000000f, 0.0891113281250f, 0.0332031250000f},
+	{-0.0266113281250f, -0.0582275390625f, -0.0517578125000f, -0.0196533203125f},
+	{0.0148925781250f, 0.0330810546875f, 0.0292968750000f, 0.0109863281250f},
+	{-0.0083007812500f, -0.0189208984375f, -0.0291748046875f, 0.0017089843750f}
+};
+
+typedef struct {
+	double b0, b1, b2, a1, a2;
+} biquad_t;
+
+typedef struct {
+	double z1, z2;
+} biquad_state_t;
+
+typedef struct {
+	unsigned long long counts[HISTOGRAM_BINS];
+	double energy[HISTOGRAM_BINS]; // summed over the blocks in each bin
+} histogram_t;
+
+struct jackoff_loudness {
+	size_t channels;
+	double* weights; // per channel
+	biquad_t shelf; // the K-weighting pre-filter
+	biquad_t highpass; // and its RLB high-pass
+	biquad_state_t* shelf_states;
+	biquad_state_t* highpass_states;
+	
+	size_t sub_block_frames; // 100 ms
+	size_t sub_block_fill;
+	double sub_block_energy; // weighted sum of squares so far
+	double sub_blocks[SUB_BLOCKS_PER_WINDOW]; // mean-square energies
+	size_t sub_block_count; // total, for knowing when the ring is full
+	
+	histogram_t blocks; // 400 ms, for integrated loudness
+	histogram_t windows; // 3 s, for loudness range
+	
+	float** history; // per channel: TRUE_PEAK_TAPS - 1 samples, then input
+	float true_peak;
+	float sample_peak;
+	unsigned long long frames;
+};
+
+static void design_filters(jackoff_loudness_t* meter, double rate);
+static void add_sub_block(jackoff_loudness_t* meter);
+static void add_to_histogram(histogram_t* histogram, double energy);
+static double gated_mean(const histogram_t* histogram, double gate,
+	size_t* first_bin, unsigned long long* count);
+static double energy_to_loudness(double energy);
+static double bin_loudness(size_t bin);
+static float find_true_peak(const float* samples, size_t count, float peak);
+
+/*
+ * Creates a meter for audio with the given channels and rate. Six channels
+ * are taken to be 5.1 in the usual order (L R C LFE Ls Rs): the LFE is left
+ * out and the surrounds weighted by +1.5 dB. Any other layout counts every
+ * channel equally.
+ */
+jackoff_loudness_t* jackoff_create_loudness(size_t channels,
+	unsigned int sample_rate)
+{
+	jackoff_loudness_t* meter;
+	size_t c;
+	
+	meter = calloc(1, sizeof(jackoff_loudness_t));
+	if (!meter) {
+		jackoff_warn("Failed to allocate the loudness meter.");
+		return NULL;
+	}
+	
+	meter->channels = channels;
+	meter->weights = calloc(channels, sizeof(double));
+	meter->shelf_states = calloc(channels, sizeof(biquad_state_t));
+	meter->highpass_states = calloc(channels, sizeof(biquad_state_t));
+	meter->history = calloc(channels, sizeof(float*));
+	if (!meter->weights || !meter->shelf_states ||
+		!meter->highpass_states || !meter->history)
+	{
+		jackoff_destroy_loudness(meter);
+		jackoff_warn("Failed to allocate the loudness meter.");
+		return NULL;
+	}
+	
+	for (c = 0; c < channels; c++) {
+		meter->history[c] = calloc(TRUE_PEAK_TAPS - 1 + TRUE_PEAK_BLOCK,
+			sizeof(float));
+		if (!meter->history[c]) {
+			jackoff_destroy_loudness(meter);
+			jackoff_warn("Failed to allocate the loudness meter.");
+			return NULL;
+		}
+		
+		if (channels == 6)
+			meter->weights[c] = (c == 3) ? 0.0 : (c >= 4) ? 1.41 : 1.0;
+		else
+			meter->weights[c] = 1.0;
+	}
+	
+	design_filters(meter, sample_rate);
+	meter->sub_block_frames = (sample_rate + 5) / 10;
+	return meter;
+}
+
+void jackoff_destroy_loudness(jackoff_loudness_t* meter) {
+	size_t c;
+	
+	if (meter->history) {
+		for (c = 0; c < meter->channels; c++)
+			free(meter->history[c]);
+		free(meter->history);
+	}
+	free(meter->weights);
+	free(meter->shelf_states);
+	free(meter->highpass_states);
+	free(meter);
+}
+
+/*
+ * Measures the next frames of planar audio.
+ */
+void jackoff_measure_loudness(jackoff_loudness_t* meter,
+	float* const* channels, size_t frames)
+{
+	const biquad_t* shelf = &meter->shelf;
+	const biquad_t* highpass = &meter->highpass;
+	biquad_state_t* s;
+	biquad_state_t* h;
+	size_t done, count, i, c;
+	double x, y, energy;
+	float* history;
+	float* block;
+	
+	for (done = 0; done < frames; done += count) {
+		// Stop at the end of each sub-block, which is when the channel sums
+		// are combined.
+		count = meter->sub_block_frames - meter->sub_block_fill;
+		if (count > frames - done)
+			count = frames - done;
+		
+		for (c = 0; c < meter->channels; c++) {
+			if (meter->weights[c] == 0.0)
+				continue;
+			s = &meter->shelf_states[c];
+			h = &meter->highpass_states[c];
+			energy = 0.0;
+			
+			// Transposed direct form II, in double precision: the high-pass
+			// sits at 38 Hz, far below where single precision holds up.
+			// A NaN or infinity would stay in the filter state for good, so
+			// they count as silence.
+			for (i = done; i < done + count; i++) {
+				x = channels[c][i];
+				if (!isfinite(x))
+					x = 0.0;
+				y = shelf->b0 * x + s->z1;
+				s->z1 = shelf->b1 * x - shelf->a1 * y + s->z2;
+				s->z2 = shelf->b2 * x - shelf->a2 * y;
+				x = y;
+				y = highpass->b0 * x + h->z1;
+				h->z1 = highpass->b1 * x - highpass->a1 * y + h->z2;
+				h->z2 = highpass->b2 * x - highpass->a2 * y;
+				energy += y * y;
+			}
+			meter->sub_block_energy += meter->weights[c] * energy;
+		}
+		
+		meter->sub_block_fill += count;
+		if (meter->sub_block_fill == meter->sub_block_frames)
+			add_sub_block(meter);
+	}
+	
+	// The peaks are taken a piece at a time, behind the filter's history.
+	for (c = 0; c < meter->channels; c++) {
+		history = meter->history[c];
+		for (done = 0; done < frames; done += count) {
+			count = frames - done;
+			if (count > TRUE_PEAK_BLOCK)
+				count = TRUE_PEAK_BLOCK;
+			
+			block = history + TRUE_PEAK_TAPS - 1;
+			memcpy(block, channels[c] + done, count * sizeof(float));
+			for (i = 0; i < count; i++) {
+				if (!isfinite(block[i]))
+					block[i] = 0.0f;
+				if (fabsf(block[i]) > meter->sample_peak)
+					meter->sample_peak = fabsf(block[i]);
+			}
+			meter->true_peak = find_true_peak(history, count,
+				meter->true_peak);
+			memmove(history, history + count,
+				(TRUE_PEAK_TAPS - 1) * sizeof(float));
+		}
+	}
+	
+	meter->frames += frames;
+}
+
+void jackoff_loudness_result(const jackoff_loudness_t* meter,
+	jackoff_loudness_result_t* result)
+{
+	unsigned long long count, seen, low_rank, high_rank;
+	size_t first_bin, bin;
+	double mean, low = 0.0, high = 0.0;
+	
+	// Integrated: blocks above the absolute gate give a relative gate, and
+	// the blocks above that give the answer.
+	mean = gated_mean(&meter->blocks, ABSOLUTE_GATE, &first_bin, &count);
+	if (count > 0) {
+		mean = gated_mean(&meter->blocks, energy_to_loudness(mean) +
+			INTEGRATED_RELATIVE_GATE, &first_bin, &count);
+	}
+	result->integrated = (count > 0) ? energy_to_loudness(mean) : -HUGE_VAL;
+	
+	// Range: the spread between the 10th and 95th percentiles of the 3 s
+	// windows that pass their own relative gate.
+	mean = gated_mean(&meter->windows, ABSOLUTE_GATE, &first_bin, &count);
+	if (count > 0) {
+		gated_mean(&meter->windows, energy_to_loudness(mean) +
+			RANGE_RELATIVE_GATE, &first_bin, &count);
+	}
+	if (count > 0) {
+		low_rank = (unsigned long long) (RANGE_LOW_PERCENTILE * (count - 1));
+		high_rank = (unsigned long long) (RANGE_HIGH_PERCENTILE * (count - 1));
+		seen = 0;
+		for (bin = first_bin; bin < HISTOGRAM_BINS; bin++) {
+			if (seen <= low_rank &&
+				seen + meter->windows.counts[bin] > low_rank)
+				low = bin_loudness(bin);
+			if (seen <= high_rank &&
+				seen + meter->windows.counts[bin] > high_rank)
+				high = bin_loudness(bin);
+			seen += meter->windows.counts[bin];
+		}
+	}
+	result->range = high - low;
+	
+	result->true_peak = 20.0 * log10(meter->true_peak);
+	result->sample_peak = 20.0 * log10(meter->sample_peak);
+	result->frames = meter->frames;
+}
+
+/*
+ * Logs the measurement and writes it beside the recording, as
+ * "<file>.loudness", then frees the meter. Returns 0 on success.
+ */
+int jackoff_finish_loudness(jackoff_loudness_t* meter, const char* file_path)
+{
+	jackoff_loudness_result_t result;
+	FILE* file;
+	char* path;
+	int status = 0;
+	
+	jackoff_loudness_result(meter, &result);
+	jackoff_destroy_loudness(meter);
+	
+	jackoff_info("\"%s\": %.1f LUFS integrated, %.1f LU range, "
+		"%.1f dBTP true peak.", file_path, result.integrated, result.range,
+		result.true_peak);
+	if (0 == strcmp(file_path, "-"))
+		return 0; // standard output has nothing beside it
+	
+	path = malloc(strlen(file_path) + sizeof(".loudness"));
+	if (!path) {
+		jackoff_warn("Failed to allocate memory for the loudness file name.");
+		return -1;
+	}
+	sprintf(path, "%s.loudness", file_path);
+	
+	file = fopen(path, "w");
+	if (!file) {
+		jackoff_warn("Failed to create \"%s\".", path);
+		free(path);
+		return -1;
+	}
+	fprintf(file, "# EBU R128: integrated loudness in LUFS, loudness range "
+		"in LU,\n# true peak in dBTP, sample peak in dBFS\n");
+	fprintf(file, "[loudness]\n");
+	fprintf(file, "integrated = %.2f\n", result.integrated);
+	fprintf(file, "range = %.2f\n", result.range);
+	fprintf(file, "true-peak = %.2f\n", result.true_peak);
+	fprintf(file, "sample-peak = %.2f\n", result.sample_peak);
+	fprintf(file, "frames = %llu\n", result.frames);
+	if (fclose(file) != 0) {
+		jackoff_warn("Failed to write \"%s\".", path);
+		status = -1;
+	}
+	
+	free(path);
+	return status;
+}
+
+/*
+ * The two K-weighting stages, by the bilinear transform of their analog
+ * prototypes, so that any sample rate gets the response BS.1770 specifies
+ * for 48 kHz.
+ */
+static void design_filters(jackoff_loudness_t* meter, double rate) {
+	double f0 = 1681.974450955533;
+	double gain = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / rate);
+	double vh = pow(10.0, gain / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+	
+	meter->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	meter->shelf.b1 = 2.0 * (k * k - vh) / a0;
+	meter->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	meter->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	meter->shelf.a2 = (1.0 - k / q + k * k) / a0;
+	
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / rate);
+	a0 = 1.0 + k / q + k * k;
+	
+	meter->highpass.b0 = 1.0;
+	meter->highpass.b1 = -2.0;
+	meter->highpass.b2 = 1.0;
+	meter->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+	meter->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+/*
+ * Closes a 100 ms sub-block, and with it a 400 ms block and a 3 s window
+ * once enough sub-blocks have gone by.
+ */
+static void add_sub_block(jackoff_loudness_t* meter) {
+	double energy = 0.0;
+	size_t i, index;
+	
+	meter->sub_blocks[meter->sub_block_count % SUB_BLOCKS_PER_WINDOW] =
+		meter->sub_block_energy / meter->sub_block_frames;
+	meter->sub_block_count++;
+	meter->sub_block_energy = 0.0;
+	meter->sub_block_fill = 0;
+	
+	for (i = 0; i < SUB_BLOCKS_PER_WINDOW && i < meter->sub_block_count;
+		i++)
+	{
+		index = (meter->sub_block_count - 1 - i) % SUB_BLOCKS_PER_WINDOW;
+		energy += meter->sub_blocks[index];
+		
+		if (i + 1 == SUB_BLOCKS_PER_BLOCK)
+			add_to_histogram(&meter->blocks, energy / SUB_BLOCKS_PER_BLOCK);
+		if (i + 1 == SUB_BLOCKS_PER_WINDOW)
+			add_to_histogram(&meter->windows, energy / SUB_BLOCKS_PER_WINDOW);
+	}
+}
+
+static void add_to_histogram(histogram_t* histogram, double energy) {
+	double loudness = energy_to_loudness(energy);
+	long bin;
+	
+	if (!isfinite(loudness) || loudness < ABSOLUTE_GATE)
+		return;
+	
+	bin = (long) ((loudness - ABSOLUTE_GATE) / HISTOGRAM_STEP);
+	if (bin >= HISTOGRAM_BINS)
+		bin = HISTOGRAM_BINS - 1;
+	histogram->counts[bin]++;
+	histogram->energy[bin] += energy;
+}
+
+/*
+ * Mean energy of the blocks in the bins at or above the gate. The bin
+ * holding the gate is counted whole, so the gate is good to 0.1 LU.
+ */
+static double gated_mean(const histogram_t* histogram, double gate,
+	size_t* first_bin, unsigned long long* count)
+{
+	double energy = 0.0;
+	size_t bin;
+	
+	*first_bin = (gate > ABSOLUTE_GATE) ?
+		(size_t) ((gate - ABSOLUTE_GATE) / HISTOGRAM_STEP) : 0;
+	if (*first_bin >= HISTOGRAM_BINS)
+		*first_bin = HISTOGRAM_BINS - 1;
+	
+	*count = 0;
+	for (bin = *first_bin; bin < HISTOGRAM_BINS; bin++) {
+		*count += histogram->counts[bin];
+		energy += histogram->energy[bin];
+	}
+	return (*count > 0) ? energy / *count : 0.0;
+}
+
+static double energy_to_loudness(double energy) {
+	return -0.691 + 10.0 * log10(energy);
+}
+
+static double bin_loudness(size_t bin) {
+	return ABSOLUTE_GATE + (bin + 0.5) * HISTOGRAM_STEP;
+}
+
+/*
+ * The largest magnitude among the 4x oversampled versions of `count`
+ * samples, which follow TRUE_PEAK_TAPS - 1 samples of history, or `peak`
+ * if that is larger.
+ */
+static float find_true_peak(const float* samples, size_t count, float peak)
+{
+	const float* x = samples + TRUE_PEAK_TAPS - 1;
+	size_t i, k;
+#if defined(__SSE__)
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 highest = _mm_set1_ps(peak);
+	__m128 sum;
+	float lanes[4];
+	
+	for (i = 0; i < count; i++) {
+		sum = _mm_setzero_ps();
+		for (k = 0; k < TRUE_PEAK_TAPS; k++) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(
+				_mm_load_ps(true_peak_filter[k]), _mm_set1_ps(x[i - k])));
+		}
+		highest = _mm_max_ps(highest, _mm_andnot_ps(sign, sum));
+	}
+	
+	_mm_storeu_ps(lanes, highest);
+	for (k = 0; k < 4; k++) {
+		if (lanes[k] > peak)
+			peak = lanes[k];
+	}
+	return peak;
+#else
+	float sum;
+	size_t p;
+	
+	for (i = 0; i < count; i++) {
+		for (p = 0; p < TRUE_PEAK_PHASES; p++) {
+			sum = 0.0f;
+			for (k = 0; k < TRUE_PEAK_TAPS; k++)
+				sum += true_peak_filter[k][p] * x[i - k];
+			if (fabsf(sum) > peak)
+				peak = fabsf(sum);
+		}
+	}
+	return peak;
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_LOUDNESS_H_
+#define _JACKOFF_LOUDNESS_H_
+
+#include <stdlib.h>
+
+/*
+ * Loudness and peak measurement after EBU R128 (ITU-R BS.1770-4), fed block
+ * by block as a recording is written. Gating works from histograms of block
+ * loudness in 0.1 LU steps, so memory stays constant however long the
+ * recording runs.
+ */
+typedef struct jackoff_loudness jackoff_loudness_t;
+
+typedef struct {
+	double integrated; // LUFS; -HUGE_VAL if nothing passed the gates
+	double range; // LU
+	double true_peak; // dBTP
+	double sample_peak; // dBFS
+	unsigned long long frames;
+} jackoff_loudness_result_t;
+
+jackoff_loudness_t* jackoff_create_loudness(size_t channels,
+	unsigned int sample_rate);
+void jackoff_destroy_loudness(jackoff_loudness_t* meter);
+void jackoff_measure_loudness(jackoff_loudness_t* meter,
+	float* const* channels, size_t frames);
+void jackoff_loudness_result(const jackoff_loudness_t* meter,
+	jackoff_loudness_result_t* result);
+int jackoff_finish_loudness(jackoff_loudness_t* meter, const char* file_path);
+
+#endif
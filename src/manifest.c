@@ -0,0 +1,387 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "manifest.h"
+#include "crc32c.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_LINE_LENGTH 256
+
+struct jackoff_manifest {
+	char* file_path;
+	
+	/* Bytes are checksummed as they arrive, for as long as they arrive in
+	 * order. Blocks written over afterwards, or anything past a gap, are
+	 * read back from the file when it is closed. */
+	uint64_t frontier; // bytes checksummed in order
+	uint32_t running; // checksum of the frontier's block so far
+	int running_dirty;
+	uint64_t gap; // where writes stopped arriving in order; -1 if they didn't
+	uint32_t* blocks; // of the blocks before the frontier's
+	unsigned char* dirty;
+	size_t count;
+	size_t capacity;
+};
+
+static int add_block(jackoff_manifest_t* manifest);
+static int read_block(int fd, uint64_t offset, size_t length,
+	unsigned char* buffer, uint32_t* crc);
+
+/*
+ * Starts checksumming a recording at file_path. Returns NULL on failure.
+ */
+jackoff_manifest_t* jackoff_create_manifest(const char* file_path) {
+	jackoff_manifest_t* manifest;
+	
+	manifest = calloc(1, sizeof(jackoff_manifest_t));
+	if (manifest)
+		manifest->file_path = strdup(file_path);
+	if (!manifest || !manifest->file_path) {
+		free(manifest);
+		jackoff_warn("Failed to allocate memory for the manifest.");
+		return NULL;
+	}
+	manifest->gap = (uint64_t) -1;
+	return manifest;
+}
+
+/*
+ * Tells the manifest that `size` bytes of data are being written to the
+ * file at the given offset.
+ */
+void jackoff_manifest_write(jackoff_manifest_t* manifest, uint64_t offset,
+	const void* data, size_t size)
+{
+	const unsigned char* bytes = data;
+	uint64_t end = offset + size;
+	uint64_t block_end;
+	size_t index, amount;
+	
+	if (offset > manifest->frontier) {
+		if (manifest->frontier < manifest->gap)
+			manifest->gap = manifest->frontier;
+		return;
+	}
+	
+	// Over what was already checksummed: a header being patched, say.
+	for (index = offset / JACKOFF_MANIFEST_BLOCK_SIZE;
+		offset < manifest->frontier && offset < end; index++)
+	{
+		if (index < manifest->count)
+			manifest->dirty[index] = 1;
+		else
+			manifest->running_dirty = 1;
+		block_end = (uint64_t) (index + 1) * JACKOFF_MANIFEST_BLOCK_SIZE;
+		amount = (size_t) (((block_end < end) ? block_end : end) - offset);
+		if (offset + amount > manifest->frontier)
+			amount = (size_t) (manifest->frontier - offset);
+		offset += amount;
+		bytes += amount;
+	}
+	
+	if (manifest->frontier >= manifest->gap)
+		return;
+	
+	while (offset < end) {
+		amount = JACKOFF_MANIFEST_BLOCK_SIZE -
+			(size_t) (offset % JACKOFF_MANIFEST_BLOCK_SIZE);
+		if (amount > end - offset)
+			amount = (size_t) (end - offset);
+		
+		manifest->running = jackoff_crc32c(manifest->running, bytes, amount);
+		offset += amount;
+		bytes += amount;
+		manifest->frontier = offset;
+		
+		if (offset % JACKOFF_MANIFEST_BLOCK_SIZE == 0 &&
+			add_block(manifest) != 0)
+		{
+			// Without room to keep it, the block is read back later.
+			manifest->gap = manifest->frontier - JACKOFF_MANIFEST_BLOCK_SIZE;
+			return;
+		}
+	}
+}
+
+/*
+ * Tells the manifest that writes from the given offset on may not have
+ * reached the file, so the blocks there are read back rather than trusted.
+ */
+void jackoff_manifest_write_failed(jackoff_manifest_t* manifest,
+	uint64_t offset)
+{
+	size_t index;
+	
+	for (index = offset / JACKOFF_MANIFEST_BLOCK_SIZE;
+		index < manifest->count; index++)
+		manifest->dirty[index] = 1;
+	if (offset / JACKOFF_MANIFEST_BLOCK_SIZE <= manifest->count)
+		manifest->running_dirty = 1;
+}
+
+/*
+ * Completes the checksums once everything has been written to the file
+ * (fd, which must be readable should any of it need reading back), writes
+ * the manifest as "<file>.manifest", and frees the manifest. Returns 0 on
+ * success.
+ */
+int jackoff_finish_manifest(jackoff_manifest_t* manifest, int fd) {
+	unsigned char* buffer = NULL;
+	struct stat status;
+	uint64_t size, offset;
+	size_t blocks, length, i;
+	uint32_t crc, whole = 0;
+	uint32_t* crcs = NULL;
+	size_t reread = 0;
+	const char* name;
+	char* path = NULL;
+	FILE* file = NULL;
+	int result = -1;
+	
+	if (fstat(fd, &status) != 0) {
+		jackoff_warn("Failed to check the size of \"%s\": %s",
+			manifest->file_path, strerror(errno));
+		goto done;
+	}
+	size = (uint64_t) status.st_size;
+	blocks = (size_t) ((size + JACKOFF_MANIFEST_BLOCK_SIZE - 1) /
+		JACKOFF_MANIFEST_BLOCK_SIZE);
+	
+	crcs = calloc(blocks ? blocks : 1, sizeof(uint32_t));
+	if (!crcs) {
+		jackoff_warn("Failed to allocate memory for the manifest.");
+		goto done;
+	}
+	
+	for (i = 0; i < blocks; i++) {
+		offset = (uint64_t) i * JACKOFF_MANIFEST_BLOCK_SIZE;
+		length = (size - offset < JACKOFF_MANIFEST_BLOCK_SIZE) ?
+			(size_t) (size - offset) : JACKOFF_MANIFEST_BLOCK_SIZE;
+		
+		// Keep what was taken in passing, if it still covers the block.
+		if (length == JACKOFF_MANIFEST_BLOCK_SIZE && i < manifest->count &&
+			!manifest->dirty[i])
+		{
+			crcs[i] = manifest->blocks[i];
+		} else if (i == manifest->count && !manifest->running_dirty &&
+			manifest->frontier == size && manifest->gap == (uint64_t) -1)
+		{
+			crcs[i] = manifest->running;
+		} else {
+			if (!buffer && !(buffer = malloc(JACKOFF_MANIFEST_BLOCK_SIZE))) {
+				jackoff_warn("Failed to allocate memory for the manifest.");
+				goto done;
+			}
+			if (read_block(fd, offset, length, buffer, &crc) != 0) {
+				jackoff_warn("Failed to read back \"%s\": %s",
+					manifest->file_path, strerror(errno));
+				goto done;
+			}
+			crcs[i] = crc;
+			reread++;
+		}
+		whole = jackoff_crc32c_combine(whole, crcs[i], length);
+	}
+	
+	path = malloc(strlen(manifest->file_path) + sizeof(".manifest"));
+	if (!path) {
+		jackoff_warn("Failed to allocate memory for the manifest file name.");
+		goto done;
+	}
+	sprintf(path, "%s.manifest", manifest->file_path);
+	
+	file = fopen(path, "w");
+	if (!file) {
+		jackoff_warn("Failed to create \"%s\": %s", path, strerror(errno));
+		goto done;
+	}
+	name = strrchr(manifest->file_path, '/');
+	name = name ? name + 1 : manifest->file_path;
+	fprintf(file, "# CRC-32C of the whole file, then of each block in turn\n");
+	fprintf(file, "[manifest]\n");
+	fprintf(file, "file = %s\n", name);
+	fprintf(file, "size = %llu\n", (unsigned long long) size);
+	fprintf(file, "block-size = %u\n", JACKOFF_MANIFEST_BLOCK_SIZE);
+	fprintf(file, "crc32c = %08x\n", whole);
+	for (i = 0; i < blocks; i++)
+		fprintf(file, "block = %08x\n", crcs[i]);
+	if (fclose(file) != 0) {
+		jackoff_warn("Failed to write \"%s\": %s", path, strerror(errno));
+		goto done;
+	}
+	
+	jackoff_debug("Wrote \"%s\"; %lu of %lu blocks were read back.", path,
+		reread, blocks);
+	result = 0;
+	
+done:
+	free(path);
+	free(buffer);
+	free(crcs);
+	jackoff_destroy_manifest(manifest);
+	return result;
+}
+
+/*
+ * Frees a manifest without writing it.
+ */
+void jackoff_destroy_manifest(jackoff_manifest_t* manifest) {
+	free(manifest->blocks);
+	free(manifest->dirty);
+	free(manifest->file_path);
+	free(manifest);
+}
+
+/*
+ * Reads a manifest written by jackoff_finish_manifest. Returns NULL if it
+ * can't be read or doesn't make sense.
+ */
+jackoff_checksums_t* jackoff_load_manifest(const char* path) {
+	jackoff_checksums_t* checksums;
+	char line[MAX_LINE_LENGTH];
+	char key[32];
+	char value[MAX_LINE_LENGTH];
+	unsigned long long number;
+	size_t expected, capacity = 0;
+	uint32_t* blocks;
+	FILE* file;
+	int valid = 1;
+	
+	file = fopen(path, "r");
+	if (!file) {
+		jackoff_warn("Failed to open \"%s\": %s", path, strerror(errno));
+		return NULL;
+	}
+	checksums = calloc(1, sizeof(jackoff_checksums_t));
+	if (!checksums) {
+		fclose(file);
+		jackoff_warn("Failed to allocate memory for the manifest.");
+		return NULL;
+	}
+	
+	while (valid && fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || line[0] == '[' || line[0] == '\n')
+			continue;
+		if (sscanf(line, " %31[a-z0-9-] = %255s", key, value) != 2) {
+			valid = 0;
+			break;
+		}
+		
+		if (0 == strcmp(key, "block")) {
+			if (checksums->count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				blocks = realloc(checksums->blocks,
+					capacity * sizeof(uint32_t));
+				if (!blocks) {
+					valid = 0;
+					break;
+				}
+				checksums->blocks = blocks;
+			}
+			valid = sscanf(value, "%llx", &number) == 1;
+			checksums->blocks[checksums->count++] = (uint32_t) number;
+		} else if (0 == strcmp(key, "crc32c")) {
+			valid = sscanf(value, "%llx", &number) == 1;
+			checksums->crc = (uint32_t) number;
+		} else if (0 == strcmp(key, "size")) {
+			valid = sscanf(value, "%llu", &number) == 1;
+			checksums->size = number;
+		} else if (0 == strcmp(key, "block-size")) {
+			valid = sscanf(value, "%llu", &number) == 1 && number > 0 &&
+				number <= 0xFFFFFFFFu;
+			checksums->block_size = (uint32_t) number;
+		}
+	}
+	fclose(file);
+	
+	if (valid && checksums->block_size) {
+		expected = (size_t) ((checksums->size + checksums->block_size - 1) /
+			checksums->block_size);
+		valid = (checksums->count == expected);
+	} else {
+		valid = 0;
+	}
+	if (!valid) {
+		jackoff_warn("\"%s\" is not a valid manifest.", path);
+		jackoff_free_checksums(checksums);
+		return NULL;
+	}
+	return checksums;
+}
+
+void jackoff_free_checksums(jackoff_checksums_t* checksums) {
+	free(checksums->blocks);
+	free(checksums);
+}
+
+/*
+ * Files away the checksum of the block just completed.
+ */
+static int add_block(jackoff_manifest_t* manifest) {
+	uint32_t* blocks;
+	unsigned char* dirty;
+	size_t capacity;
+	
+	if (manifest->count == manifest->capacity) {
+		capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+		blocks = realloc(manifest->blocks, capacity * sizeof(uint32_t));
+		if (!blocks)
+			return -1;
+		manifest->blocks = blocks;
+		dirty = realloc(manifest->dirty, capacity);
+		if (!dirty)
+			return -1;
+		manifest->dirty = dirty;
+		manifest->capacity = capacity;
+	}
+	
+	manifest->blocks[manifest->count] = manifest->running;
+	manifest->dirty[manifest->count] = (unsigned char) manifest->running_dirty;
+	manifest->count++;
+	manifest->running = 0;
+	manifest->running_dirty = 0;
+	return 0;
+}
+
+static int read_block(int fd, uint64_t offset, size_t length,
+	unsigned char* buffer, uint32_t* crc)
+{
+	size_t done = 0;
+	ssize_t got;
+	
+	while (done < length) {
+		got = pread(fd, buffer + done, length - done, (off_t) (offset + done));
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = EIO;
+			return -1;
+		}
+		done += (size_t) got;
+	}
+	*crc = jackoff_crc32c(0, buffer, length);
+	return 0;
+}
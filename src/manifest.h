@@ -0,0 +1,69 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_MANIFEST_H_
+#define _JACKOFF_MANIFEST_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A manifest is a text sidecar ("<recording>.manifest") holding CRC-32C
+ * checksums of the recording: one for the whole file, and one for each
+ * block of it, so that damage can be found to within a block and files can
+ * be checked in parallel. Checksums are taken as the bytes are written, and
+ * the manifest is written when the recording is closed:
+ *
+ *   [manifest]
+ *   file = take.wav
+ *   size = 5767212
+ *   block-size = 1048576
+ *   crc32c = 8a9136aa
+ *   block = 2d3f6b5e
+ *   block = ...
+ *
+ * with one "block" line per block in order, the last covering whatever
+ * remains. Checksums are in hex.
+ */
+
+#define JACKOFF_MANIFEST_BLOCK_SIZE (1024 * 1024)
+
+typedef struct jackoff_manifest jackoff_manifest_t;
+
+/* The contents of a manifest, as read back. */
+typedef struct {
+	uint64_t size;
+	uint32_t block_size;
+	uint32_t crc;
+	uint32_t* blocks;
+	size_t count;
+} jackoff_checksums_t;
+
+jackoff_manifest_t* jackoff_create_manifest(const char* file_path);
+void jackoff_manifest_write(jackoff_manifest_t* manifest, uint64_t offset,
+	const void* data, size_t size);
+void jackoff_manifest_write_failed(jackoff_manifest_t* manifest,
+	uint64_t offset);
+int jackoff_finish_manifest(jackoff_manifest_t* manifest, int fd);
+void jackoff_destroy_manifest(jackoff_manifest_t* manifest);
+
+jackoff_checksums_t* jackoff_load_manifest(const char* path);
+void jackoff_free_checksums(jackoff_checksums_t* checksums);
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "metrics.h"
+#include "logging.h"
+#include "realtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+struct jackoff_metrics {
+	jackoff_recording_t* recordings;
+	size_t count;
+	size_t threads; // including the JACK thread, which is thread 0
+	jackoff_counters_t* counters; // [thread][recording]
+	uint64_t started;
+	
+	const char* path;
+	double interval;
+	pthread_t file_thread;
+	int file_thread_started;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+typedef struct {
+	const char* name;
+	const char* type;
+	const char* help;
+	int maximum; // aggregate with max() instead of a sum
+	double scale;
+} metric_info_t;
+
+static const metric_info_t metric_info[JACKOFF_METRIC_COUNT] = {
+	{"jackoff_frames_captured_total", "counter",
+		"Frames captured from JACK.", 0, 1.0},
+	{"jackoff_frames_dropped_total", "counter",
+		"Frames lost to a full transport or a slow stream reader.", 0, 1.0},
+	{"jackoff_transport_fill_high_water_frames", "gauge",
+		"Most frames ever waiting in the capture transport.", 1, 1.0},
+	{"jackoff_writer_iterations_total", "counter",
+		"Times a writer thread has serviced the recording.", 0, 1.0},
+	{"jackoff_encode_seconds_total", "counter",
+		"Time spent processing and encoding audio, excluding writes.", 0,
+		1e-9},
+	{"jackoff_bytes_written_total", "counter",
+		"Bytes of audio handed to the output.", 0, 1.0},
+	{"jackoff_write_calls_total", "counter",
+		"Calls made to write audio to the output.", 0, 1.0},
+	{"jackoff_write_seconds_total", "counter",
+		"Time spent in calls that write audio to the output.", 0, 1e-9},
+	{"jackoff_write_seconds_max", "gauge",
+		"Longest single call to write audio to the output.", 1, 1e-9},
+	{"jackoff_writer_catch_up_seconds_max", "gauge",
+		"Longest the writer has taken to get the transport back under a "
+		"quarter full.", 1, 1e-9}
+};
+
+__thread jackoff_counters_t* jackoff_thread_counters = NULL;
+
+static void* metrics_file_thread(void* arg);
+static void write_label(FILE* file, const jackoff_recording_t* recording);
+
+/*
+ * Sets up counters for the given recordings, for the JACK thread plus the
+ * given number of writer threads.
+ */
+jackoff_metrics_t* jackoff_create_metrics(jackoff_recording_t* recordings,
+	size_t count, size_t threads)
+{
+	jackoff_metrics_t* metrics;
+	
+	metrics = calloc(1, sizeof(jackoff_metrics_t));
+	if (!metrics) {
+		jackoff_warn("Failed to allocate memory for metrics.");
+		return NULL;
+	}
+	
+	metrics->recordings = recordings;
+	metrics->count = count;
+	metrics->threads = threads + 1;
+	metrics->started = jackoff_metrics_clock();
+	if (posix_memalign((void**) &metrics->counters, JACKOFF_CACHE_LINE_SIZE,
+		metrics->threads * count * sizeof(jackoff_counters_t)) != 0)
+	{
+		free(metrics);
+		jackoff_warn("Failed to allocate memory for metrics.");
+		return NULL;
+	}
+	memset(metrics->counters, 0,
+		metrics->threads * count * sizeof(jackoff_counters_t));
+	
+	pthread_mutex_init(&metrics->lock, NULL);
+	pthread_cond_init(&metrics->wake, NULL);
+	return metrics;
+}
+
+/*
+ * Returns the counters that the given thread (0 for the JACK thread, then
+ * 1 and up for writers) keeps for the given recording.
+ */
+jackoff_counters_t* jackoff_metrics_counters(jackoff_metrics_t* metrics,
+	size_t thread, size_t recording)
+{
+	if (!metrics || thread >= metrics->threads)
+		return NULL;
+	return &metrics->counters[thread * metrics->count + recording];
+}
+
+/*
+ * Starts a thread that rewrites the metrics file every interval seconds.
+ * The file is replaced atomically, so a scraper never sees half of it.
+ */
+int jackoff_start_metrics_file(jackoff_metrics_t* metrics, const char* path,
+	double interval)
+{
+	pthread_attr_t attr;
+	int result;
+	
+	metrics->path = path;
+	metrics->interval = interval;
+	
+	jackoff_init_thread_attr(&attr);
+	result = pthread_create(&metrics->file_thread, &attr, metrics_file_thread,
+		metrics);
+	pthread_attr_destroy(&attr);
+	if (result != 0) {
+		jackoff_warn("Failed to start the metrics thread.");
+		return -1;
+	}
+	metrics->file_thread_started = 1;
+	return 0;
+}
+
+/*
+ * Writes every metric in the Prometheus text exposition format.
+ */
+int jackoff_write_metrics(jackoff_metrics_t* metrics, const char* path) {
+	char temporary_path[4096];
+	FILE* file;
+	const metric_info_t* info;
+	const jackoff_recording_t* recording;
+	uint64_t value, v;
+	uint64_t now = jackoff_metrics_clock();
+	uint64_t end;
+	size_t m, r, t;
+	
+	snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+	file = fopen(temporary_path, "w");
+	if (!file) {
+		jackoff_warn("Failed to write metrics to \"%s\": %s", temporary_path,
+			strerror(errno));
+		return -1;
+	}
+	
+	for (m = 0; m < JACKOFF_METRIC_COUNT; m++) {
+		info = &metric_info[m];
+		fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help,
+			info->name, info->type);
+		
+		for (r = 0; r < metrics->count; r++) {
+			value = 0;
+			for (t = 0; t < metrics->threads; t++) {
+				v = __atomic_load_n(
+					&metrics->counters[t * metrics->count + r].values[m],
+					__ATOMIC_RELAXED);
+				if (!info->maximum)
+					value += v;
+				else if (v > value)
+					value = v;
+			}
+			
+			fprintf(file, "%s", info->name);
+			write_label(file, &metrics->recordings[r]);
+			if (info->scale == 1.0)
+				fprintf(file, " %llu\n", (unsigned long long) value);
+			else
+				fprintf(file, " %.9f\n", value * info->scale);
+		}
+	}
+	
+	fprintf(file, "# HELP jackoff_transport_capacity_frames Frames the "
+		"capture transport can hold.\n"
+		"# TYPE jackoff_transport_capacity_frames gauge\n");
+	for (r = 0; r < metrics->count; r++) {
+		recording = &metrics->recordings[r];
+		if (!recording->client)
+			continue;
+		fprintf(file, "jackoff_transport_capacity_frames");
+		write_label(file, recording);
+		fprintf(file, " %lu\n", recording->client->transport_frames);
+	}
+	
+	fprintf(file, "# HELP jackoff_spilled_frames Frames waiting in the spill "
+		"file.\n# TYPE jackoff_spilled_frames gauge\n");
+	for (r = 0; r < metrics->count; r++) {
+		recording = &metrics->recordings[r];
+		if (!recording->client || !recording->client->spill)
+			continue;
+		fprintf(file, "jackoff_spilled_frames");
+		write_label(file, recording);
+		fprintf(file, " %lu\n", jackoff_spill_count(recording->client->spill));
+	}
+	
+	fprintf(file, "# HELP jackoff_session_uptime_seconds How long the "
+		"recording's output has been open.\n"
+		"# TYPE jackoff_session_uptime_seconds gauge\n");
+	for (r = 0; r < metrics->count; r++) {
+		recording = &metrics->recordings[r];
+		if (!recording->opened_at)
+			continue;
+		end = recording->closed_at ? recording->closed_at : now;
+		fprintf(file, "jackoff_session_uptime_seconds");
+		write_label(file, recording);
+		fprintf(file, " %.3f\n", (end - recording->opened_at) * 1e-9);
+	}
+	
+	fprintf(file, "# HELP jackoff_uptime_seconds How long jackoff has been "
+		"running.\n# TYPE jackoff_uptime_seconds gauge\n"
+		"jackoff_uptime_seconds %.3f\n", (now - metrics->started) * 1e-9);
+	
+	if (fclose(file) != 0 || rename(temporary_path, path) != 0) {
+		jackoff_warn("Failed to write metrics to \"%s\": %s", path,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stops the metrics file thread, if there is one, after a final write.
+ */
+void jackoff_destroy_metrics(jackoff_metrics_t* metrics) {
+	if (!metrics)
+		return;
+	
+	if (metrics->file_thread_started) {
+		pthread_mutex_lock(&metrics->lock);
+		metrics->stopping = 1;
+		pthread_cond_signal(&metrics->wake);
+		pthread_mutex_unlock(&metrics->lock);
+		pthread_join(metrics->file_thread, NULL);
+	}
+	
+	pthread_cond_destroy(&metrics->wake);
+	pthread_mutex_destroy(&metrics->lock);
+	free(metrics->counters);
+	free(metrics);
+}
+
+/*
+ * Nanoseconds on a monotonic clock.
+ */
+uint64_t jackoff_metrics_clock() {
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void* metrics_file_thread(void* arg) {
+	jackoff_metrics_t* metrics = arg;
+	struct timespec deadline;
+	double whole;
+	int stopping;
+	
+	do {
+		jackoff_write_metrics(metrics, metrics->path);
+		
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += (long) (modf(metrics->interval, &whole) * 1e9);
+		deadline.tv_sec += (time_t) whole + deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		
+		pthread_mutex_lock(&metrics->lock);
+		while (!metrics->stopping && pthread_cond_timedwait(&metrics->wake,
+			&metrics->lock, &deadline) != ETIMEDOUT)
+			;
+		stopping = metrics->stopping;
+		pthread_mutex_unlock(&metrics->lock);
+	} while (!stopping);
+	
+	jackoff_write_metrics(metrics, metrics->path);
+	return NULL;
+}
+
+/*
+ * Writes the {recording="..."} label, escaped as the format requires.
+ */
+static void write_label(FILE* file, const jackoff_recording_t* recording) {
+	const char* name = recording->name ? recording->name :
+		recording->file_path;
+	const char* c;
+	
+	fputs("{recording=\"", file);
+	for (c = name; *c; c++) {
+		if (*c == '\\' || *c == '"')
+			fputc('\\', file);
+		if (*c == '\n')
+			fputs("\\n", file);
+		else
+			fputc(*c, file);
+	}
+	fputs("\"}", file);
+}
@@ -0,0 +1,111 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_METRICS_H_
+#define _JACKOFF_METRICS_H_
+
+#include "jackoff.h"
+#include "blockpool.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef enum {
+	JACKOFF_METRIC_FRAMES_CAPTURED,
+	JACKOFF_METRIC_FRAMES_DROPPED,
+	JACKOFF_METRIC_FILL_HIGH_WATER, // frames; a maximum, not a sum
+	JACKOFF_METRIC_WRITER_ITERATIONS,
+	JACKOFF_METRIC_ENCODE_NSEC,
+	JACKOFF_METRIC_BYTES_WRITTEN,
+	JACKOFF_METRIC_WRITE_CALLS,
+	JACKOFF_METRIC_WRITE_NSEC,
+	JACKOFF_METRIC_WRITE_MAX_NSEC, // a maximum, not a sum
+	JACKOFF_METRIC_CATCH_UP_MAX_NSEC, // a maximum, not a sum
+	JACKOFF_METRIC_COUNT
+} jackoff_metric_t;
+
+/*
+ * One thread's counters for one recording. Only that thread ever writes
+ * them, so updates are plain relaxed stores; readers add up (or take the
+ * maximum of) every thread's copy.
+ */
+typedef struct jackoff_counters {
+	uint64_t values[JACKOFF_METRIC_COUNT];
+} __attribute__((aligned(JACKOFF_CACHE_LINE_SIZE))) jackoff_counters_t;
+
+typedef struct jackoff_metrics jackoff_metrics_t;
+
+/* Counters of the recording the calling thread is working on, for code
+ * (like the encoders) that doesn't know which one that is. NULL when
+ * metrics are off. */
+extern __thread jackoff_counters_t* jackoff_thread_counters;
+
+jackoff_metrics_t* jackoff_create_metrics(jackoff_recording_t* recordings,
+	size_t count, size_t threads);
+jackoff_counters_t* jackoff_metrics_counters(jackoff_metrics_t* metrics,
+	size_t thread, size_t recording);
+int jackoff_start_metrics_file(jackoff_metrics_t* metrics, const char* path,
+	double interval);
+int jackoff_write_metrics(jackoff_metrics_t* metrics, const char* path);
+void jackoff_destroy_metrics(jackoff_metrics_t* metrics);
+uint64_t jackoff_metrics_clock();
+
+static inline void jackoff_count(jackoff_counters_t* counters,
+	jackoff_metric_t metric, uint64_t amount)
+{
+	if (counters) {
+		__atomic_store_n(&counters->values[metric],
+			counters->values[metric] + amount, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void jackoff_count_max(jackoff_counters_t* counters,
+	jackoff_metric_t metric, uint64_t value)
+{
+	if (counters && value > counters->values[metric])
+		__atomic_store_n(&counters->values[metric], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Timing for the encoders' output calls: take a start time before the call
+ * and count it afterwards. Both do nothing when metrics are off.
+ */
+static inline uint64_t jackoff_write_started() {
+	return jackoff_thread_counters ? jackoff_metrics_clock() : 0;
+}
+
+static inline void jackoff_count_write_to(jackoff_counters_t* counters,
+	uint64_t started, size_t bytes)
+{
+	uint64_t elapsed;
+	
+	if (!counters)
+		return;
+	elapsed = jackoff_metrics_clock() - started;
+	jackoff_count(counters, JACKOFF_METRIC_WRITE_CALLS, 1);
+	jackoff_count(counters, JACKOFF_METRIC_WRITE_NSEC, elapsed);
+	jackoff_count_max(counters, JACKOFF_METRIC_WRITE_MAX_NSEC, elapsed);
+	jackoff_count(counters, JACKOFF_METRIC_BYTES_WRITTEN, bytes);
+}
+
+static inline void jackoff_count_write(uint64_t started, size_t bytes) {
+	jackoff_count_write_to(jackoff_thread_counters, started, bytes);
+}
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "mixer.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#define MAX_LINE_LENGTH 4096
+
+static void scale_into(float* output, const float* input, float gain,
+	size_t frames);
+static void accumulate_into(float* output, const float* input, float gain,
+	size_t frames);
+
+/*
+ * Reads a gain matrix from a text file. Each non-blank line describes one
+ * output channel and holds one linear gain per captured channel, separated
+ * by whitespace; everything after a '#' is a comment. For example, a stereo
+ * mixdown of four channels:
+ *
+ *     # in1  in2  in3  in4
+ *     1.0    0.0  0.7  0.0
+ *     0.0    1.0  0.0  0.7
+ */
+jackoff_matrix_t* jackoff_load_matrix(const char* path) {
+	jackoff_matrix_t* matrix;
+	FILE* file;
+	char line[MAX_LINE_LENGTH];
+	char* c;
+	char* end;
+	float gain;
+	float* gains;
+	size_t count;
+	size_t line_number = 0;
+	
+	file = fopen(path, "r");
+	if (!file) {
+		jackoff_warn("Failed to open channel matrix \"%s\".", path);
+		return NULL;
+	}
+	
+	matrix = calloc(1, sizeof(jackoff_matrix_t));
+	if (!matrix) {
+		fclose(file);
+		jackoff_warn("Failed to allocate memory for the channel matrix.");
+		return NULL;
+	}
+	
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		line[strcspn(line, "#\r\n")] = 0;
+		
+		count = 0;
+		for (c = line; ; c = end) {
+			gain = strtof(c, &end);
+			if (end == c)
+				break;
+			
+			if (matrix->outputs > 0 && count >= matrix->inputs) {
+				jackoff_warn("%s:%lu: too many gains in row.", path,
+					line_number);
+				goto fail;
+			}
+			
+			gains = realloc(matrix->gains, sizeof(float) *
+				(matrix->outputs * matrix->inputs + count + 1));
+			if (!gains)
+				goto fail;
+			matrix->gains = gains;
+			matrix->gains[matrix->outputs * matrix->inputs + count] = gain;
+			count++;
+		}
+		
+		while (*end == ' ' || *end == '\t')
+			end++;
+		if (*end != 0) {
+			jackoff_warn("%s:%lu: invalid gain \"%s\".", path, line_number,
+				end);
+			goto fail;
+		}
+		
+		if (count == 0)
+			continue;
+		if (matrix->outputs == 0) {
+			matrix->inputs = count;
+		} else if (count != matrix->inputs) {
+			jackoff_warn("%s:%lu: expected %lu gains but found %lu.", path,
+				line_number, matrix->inputs, count);
+			goto fail;
+		}
+		matrix->outputs++;
+	}
+	
+	fclose(file);
+	
+	if (matrix->outputs == 0) {
+		jackoff_warn("Channel matrix \"%s\" is empty.", path);
+		jackoff_destroy_matrix(matrix);
+		return NULL;
+	}
+	
+	jackoff_debug("Loaded a %lu-to-%lu channel matrix.", matrix->inputs,
+		matrix->outputs);
+	return matrix;
+	
+	fail:
+	fclose(file);
+	jackoff_destroy_matrix(matrix);
+	return NULL;
+}
+
+void jackoff_destroy_matrix(jackoff_matrix_t* matrix) {
+	if (matrix->gains)
+		free(matrix->gains);
+	free(matrix);
+}
+
+/*
+ * Mixes planar input channels into planar output channels. Silent gains are
+ * skipped, so sparse matrices (the common case) cost little more than a copy.
+ */
+void jackoff_mix(const jackoff_matrix_t* matrix, const float** input,
+	size_t frames, float** output)
+{
+	const float* row;
+	size_t in, out;
+	int started;
+	
+	for (out = 0; out < matrix->outputs; out++) {
+		row = matrix->gains + out * matrix->inputs;
+		started = 0;
+		
+		for (in = 0; in < matrix->inputs; in++) {
+			if (row[in] == 0.0f)
+				continue;
+			if (started) {
+				accumulate_into(output[out], input[in], row[in], frames);
+			} else {
+				scale_into(output[out], input[in], row[in], frames);
+				started = 1;
+			}
+		}
+		
+		if (!started)
+			memset(output[out], 0, frames * sizeof(float));
+	}
+}
+
+static void scale_into(float* output, const float* input, float gain,
+	size_t frames)
+{
+	size_t i = 0;
+#if defined(__AVX__)
+	__m256 g = _mm256_set1_ps(gain);
+	
+	for (; i + 8 <= frames; i += 8) {
+		_mm256_storeu_ps(output + i,
+			_mm256_mul_ps(_mm256_loadu_ps(input + i), g));
+	}
+#elif defined(__SSE__)
+	__m128 g = _mm_set1_ps(gain);
+	
+	for (; i + 4 <= frames; i += 4)
+		_mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(input + i), g));
+#endif
+	for (; i < frames; i++)
+		output[i] = input[i] * gain;
+}
+
+static void accumulate_into(float* output, const float* input, float gain,
+	size_t frames)
+{
+	size_t i = 0;
+#if defined(__AVX__)
+	__m256 g = _mm256_set1_ps(gain);
+	
+	for (; i + 8 <= frames; i += 8) {
+		_mm256_storeu_ps(output + i, _mm256_add_ps(
+			_mm256_loadu_ps(output + i),
+			_mm256_mul_ps(_mm256_loadu_ps(input + i), g)));
+	}
+#elif defined(__SSE__)
+	__m128 g = _mm_set1_ps(gain);
+	
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(output + i, _mm_add_ps(_mm_loadu_ps(output + i),
+			_mm_mul_ps(_mm_loadu_ps(input + i), g)));
+	}
+#endif
+	for (; i < frames; i++)
+		output[i] += input[i] * gain;
+}
@@ -0,0 +1,40 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_MIXER_H_
+#define _JACKOFF_MIXER_H_
+
+#include <stdlib.h>
+
+/*
+ * A gain matrix mapping N captured channels onto M output channels. Gains are
+ * stored row-major, one row of `inputs` gains per output channel.
+ */
+typedef struct {
+	size_t inputs;
+	size_t outputs;
+	float* gains;
+} jackoff_matrix_t;
+
+jackoff_matrix_t* jackoff_load_matrix(const char* path);
+void jackoff_destroy_matrix(jackoff_matrix_t* matrix);
+void jackoff_mix(const jackoff_matrix_t* matrix, const float** input,
+	size_t frames, float** output);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "peaks.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/*
+ * The peak each level is building: its extremes so far for every channel,
+ * and how much of it is done (frames at level 0, peaks below it above).
+ */
+typedef struct {
+	float* minimum;
+	float* maximum;
+	size_t filled;
+} level_t;
+
+struct jackoff_peaks {
+	FILE* file;
+	size_t channels;
+	level_t levels[JACKOFF_PEAKS_LEVELS];
+	unsigned char* record; // one packed peak
+	size_t record_size;
+	unsigned long long frames;
+};
+
+static void start_peak(jackoff_peaks_t* peaks, size_t level);
+static int finish_peak(jackoff_peaks_t* peaks, size_t level);
+static void find_range(const float* samples, size_t count, float* minimum,
+	float* maximum);
+static void pack_u16(unsigned char* p, uint16_t value);
+static void pack_u32(unsigned char* p, uint32_t value);
+static void pack_u64(unsigned char* p, uint64_t value);
+static void pack_f32(unsigned char* p, float value);
+
+/*
+ * Creates the peak file for a recording at file_path. Returns NULL on
+ * failure.
+ */
+jackoff_peaks_t* jackoff_create_peaks(const char* file_path, size_t channels,
+	unsigned int sample_rate)
+{
+	jackoff_peaks_t* peaks;
+	unsigned char header[JACKOFF_PEAKS_HEADER_SIZE];
+	char* path;
+	size_t level;
+	
+	peaks = calloc(1, sizeof(jackoff_peaks_t));
+	path = malloc(strlen(file_path) + sizeof(".peaks"));
+	if (!peaks || !path) {
+		free(peaks);
+		free(path);
+		jackoff_warn("Failed to allocate memory for the peak file.");
+		return NULL;
+	}
+	
+	peaks->channels = channels;
+	peaks->record_size = channels * 2 * sizeof(float);
+	peaks->record = malloc(peaks->record_size);
+	for (level = 0; level < JACKOFF_PEAKS_LEVELS; level++) {
+		peaks->levels[level].minimum = malloc(channels * sizeof(float));
+		peaks->levels[level].maximum = malloc(channels * sizeof(float));
+		if (!peaks->levels[level].minimum || !peaks->levels[level].maximum)
+			break;
+		start_peak(peaks, level);
+	}
+	if (!peaks->record || level < JACKOFF_PEAKS_LEVELS) {
+		jackoff_warn("Failed to allocate memory for the peak file.");
+		free(path);
+		jackoff_close_peaks(peaks);
+		return NULL;
+	}
+	
+	sprintf(path, "%s.peaks", file_path);
+	peaks->file = fopen(path, "wb");
+	if (!peaks->file) {
+		jackoff_warn("Failed to create peak file \"%s\": %s", path,
+			strerror(errno));
+		free(path);
+		jackoff_close_peaks(peaks);
+		return NULL;
+	}
+	
+	memset(header, 0, sizeof(header));
+	memcpy(header, "JKPK", 4);
+	pack_u16(header + 4, JACKOFF_PEAKS_VERSION);
+	pack_u16(header + 6, JACKOFF_PEAKS_HEADER_SIZE);
+	pack_u32(header + 8, sample_rate);
+	pack_u32(header + 12, (uint32_t) channels);
+	pack_u32(header + 16, JACKOFF_PEAKS_BASE_FRAMES);
+	pack_u16(header + 20, JACKOFF_PEAKS_LEVELS);
+	pack_u16(header + 22, JACKOFF_PEAKS_FAN_OUT);
+	if (fwrite(header, sizeof(header), 1, peaks->file) != 1) {
+		jackoff_warn("Failed to write peak file \"%s\": %s", path,
+			strerror(errno));
+		free(path);
+		jackoff_close_peaks(peaks);
+		return NULL;
+	}
+	
+	jackoff_debug("Writing peaks of \"%s\" to \"%s\".", file_path, path);
+	free(path);
+	return peaks;
+}
+
+/*
+ * Adds the next frames of planar audio, writing out the peaks they
+ * complete. The file is flushed each time, so readers see the overview
+ * grow with the recording.
+ */
+int jackoff_add_peaks(jackoff_peaks_t* peaks, float* const* channels,
+	size_t frames)
+{
+	level_t* base = &peaks->levels[0];
+	size_t done, count, c;
+	
+	for (done = 0; done < frames; done += count) {
+		count = JACKOFF_PEAKS_BASE_FRAMES - base->filled;
+		if (count > frames - done)
+			count = frames - done;
+		
+		for (c = 0; c < peaks->channels; c++) {
+			find_range(channels[c] + done, count, &base->minimum[c],
+				&base->maximum[c]);
+		}
+		
+		base->filled += count;
+		if (base->filled == JACKOFF_PEAKS_BASE_FRAMES &&
+			finish_peak(peaks, 0) != 0)
+			return -1;
+	}
+	
+	peaks->frames += frames;
+	if (fflush(peaks->file) != 0) {
+		jackoff_warn("Failed to write to the peak file: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes out the peaks the recording ended partway through, records its
+ * length in the header and closes the file.
+ */
+int jackoff_close_peaks(jackoff_peaks_t* peaks) {
+	unsigned char frames[8];
+	size_t level;
+	int result = 0;
+	
+	if (peaks->file) {
+		// Finishing a peak adds to the one above, so this goes bottom up
+		// and leaves them in the order the layout expects.
+		for (level = 0; level < JACKOFF_PEAKS_LEVELS && result == 0;
+			level++)
+		{
+			if (peaks->levels[level].filled > 0 &&
+				finish_peak(peaks, level) != 0)
+				result = -1;
+		}
+		
+		pack_u64(frames, peaks->frames);
+		if (result == 0 && (fseek(peaks->file, 24, SEEK_SET) != 0 ||
+			fwrite(frames, sizeof(frames), 1, peaks->file) != 1))
+		{
+			jackoff_warn("Failed to write to the peak file: %s",
+				strerror(errno));
+			result = -1;
+		}
+		if (fclose(peaks->file) != 0) {
+			jackoff_warn("Failed to close the peak file: %s",
+				strerror(errno));
+			result = -1;
+		}
+	}
+	
+	for (level = 0; level < JACKOFF_PEAKS_LEVELS; level++) {
+		free(peaks->levels[level].minimum);
+		free(peaks->levels[level].maximum);
+	}
+	free(peaks->record);
+	free(peaks);
+	return result;
+}
+
+static void start_peak(jackoff_peaks_t* peaks, size_t level) {
+	level_t* l = &peaks->levels[level];
+	size_t c;
+	
+	for (c = 0; c < peaks->channels; c++) {
+		l->minimum[c] = HUGE_VALF;
+		l->maximum[c] = -HUGE_VALF;
+	}
+	l->filled = 0;
+}
+
+/*
+ * Writes out the peak a level has been building, folds it into the one
+ * above, and starts the next. A level above that fills up is finished in
+ * turn.
+ */
+static int finish_peak(jackoff_peaks_t* peaks, size_t level) {
+	level_t* l = &peaks->levels[level];
+	level_t* above;
+	size_t c;
+	
+	for (c = 0; c < peaks->channels; c++) {
+		pack_f32(peaks->record + c * 8, l->minimum[c]);
+		pack_f32(peaks->record + c * 8 + 4, l->maximum[c]);
+	}
+	if (fwrite(peaks->record, peaks->record_size, 1, peaks->file) != 1) {
+		jackoff_warn("Failed to write to the peak file: %s", strerror(errno));
+		return -1;
+	}
+	
+	if (level + 1 < JACKOFF_PEAKS_LEVELS) {
+		above = &peaks->levels[level + 1];
+		for (c = 0; c < peaks->channels; c++) {
+			if (l->minimum[c] < above->minimum[c])
+				above->minimum[c] = l->minimum[c];
+			if (l->maximum[c] > above->maximum[c])
+				above->maximum[c] = l->maximum[c];
+		}
+		above->filled++;
+	}
+	start_peak(peaks, level);
+	
+	if (level + 1 < JACKOFF_PEAKS_LEVELS &&
+		peaks->levels[level + 1].filled == JACKOFF_PEAKS_FAN_OUT)
+		return finish_peak(peaks, level + 1);
+	return 0;
+}
+
+/*
+ * Widens [minimum, maximum] to take in `count` samples.
+ */
+static void find_range(const float* samples, size_t count, float* minimum,
+	float* maximum)
+{
+	size_t i = 0;
+	float low = *minimum;
+	float high = *maximum;
+#if defined(__AVX__)
+	__m256 lows = _mm256_set1_ps(low);
+	__m256 highs = _mm256_set1_ps(high);
+	__m256 x;
+	__m128 low4, high4;
+	
+	// With the new samples first, a NaN among them is passed over, as the
+	// comparisons below pass it over.
+	for (; i + 8 <= count; i += 8) {
+		x = _mm256_loadu_ps(samples + i);
+		lows = _mm256_min_ps(x, lows);
+		highs = _mm256_max_ps(x, highs);
+	}
+	low4 = _mm_min_ps(_mm256_castps256_ps128(lows),
+		_mm256_extractf128_ps(lows, 1));
+	high4 = _mm_max_ps(_mm256_castps256_ps128(highs),
+		_mm256_extractf128_ps(highs, 1));
+	low4 = _mm_min_ps(low4, _mm_movehl_ps(low4, low4));
+	low4 = _mm_min_ss(low4, _mm_shuffle_ps(low4, low4, 1));
+	high4 = _mm_max_ps(high4, _mm_movehl_ps(high4, high4));
+	high4 = _mm_max_ss(high4, _mm_shuffle_ps(high4, high4, 1));
+	low = _mm_cvtss_f32(low4);
+	high = _mm_cvtss_f32(high4);
+#elif defined(__SSE__)
+	__m128 lows = _mm_set1_ps(low);
+	__m128 highs = _mm_set1_ps(high);
+	__m128 x;
+	
+	for (; i + 4 <= count; i += 4) {
+		x = _mm_loadu_ps(samples + i);
+		lows = _mm_min_ps(x, lows);
+		highs = _mm_max_ps(x, highs);
+	}
+	lows = _mm_min_ps(lows, _mm_movehl_ps(lows, lows));
+	lows = _mm_min_ss(lows, _mm_shuffle_ps(lows, lows, 1));
+	highs = _mm_max_ps(highs, _mm_movehl_ps(highs, highs));
+	highs = _mm_max_ss(highs, _mm_shuffle_ps(highs, highs, 1));
+	low = _mm_cvtss_f32(lows);
+	high = _mm_cvtss_f32(highs);
+#endif
+	
+	for (; i < count; i++) {
+		if (samples[i] < low)
+			low = samples[i];
+		if (samples[i] > high)
+			high = samples[i];
+	}
+	
+	*minimum = low;
+	*maximum = high;
+}
+
+static void pack_u16(unsigned char* p, uint16_t value) {
+	value = htole16(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static void pack_u32(unsigned char* p, uint32_t value) {
+	value = htole32(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static void pack_u64(unsigned char* p, uint64_t value) {
+	value = htole64(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static void pack_f32(unsigned char* p, float value) {
+	uint32_t bits;
+	
+	memcpy(&bits, &value, sizeof(bits));
+	pack_u32(p, bits);
+}
@@ -0,0 +1,67 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_PEAKS_H_
+#define _JACKOFF_PEAKS_H_
+
+#include <stdlib.h>
+
+/*
+ * A peak file is a sidecar ("<recording>.peaks") holding a waveform overview
+ * of the recording: the smallest and largest sample of every channel over
+ * spans of frames, at several resolutions. It is appended to as the
+ * recording goes, so editors can draw it while the recording is still
+ * growing. All integers are little-endian; peaks are IEEE floats.
+ *
+ *   header   "JKPK", u16 version, u16 header size, u32 sample rate,
+ *            u32 channels, u32 frames per level 0 peak, u16 levels,
+ *            u16 fan-out, u64 frames in the recording (0 until it is
+ *            closed)
+ *   peaks    for every channel in turn, f32 minimum and f32 maximum
+ *
+ * Each peak at level L covers fan-out peaks of level L - 1; level 0 peaks
+ * cover 256 frames, and with a fan-out of 16 the four levels cover 256,
+ * 4096, 65536 and 1048576 frames. Peaks are written as soon as they are
+ * complete, which puts every peak right after the last of the peaks it
+ * covers:
+ *
+ *   16 level 0, one level 1, 16 level 0, one level 1, ... (16 times),
+ *   one level 2, ... (16 times), one level 3
+ *
+ * and then again for the next 1048576 frames. So each run of 4369 peaks
+ * describes 1048576 frames, and the place of any peak follows from its
+ * number. The last peak of each level may cover fewer frames than the
+ * others if the recording ended partway through it.
+ */
+
+#define JACKOFF_PEAKS_VERSION 1
+#define JACKOFF_PEAKS_HEADER_SIZE 32
+#define JACKOFF_PEAKS_BASE_FRAMES 256
+#define JACKOFF_PEAKS_LEVELS 4
+#define JACKOFF_PEAKS_FAN_OUT 16
+
+typedef struct jackoff_peaks jackoff_peaks_t;
+
+jackoff_peaks_t* jackoff_create_peaks(const char* file_path, size_t channels,
+	unsigned int sample_rate);
+int jackoff_add_peaks(jackoff_peaks_t* peaks, float* const* channels,
+	size_t frames);
+int jackoff_close_peaks(jackoff_peaks_t* peaks);
+
+#endif
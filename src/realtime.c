@@ -0,0 +1,239 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "realtime.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define NODE_CPU_LIST_PATH "/sys/devices/system/node/node%d/cpulist"
+
+/* The CPUs the process may run on, taken before any thread is pinned. */
+static cpu_set_t process_cpus;
+static pthread_once_t process_cpus_once = PTHREAD_ONCE_INIT;
+
+static void save_process_cpus();
+static int parse_cpu_list(const char* list, cpu_set_t* cpus);
+
+/*
+ * Parses a writer priority, optionally prefixed with the scheduling policy:
+ * "70", "fifo:70" or "rr:70".
+ */
+int jackoff_parse_thread_priority(const char* value,
+	jackoff_thread_policy_t* policy)
+{
+	char* end;
+	
+	policy->policy = SCHED_FIFO;
+	if (strncmp(value, "fifo:", 5) == 0) {
+		value += 5;
+	} else if (strncmp(value, "rr:", 3) == 0) {
+		policy->policy = SCHED_RR;
+		value += 3;
+	}
+	
+	policy->priority = (int) strtol(value, &end, 10);
+	if (end == value || *end != 0)
+		return 0;
+	
+	return (policy->priority >= sched_get_priority_min(policy->policy) &&
+		policy->priority <= sched_get_priority_max(policy->policy));
+}
+
+/*
+ * Parses the set of CPUs to pin to. This is either a CPU list in the kernel's
+ * format ("0-3,8") or "node" followed by a NUMA node number, which selects the
+ * CPUs local to that node.
+ */
+int jackoff_parse_cpu_set(const char* value, jackoff_thread_policy_t* policy)
+{
+	char path[128];
+	char list[1024];
+	FILE* file;
+	char* end;
+	int node;
+	int result;
+	
+	if (strncmp(value, "node", 4) != 0) {
+		policy->pin = parse_cpu_list(value, &policy->cpus);
+		return policy->pin;
+	}
+	
+	node = (int) strtol(value + 4, &end, 10);
+	if (end == value + 4 || *end != 0)
+		return 0;
+	
+	snprintf(path, sizeof(path), NODE_CPU_LIST_PATH, node);
+	file = fopen(path, "r");
+	if (!file) {
+		jackoff_warn("Can't find the CPUs of NUMA node %d: %s", node,
+			strerror(errno));
+		return 0;
+	}
+	result = (fgets(list, sizeof(list), file) != NULL);
+	fclose(file);
+	
+	if (result) {
+		list[strcspn(list, "\n")] = 0;
+		result = parse_cpu_list(list, &policy->cpus);
+	}
+	policy->pin = result;
+	return result;
+}
+
+/*
+ * Applies the policy to the calling thread. The priority is kept below that
+ * of JACK's process thread so that the writer can never delay the capture
+ * it's trying to keep up with.
+ */
+int jackoff_apply_thread_policy(const jackoff_thread_policy_t* policy,
+	jack_client_t* jack_client, const char* thread_name)
+{
+	struct sched_param param;
+	int jack_priority;
+	int result;
+	int ok = 1;
+	
+	pthread_once(&process_cpus_once, save_process_cpus);
+	
+	if (policy->pin) {
+		result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+			&policy->cpus);
+		if (result != 0) {
+			jackoff_warn("Failed to pin the %s thread to its CPUs: %s",
+				thread_name, strerror(result));
+			ok = 0;
+		}
+	}
+	
+	if (policy->priority > 0) {
+		param.sched_priority = policy->priority;
+		
+		// There's no realtime priority below 1, so if JACK's process thread
+		// has that, or none at all, the writer stays under the normal
+		// scheduler rather than outrank it.
+		jack_priority = jack_client_real_time_priority(jack_client);
+		if (jack_priority <= 1) {
+			jackoff_warn("Not giving the %s thread realtime priority: JACK's "
+				"process thread %s.", thread_name, (jack_priority == 1) ?
+				"is at priority 1, with none below it" :
+				"isn't running in realtime");
+			return 0;
+		}
+		if (param.sched_priority >= jack_priority) {
+			param.sched_priority = jack_priority - 1;
+			jackoff_warn("Lowering the %s thread's priority to %d, below "
+				"JACK's.", thread_name, param.sched_priority);
+		}
+		
+		result = pthread_setschedparam(pthread_self(), policy->policy,
+			&param);
+		if (result != 0) {
+			jackoff_warn("Failed to give the %s thread realtime priority %d: "
+				"%s (check RLIMIT_RTPRIO).", thread_name, param.sched_priority,
+				strerror(result));
+			ok = 0;
+		} else {
+			jackoff_debug("Running the %s thread at %s priority %d.",
+				thread_name, (policy->policy == SCHED_RR) ? "SCHED_RR" :
+				"SCHED_FIFO", param.sched_priority);
+		}
+	}
+	
+	return ok;
+}
+
+/*
+ * Sets up attributes for a helper thread: one that runs under the normal
+ * scheduler on any of the process's CPUs, whatever the thread starting it
+ * runs with. Helpers are started by writers too, and would otherwise take
+ * on their priority and pinning.
+ */
+void jackoff_init_thread_attr(pthread_attr_t* attr) {
+	struct sched_param param;
+	
+	pthread_once(&process_cpus_once, save_process_cpus);
+	
+	pthread_attr_init(attr);
+	pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+	param.sched_priority = 0;
+	pthread_attr_setschedparam(attr, &param);
+	if (CPU_COUNT(&process_cpus) > 0)
+		pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &process_cpus);
+}
+
+/*
+ * Locks every page the process has into RAM and, if future is set, every
+ * page it will allocate.
+ */
+int jackoff_lock_memory(int future) {
+	if (mlockall(MCL_CURRENT | (future ? MCL_FUTURE : 0)) != 0) {
+		jackoff_warn("Failed to lock memory: %s (check RLIMIT_MEMLOCK).",
+			strerror(errno));
+		return 0;
+	}
+	
+	jackoff_debug("Locked all memory.");
+	return 1;
+}
+
+static void save_process_cpus() {
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &process_cpus) != 0)
+		CPU_ZERO(&process_cpus);
+}
+
+static int parse_cpu_list(const char* list, cpu_set_t* cpus) {
+	const char* c = list;
+	char* end;
+	long first, last, cpu;
+	
+	CPU_ZERO(cpus);
+	
+	while (*c) {
+		first = strtol(c, &end, 10);
+		if (end == c || first < 0)
+			return 0;
+		last = first;
+		
+		c = end;
+		if (*c == '-') {
+			c++;
+			last = strtol(c, &end, 10);
+			if (end == c || last < first)
+				return 0;
+			c = end;
+		}
+		
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET((int) cpu, cpus);
+		
+		if (*c == ',')
+			c++;
+		else if (*c != 0)
+			return 0;
+	}
+	
+	return CPU_COUNT(cpus) > 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_REALTIME_H_
+#define _JACKOFF_REALTIME_H_
+
+#include <jack/jack.h>
+#include <sched.h>
+#include <pthread.h>
+
+/*
+ * Scheduling for the threads that drain the ring buffers and encode audio.
+ * A priority of 0 leaves the threads under the normal scheduler.
+ */
+typedef struct {
+	int policy;
+	int priority;
+	int pin;
+	cpu_set_t cpus;
+} jackoff_thread_policy_t;
+
+int jackoff_parse_thread_priority(const char* value,
+	jackoff_thread_policy_t* policy);
+int jackoff_parse_cpu_set(const char* value, jackoff_thread_policy_t* policy);
+int jackoff_apply_thread_policy(const jackoff_thread_policy_t* policy,
+	jack_client_t* jack_client, const char* thread_name);
+void jackoff_init_thread_attr(pthread_attr_t* attr);
+int jackoff_lock_memory(int future);
+
+#endif
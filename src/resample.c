@@ -0,0 +1,321 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "resample.h"
+#include "logging.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// Zero crossings of the prototype sinc on each side of its peak.
+#define ZERO_CROSSINGS 16
+// Filter cutoff as a fraction of the lower of the two Nyquist frequencies.
+#define PASSBAND 0.92
+#define KAISER_BETA 8.6
+// Filter rows are padded to a multiple of this many taps (and aligned to it)
+// so that the dot product never needs a scalar tail.
+#define TAP_ALIGNMENT 8
+// Refuse ratios that would need an unreasonably large filter bank.
+#define MAX_PHASES 1024
+
+struct jackoff_resampler {
+	size_t channels;
+	unsigned int up;
+	unsigned int down;
+	size_t taps;
+	size_t max_frames;
+	size_t capacity;
+	float* coefficients;
+	float** history;
+	
+	// Position of the next output sample, in upsampled units, relative to
+	// the first sample of the block currently being processed.
+	unsigned long position;
+	unsigned long long frames_in;
+	unsigned long long frames_out;
+};
+
+static unsigned int gcd(unsigned int a, unsigned int b);
+static double bessel_i0(double x);
+static int design_filter(jackoff_resampler_t* resampler);
+static size_t run_filter(jackoff_resampler_t* resampler, const float** input,
+	size_t frames, float** output);
+static inline float dot_product(const float* coefficients,
+	const float* samples, size_t taps);
+
+jackoff_resampler_t* jackoff_create_resampler(size_t channels,
+	unsigned int in_rate, unsigned int out_rate, size_t max_frames)
+{
+	jackoff_resampler_t* resampler;
+	unsigned int divisor = gcd(in_rate, out_rate);
+	size_t c;
+	
+	resampler = calloc(1, sizeof(jackoff_resampler_t));
+	if (!resampler) {
+		jackoff_warn("Failed to allocate memory for the resampler.");
+		return NULL;
+	}
+	
+	resampler->channels = channels;
+	resampler->up = out_rate / divisor;
+	resampler->down = in_rate / divisor;
+	resampler->max_frames = max_frames;
+	resampler->capacity = (size_t) (((unsigned long long) max_frames *
+		resampler->up) / resampler->down) + 2;
+	
+	if (resampler->up > MAX_PHASES) {
+		jackoff_warn("Can't resample from %u Hz to %u Hz: the ratio is too "
+			"complex.", in_rate, out_rate);
+		free(resampler);
+		return NULL;
+	}
+	
+	if (!design_filter(resampler)) {
+		free(resampler);
+		return NULL;
+	}
+	
+	resampler->history = calloc(channels, sizeof(float*));
+	if (!resampler->history) {
+		jackoff_destroy_resampler(resampler);
+		return NULL;
+	}
+	for (c = 0; c < channels; c++) {
+		resampler->history[c] = calloc(resampler->taps - 1 + max_frames,
+			sizeof(float));
+		if (!resampler->history[c]) {
+			jackoff_warn("Failed to allocate resampler history.");
+			jackoff_destroy_resampler(resampler);
+			return NULL;
+		}
+	}
+	
+	// Start half a filter length in so that the filter's delay is
+	// compensated and output frame 0 lines up with input frame 0.
+	resampler->position = (resampler->taps * resampler->up) / 2;
+	
+	jackoff_debug("Resampling %u Hz to %u Hz (%u/%u, %lu taps per phase).",
+		in_rate, out_rate, resampler->up, resampler->down, resampler->taps);
+	return resampler;
+}
+
+void jackoff_destroy_resampler(jackoff_resampler_t* resampler) {
+	size_t c;
+	
+	if (resampler->history) {
+		for (c = 0; c < resampler->channels; c++) {
+			if (resampler->history[c])
+				free(resampler->history[c]);
+		}
+		free(resampler->history);
+	}
+	
+	if (resampler->coefficients)
+		free(resampler->coefficients);
+	free(resampler);
+}
+
+size_t jackoff_resampler_capacity(const jackoff_resampler_t* resampler) {
+	return resampler->capacity;
+}
+
+size_t jackoff_resample(jackoff_resampler_t* resampler, const float** input,
+	size_t frames, float** output)
+{
+	resampler->frames_in += frames;
+	return run_filter(resampler, input, frames, output);
+}
+
+/*
+ * Pushes silence through the filter to get out the audio that is still
+ * sitting in its history. Call repeatedly until it returns 0.
+ */
+size_t jackoff_resampler_flush(jackoff_resampler_t* resampler,
+	float** output)
+{
+	unsigned long long total = (resampler->frames_in * resampler->up +
+		resampler->down - 1) / resampler->down;
+	size_t produced;
+	
+	if (resampler->frames_out >= total)
+		return 0;
+	
+	produced = run_filter(resampler, NULL, resampler->max_frames, output);
+	if (resampler->frames_out > total) {
+		produced -= (size_t) (resampler->frames_out - total);
+		resampler->frames_out = total;
+	}
+	return produced;
+}
+
+static size_t run_filter(jackoff_resampler_t* resampler, const float** input,
+	size_t frames, float** output)
+{
+	size_t taps = resampler->taps;
+	size_t keep = taps - 1;
+	unsigned int up = resampler->up;
+	unsigned long position;
+	unsigned long frame;
+	size_t produced = 0;
+	size_t c;
+	float* history;
+	const float* row;
+	
+	position = resampler->position;
+	for (c = 0; c < resampler->channels; c++) {
+		history = resampler->history[c];
+		if (input)
+			memcpy(history + keep, input[c], frames * sizeof(float));
+		else
+			memset(history + keep, 0, frames * sizeof(float));
+		
+		produced = 0;
+		position = resampler->position;
+		for (frame = position / up; frame < frames; frame = position / up) {
+			row = resampler->coefficients + (position % up) * taps;
+			output[c][produced++] = dot_product(row, history + frame, taps);
+			position += resampler->down;
+		}
+		
+		memmove(history, history + frames, keep * sizeof(float));
+	}
+	
+	// Every channel advanced by the same amount.
+	resampler->position = position - frames * up;
+	resampler->frames_out += produced;
+	
+	return produced;
+}
+
+static inline float dot_product(const float* coefficients,
+	const float* samples, size_t taps)
+{
+	size_t i;
+#if defined(__AVX__)
+	__m256 sum = _mm256_setzero_ps();
+	__m128 low, high;
+	
+	for (i = 0; i < taps; i += 8) {
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(
+			_mm256_load_ps(coefficients + i), _mm256_loadu_ps(samples + i)));
+	}
+	low = _mm256_castps256_ps128(sum);
+	high = _mm256_extractf128_ps(sum, 1);
+	low = _mm_add_ps(low, high);
+	low = _mm_add_ps(low, _mm_movehl_ps(low, low));
+	low = _mm_add_ss(low, _mm_shuffle_ps(low, low, 1));
+	return _mm_cvtss_f32(low);
+#elif defined(__SSE__)
+	__m128 sum = _mm_setzero_ps();
+	
+	for (i = 0; i < taps; i += 4) {
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_load_ps(coefficients + i),
+			_mm_loadu_ps(samples + i)));
+	}
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#else
+	float sum = 0.0f;
+	
+	for (i = 0; i < taps; i++)
+		sum += coefficients[i] * samples[i];
+	return sum;
+#endif
+}
+
+/*
+ * Builds the polyphase filter bank: a Kaiser-windowed sinc prototype running
+ * at the upsampled rate, split into one row per phase. Rows are stored
+ * time-reversed so each output is a straight dot product against the input.
+ */
+static int design_filter(jackoff_resampler_t* resampler) {
+	unsigned int up = resampler->up;
+	unsigned int down = resampler->down;
+	unsigned int factor = (up > down) ? up : down;
+	double cutoff = PASSBAND * 0.5 / factor;
+	double center, x, window, value;
+	size_t taps, length, phase, j, i;
+	
+	taps = (size_t) ceil(2.0 * ZERO_CROSSINGS * factor / up);
+	taps = (taps + TAP_ALIGNMENT - 1) / TAP_ALIGNMENT * TAP_ALIGNMENT;
+	length = taps * up;
+	center = length / 2.0;
+	
+	if (posix_memalign((void**) &resampler->coefficients,
+		TAP_ALIGNMENT * sizeof(float), length * sizeof(float)) != 0)
+	{
+		jackoff_warn("Failed to allocate the resampling filter.");
+		resampler->coefficients = NULL;
+		return 0;
+	}
+	resampler->taps = taps;
+	
+	for (phase = 0; phase < up; phase++) {
+		for (j = 0; j < taps; j++) {
+			i = phase + j * up;
+			x = i - center;
+			window = 1.0 - (x / center) * (x / center);
+			window = (window > 0.0) ?
+				bessel_i0(KAISER_BETA * sqrt(window)) / bessel_i0(KAISER_BETA) :
+				0.0;
+			value = (x == 0.0) ? 2.0 * cutoff :
+				sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+			
+			// Scale by the upsampling factor to make up for the zeros that
+			// upsampling stuffs between input samples.
+			resampler->coefficients[phase * taps + (taps - 1 - j)] =
+				(float) (value * window * up);
+		}
+	}
+	
+	return 1;
+}
+
+static double bessel_i0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+	double half = x / 2.0;
+	int k;
+	
+	for (k = 1; k < 50; k++) {
+		term *= (half / k) * (half / k);
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+	unsigned int t;
+	
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
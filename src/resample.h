@@ -0,0 +1,43 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_RESAMPLE_H_
+#define _JACKOFF_RESAMPLE_H_
+
+#include <stdlib.h>
+
+typedef struct jackoff_resampler jackoff_resampler_t;
+
+/*
+ * A rational polyphase resampler. Each channel keeps its own filter history,
+ * so blocks of any size up to max_frames can be fed through it one after
+ * another. Output is aligned with input (the filter delay is compensated) and
+ * a flush at the end produces exactly ceil(input * out_rate / in_rate) frames
+ * in total.
+ */
+jackoff_resampler_t* jackoff_create_resampler(size_t channels,
+	unsigned int in_rate, unsigned int out_rate, size_t max_frames);
+void jackoff_destroy_resampler(jackoff_resampler_t* resampler);
+size_t jackoff_resampler_capacity(const jackoff_resampler_t* resampler);
+size_t jackoff_resample(jackoff_resampler_t* resampler, const float** input,
+	size_t frames, float** output);
+size_t jackoff_resampler_flush(jackoff_resampler_t* resampler,
+	float** output);
+
+#endif
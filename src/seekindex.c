@@ -0,0 +1,175 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "seekindex.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/time.h>
+
+struct jackoff_seek_index {
+	FILE* file;
+	jackoff_client_t* client;
+	jack_nframes_t sample_rate; // of the recording
+	jack_nframes_t capture_rate; // of JACK
+	size_t first_frame; // in frames captured
+	uint64_t interval; // frames between entries
+	uint64_t next_frame; // of the next entry
+};
+
+static void pack_u16(unsigned char* p, uint16_t value);
+static void pack_u32(unsigned char* p, uint32_t value);
+static void pack_u64(unsigned char* p, uint64_t value);
+
+/*
+ * Creates the seek index for a recording at file_path, with an entry every
+ * `interval` seconds of audio. Returns NULL on failure.
+ */
+jackoff_seek_index_t* jackoff_create_seek_index(jackoff_client_t* client,
+	const char* file_path, jack_nframes_t sample_rate, double interval)
+{
+	jackoff_seek_index_t* index;
+	unsigned char header[JACKOFF_SEEK_INDEX_HEADER_SIZE];
+	char* path;
+	
+	index = calloc(1, sizeof(jackoff_seek_index_t));
+	path = malloc(strlen(file_path) + sizeof(".seek"));
+	if (!index || !path) {
+		free(index);
+		free(path);
+		jackoff_warn("Failed to allocate memory for the seek index.");
+		return NULL;
+	}
+	
+	index->client = client;
+	index->sample_rate = sample_rate;
+	index->capture_rate = client->sample_rate;
+	index->first_frame = client->frames_consumed;
+	index->interval = (uint64_t) (interval * sample_rate);
+	if (index->interval == 0)
+		index->interval = 1;
+	
+	sprintf(path, "%s.seek", file_path);
+	index->file = fopen(path, "wb");
+	if (!index->file) {
+		jackoff_warn("Failed to create seek index \"%s\": %s", path,
+			strerror(errno));
+		free(path);
+		free(index);
+		return NULL;
+	}
+	
+	memset(header, 0, sizeof(header));
+	memcpy(header, "JKSX", 4);
+	pack_u16(header + 4, JACKOFF_SEEK_INDEX_VERSION);
+	pack_u16(header + 6, JACKOFF_SEEK_INDEX_HEADER_SIZE);
+	pack_u32(header + 8, sample_rate);
+	pack_u32(header + 12, (uint32_t) index->interval);
+	if (fwrite(header, sizeof(header), 1, index->file) != 1) {
+		jackoff_warn("Failed to write seek index \"%s\": %s", path,
+			strerror(errno));
+		fclose(index->file);
+		free(path);
+		free(index);
+		return NULL;
+	}
+	
+	jackoff_debug("Indexing \"%s\" every %llu frames in \"%s\".", file_path,
+		(unsigned long long) index->interval, path);
+	free(path);
+	return index;
+}
+
+/*
+ * Tells the index that the recording's next frame will be written at the
+ * given byte offset. An entry is added whenever that crosses the next
+ * multiple of the interval; it is flushed at once, so readers can use the
+ * index while the recording is still going.
+ */
+int jackoff_seek_index_mark(jackoff_seek_index_t* index, uint64_t frame,
+	uint64_t offset)
+{
+	unsigned char entry[JACKOFF_SEEK_INDEX_ENTRY_SIZE];
+	jack_client_t* jack_client = index->client->jack_client;
+	size_t captured;
+	jack_nframes_t jack_frame;
+	jack_time_t jack_time;
+	struct timeval now;
+	int64_t unix_time;
+	
+	// The frame's place on JACK's clock, from when the callback captured
+	// it, and its wall-clock time by way of the current offset between
+	// them. The client's stamps are read on every call, so they can't pile
+	// up between entries.
+	captured = index->first_frame +
+		(size_t) (frame * index->capture_rate / index->sample_rate);
+	jack_frame = (jack_nframes_t) jackoff_client_frame_time(index->client,
+		captured);
+	if (frame < index->next_frame)
+		return 0;
+	index->next_frame = (frame / index->interval + 1) * index->interval;
+	
+	jack_time = jack_frames_to_time(jack_client, jack_frame);
+	gettimeofday(&now, NULL);
+	unix_time = (int64_t) now.tv_sec * 1000000 + now.tv_usec -
+		(int64_t) (jack_get_time() - jack_time);
+	
+	pack_u64(entry, frame);
+	pack_u64(entry + 8, offset);
+	pack_u64(entry + 16, jack_time);
+	pack_u64(entry + 24, (uint64_t) unix_time);
+	if (fwrite(entry, sizeof(entry), 1, index->file) != 1 ||
+		fflush(index->file) != 0)
+	{
+		jackoff_warn("Failed to write to the seek index: %s",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int jackoff_close_seek_index(jackoff_seek_index_t* index) {
+	int result = 0;
+	
+	if (fclose(index->file) != 0) {
+		jackoff_warn("Failed to close the seek index: %s", strerror(errno));
+		result = -1;
+	}
+	free(index);
+	return result;
+}
+
+static void pack_u16(unsigned char* p, uint16_t value) {
+	value = htole16(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static void pack_u32(unsigned char* p, uint32_t value) {
+	value = htole32(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static void pack_u64(unsigned char* p, uint64_t value) {
+	value = htole64(value);
+	memcpy(p, &value, sizeof(value));
+}
@@ -0,0 +1,53 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_SEEKINDEX_H_
+#define _JACKOFF_SEEKINDEX_H_
+
+#include "client.h"
+
+#include <stdint.h>
+
+/*
+ * A seek index is a sidecar file ("<recording>.seek") that maps positions
+ * in a recording to byte offsets in it, written as the recording goes.
+ * All integers are little-endian.
+ *
+ *   header   "JKSX", u16 version, u16 header size, u32 sample rate,
+ *            u32 frames between entries, 16 reserved bytes
+ *   entries  u64 frame, u64 byte offset, u64 JACK time and u64 UNIX time
+ *            of the frame (both in microseconds)
+ *
+ * Encoders may hold audio back, so an entry's offset is at or before the
+ * start of its frame's data: decode from there and skip ahead.
+ */
+
+#define JACKOFF_SEEK_INDEX_VERSION 1
+#define JACKOFF_SEEK_INDEX_HEADER_SIZE 32
+#define JACKOFF_SEEK_INDEX_ENTRY_SIZE 32
+
+typedef struct jackoff_seek_index jackoff_seek_index_t;
+
+jackoff_seek_index_t* jackoff_create_seek_index(jackoff_client_t* client,
+	const char* file_path, jack_nframes_t sample_rate, double interval);
+int jackoff_seek_index_mark(jackoff_seek_index_t* index, uint64_t frame,
+	uint64_t offset);
+int jackoff_close_seek_index(jackoff_seek_index_t* index);
+
+#endif
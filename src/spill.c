@@ -0,0 +1,190 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "spill.h"
+#include "client.h"
+#include "logging.h"
+#include "realtime.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct jackoff_spiller {
+	struct jackoff_host* host;
+	float interval;
+	pthread_t thread;
+	volatile int running;
+};
+
+static void* spill_thread(void* arg);
+
+/*
+ * Creates a spill file holding the given number of frames per channel in
+ * the given directory. The file is unlinked straight away, so it never
+ * outlives the process, and its blocks are allocated up front so that
+ * spilling can't fail for want of space. Returns NULL on failure.
+ */
+jackoff_spill_t* jackoff_create_spill(const char* directory, size_t channels,
+	size_t frames)
+{
+	jackoff_spill_t* spill;
+	char path[4096];
+	int result;
+	
+	spill = calloc(1, sizeof(jackoff_spill_t));
+	if (!spill) {
+		jackoff_warn("Failed to allocate memory for the spill file.");
+		return NULL;
+	}
+	
+	spill->channels = channels;
+	spill->capacity = frames;
+	spill->map_size = channels * frames * sizeof(jack_default_audio_sample_t);
+	
+	snprintf(path, sizeof(path), "%s/jackoff-spill-XXXXXX", directory);
+	spill->fd = mkstemp(path);
+	if (spill->fd < 0) {
+		jackoff_warn("Failed to create a spill file in \"%s\": %s", directory,
+			strerror(errno));
+		free(spill);
+		return NULL;
+	}
+	unlink(path);
+	
+	result = posix_fallocate(spill->fd, 0, (off_t) spill->map_size);
+	if (result != 0) {
+		jackoff_warn("Failed to allocate %lu bytes for the spill file: %s",
+			spill->map_size, strerror(result));
+		close(spill->fd);
+		free(spill);
+		return NULL;
+	}
+	
+	spill->map = mmap(NULL, spill->map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, spill->fd, 0);
+	if (spill->map == MAP_FAILED) {
+		jackoff_warn("Failed to map the spill file: %s", strerror(errno));
+		close(spill->fd);
+		free(spill);
+		return NULL;
+	}
+	
+	jackoff_debug("Spill file: %lu frames; %lu bytes.", frames,
+		spill->map_size);
+	return spill;
+}
+
+void jackoff_destroy_spill(jackoff_spill_t* spill) {
+	munmap(spill->map, spill->map_size);
+	close(spill->fd);
+	free(spill);
+}
+
+size_t jackoff_spill_space(const jackoff_spill_t* spill) {
+	return spill->capacity - (spill->tail - spill->head);
+}
+
+size_t jackoff_spill_count(const jackoff_spill_t* spill) {
+	return spill->tail - spill->head;
+}
+
+/*
+ * Finds where frames [position, position + frames) of a channel live in the
+ * file: *first_frames of them at *first, and the rest, if the ring wraps, at
+ * *second.
+ */
+void jackoff_spill_regions(jackoff_spill_t* spill, size_t channel,
+	size_t position, size_t frames, jack_default_audio_sample_t** first,
+	size_t* first_frames, jack_default_audio_sample_t** second)
+{
+	jack_default_audio_sample_t* ring = spill->map +
+		channel * spill->capacity;
+	size_t offset = position % spill->capacity;
+	
+	*first = ring + offset;
+	*first_frames = spill->capacity - offset;
+	if (*first_frames > frames)
+		*first_frames = frames;
+	*second = ring;
+}
+
+/*
+ * Starts the thread that checks the host's clients every interval seconds
+ * and spills any whose ring buffers are filling up.
+ */
+jackoff_spiller_t* jackoff_start_spiller(struct jackoff_host* host,
+	float interval)
+{
+	jackoff_spiller_t* spiller;
+	pthread_attr_t attr;
+	int result;
+	
+	spiller = calloc(1, sizeof(jackoff_spiller_t));
+	if (!spiller) {
+		jackoff_warn("Failed to allocate memory for the spill thread.");
+		return NULL;
+	}
+	
+	spiller->host = host;
+	spiller->interval = interval;
+	spiller->running = 1;
+	jackoff_init_thread_attr(&attr);
+	result = pthread_create(&spiller->thread, &attr, spill_thread, spiller);
+	pthread_attr_destroy(&attr);
+	if (result != 0) {
+		jackoff_warn("Failed to start the spill thread.");
+		free(spiller);
+		return NULL;
+	}
+	
+	return spiller;
+}
+
+void jackoff_stop_spiller(jackoff_spiller_t* spiller) {
+	if (!spiller)
+		return;
+	
+	spiller->running = 0;
+	pthread_join(spiller->thread, NULL);
+	free(spiller);
+}
+
+static void* spill_thread(void* arg) {
+	jackoff_spiller_t* spiller = arg;
+	jackoff_host_t* host = spiller->host;
+	size_t i;
+	size_t moved;
+	
+	while (spiller->running) {
+		moved = 0;
+		for (i = 0; i < host->client_count; i++) {
+			if (host->clients[i]->spill)
+				moved += jackoff_client_spill(host->clients[i]);
+		}
+		
+		if (!moved)
+			usleep(1000000 * spiller->interval);
+	}
+	
+	return NULL;
+}
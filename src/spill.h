@@ -0,0 +1,61 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_SPILL_H_
+#define _JACKOFF_SPILL_H_
+
+#include <jack/jack.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * A second buffering tier behind a client's ring buffers: a large file,
+ * preallocated and mapped into memory, holding a ring of frames for each
+ * channel. The spill thread moves audio into it when the writer falls
+ * behind, and the writer reads it back before it goes on to the rings.
+ * head and tail are running frame counts; access is under the client's
+ * spill_lock.
+ */
+typedef struct jackoff_spill {
+	int fd;
+	jack_default_audio_sample_t* map;
+	size_t map_size;
+	size_t channels;
+	size_t capacity; // frames per channel
+	size_t head; // frames read back
+	size_t tail; // frames spilled
+} jackoff_spill_t;
+
+typedef struct jackoff_spiller jackoff_spiller_t;
+struct jackoff_host;
+
+jackoff_spill_t* jackoff_create_spill(const char* directory, size_t channels,
+	size_t frames);
+void jackoff_destroy_spill(jackoff_spill_t* spill);
+size_t jackoff_spill_space(const jackoff_spill_t* spill);
+size_t jackoff_spill_count(const jackoff_spill_t* spill);
+void jackoff_spill_regions(jackoff_spill_t* spill, size_t channel,
+	size_t position, size_t frames, jack_default_audio_sample_t** first,
+	size_t* first_frames, jack_default_audio_sample_t** second);
+
+jackoff_spiller_t* jackoff_start_spiller(struct jackoff_host* host,
+	float interval);
+void jackoff_stop_spiller(jackoff_spiller_t* spiller);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Records from the stand-in JACK graph in fakejack.c through the whole
+ * capture and writer path, with and without injected disk stalls and write
+ * failures, and checks what comes out: how many frames were dropped, that
+ * the metrics account for every frame of the requested duration, and how
+ * long the file is. Raw streams go through driver_stream; WAV files go
+ * through libsndfile and the write-behind buffer, where the disk faults
+ * land on each window's pwrite.
+ */
+
+#include "jackoff.h"
+#include "realtime.h"
+#include "configfile.h"
+#include "fakejack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SAMPLE_RATE 48000
+#define PERIOD 256
+#define DURATION 2.0
+
+// Long enough for any scenario, stalls and all; a hung writer fails.
+#define TIMEOUT 60
+
+// Enough spill file for the whole recording.
+#define SPILL_DURATION 10.0
+
+typedef enum {
+	EXPECT_COMPLETE, // every frame captured and in the file
+	EXPECT_DROPOUTS, // frames dropped, and counted
+	EXPECT_FAILURE // the recording fails
+} outcome_t;
+
+typedef struct {
+	const char* name;
+	const char* format; // "raw32" or "wav"
+	size_t channels;
+	float ring_duration;
+	int capture_flags;
+	int spill; // 1 to spill into the test directory
+	const char* faults; // JACKOFF_FAULTS, or NULL for none
+	outcome_t expect;
+} scenario_t;
+
+// The rings round up to a power of two in bytes: a 0.25 s ring holds about
+// a third of a second, and a 0.5 s one about two thirds. Two seconds of
+// 8-channel WAV fill the 1 MiB write-behind buffer once, a little under
+// 1.4 s in, so that write is the one a WAV scenario stalls or fails.
+static const scenario_t scenarios[] = {
+	{"1 channel, 0.25 s ring", "raw32", 1, 0.25, 0, 0, NULL,
+		EXPECT_COMPLETE},
+	{"8 channels, 1 s ring", "raw32", 8, 1.0, 0, 0, NULL, EXPECT_COMPLETE},
+	{"8 channels, 0.5 s of blocks", "raw32", 8, 0.5,
+		JACKOFF_TRANSPORT_BLOCKS, 0, NULL, EXPECT_COMPLETE},
+	{"8 channels of WAV, 0.5 s ring", "wav", 8, 0.5, 0, 0, NULL,
+		EXPECT_COMPLETE},
+	{"2 channels, 0.25 s ring, 700 ms stalls", "raw32", 2, 0.25, 0, 0,
+		"stall=700,every=50", EXPECT_DROPOUTS},
+	{"8 channels, 0.5 s ring, 1.2 s stalls", "raw32", 8, 0.5, 0, 0,
+		"stall=1200,every=50", EXPECT_DROPOUTS},
+	{"4 channels, 0.25 s of blocks, 700 ms stalls", "raw32", 4, 0.25,
+		JACKOFF_TRANSPORT_BLOCKS, 0, "stall=700,every=50", EXPECT_DROPOUTS},
+	{"8 channels of WAV, 0.25 s ring, 1.2 s stalls", "wav", 8, 0.25, 0, 0,
+		"stall=1200", EXPECT_DROPOUTS},
+	{"2 channels, 0.25 s ring and a spill file, 700 ms stalls", "raw32", 2,
+		0.25, 0, 1, "stall=700,every=50", EXPECT_COMPLETE},
+	{"2 channels, 0.5 s ring, failing writes", "raw32", 2, 0.5, 0, 0,
+		"fail=5", EXPECT_FAILURE},
+	{"8 channels of WAV, 0.5 s ring, failing writes", "wav", 8, 0.5, 0, 0,
+		"fail=1", EXPECT_FAILURE},
+	{NULL, NULL, 0, 0, 0, 0, NULL, EXPECT_COMPLETE}
+};
+
+// Defined in jackoff.c, which is built for the tests without its main().
+int run(jackoff_recording_t* recordings, size_t count,
+	const char* client_name, jack_options_t options, float buffer_duration,
+	size_t writer_threads, const jackoff_thread_policy_t* writer_policy,
+	int capture_flags, const char* metrics_path, const char* spill_dir,
+	float spill_duration);
+
+static int run_scenario(const scenario_t* scenario, const char* directory);
+static int check_ramp(const char* path, size_t channels, size_t frames);
+static long wav_frames(const char* path, size_t channels);
+static double read_metric(const char* path, const char* name);
+
+int main(int argc, char* argv[]) {
+	char directory[] = "/tmp/jackoff-test-XXXXXX";
+	const scenario_t* scenario;
+	pid_t child;
+	int status;
+	int failures = 0;
+	
+	if (!mkdtemp(directory)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	
+	// Each scenario runs in a process of its own, so that it gets its own
+	// fault plan and starts from a clean slate.
+	for (scenario = &scenarios[0]; scenario->name; scenario++) {
+		fflush(stdout);
+		child = fork();
+		if (child < 0) {
+			perror("fork");
+			return 1;
+		} else if (child == 0) {
+			alarm(TIMEOUT);
+			exit(run_scenario(scenario, directory));
+		}
+		
+		if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != 0)
+		{
+			printf("FAIL: %s\n", scenario->name);
+			failures++;
+		} else {
+			printf("PASS: %s\n", scenario->name);
+		}
+	}
+	
+	rmdir(directory);
+	return failures ? 1 : 0;
+}
+
+/*
+ * Records DURATION seconds as the scenario describes and checks the
+ * result. Returns nonzero if anything was wrong.
+ */
+static int run_scenario(const scenario_t* scenario, const char* directory) {
+	jackoff_recording_t recording;
+	jackoff_thread_policy_t policy;
+	char file_path[256];
+	char metrics_path[256];
+	struct stat info;
+	int wav = (0 == strcmp(scenario->format, "wav"));
+	size_t frame_size = scenario->channels * (wav ? 2 : sizeof(float));
+	double duration = DURATION * SAMPLE_RATE;
+	double captured, dropped, catch_up;
+	size_t frames;
+	long data_frames;
+	int result;
+	int failed = 0;
+	
+	snprintf(file_path, sizeof(file_path), "%s/recording-%d.%s", directory,
+		(int) getpid(), wav ? "wav" : "raw");
+	snprintf(metrics_path, sizeof(metrics_path), "%s/metrics-%d.prom",
+		directory, (int) getpid());
+	
+	if (scenario->faults)
+		setenv("JACKOFF_FAULTS", scenario->faults, 1);
+	else
+		unsetenv("JACKOFF_FAULTS");
+	
+	// Start a second short of where JACK's frame time wraps, so that every
+	// recording runs across the wrap.
+	fake_jack_configure(SAMPLE_RATE, PERIOD,
+		(jack_nframes_t) 0 - SAMPLE_RATE);
+	
+	memset(&recording, 0, sizeof(recording));
+	memset(&policy, 0, sizeof(policy));
+	recording.file_path = file_path;
+	recording.format = jackoff_get_output_format(scenario->format);
+	recording.channels = scenario->channels;
+	recording.duration = DURATION;
+	recording.settings.bitrate = -1;
+	recording.settings.dither = JACKOFF_DITHER_DEFAULT;
+	recording.settings.stream_backlog = JACKOFF_DEFAULT_STREAM_BACKLOG;
+	recording.settings.write_buffer = JACKOFF_DEFAULT_WRITE_BUFFER;
+	if (jackoff_resolve_recording(&recording) != 0)
+		return 1;
+	
+	result = run(&recording, 1, "jackoff-test", JackNullOption,
+		scenario->ring_duration, 1, &policy, scenario->capture_flags,
+		metrics_path, scenario->spill ? directory : NULL, SPILL_DURATION);
+	
+	if (stat(file_path, &info) != 0) {
+		printf("%s: no output file\n", scenario->name);
+		return 1;
+	}
+	frames = (size_t) info.st_size / frame_size;
+	if (wav) {
+		// The header says how much audio there is; a failed recording
+		// may not have got as far as writing it.
+		data_frames = wav_frames(file_path, scenario->channels);
+		if (data_frames < 0 && scenario->expect != EXPECT_FAILURE) {
+			printf("%s: the WAV file has no data chunk\n", scenario->name);
+			failed = 1;
+		}
+		frames = (data_frames > 0) ? (size_t) data_frames : 0;
+	}
+	captured = read_metric(metrics_path, "jackoff_frames_captured_total");
+	dropped = read_metric(metrics_path, "jackoff_frames_dropped_total");
+	catch_up = read_metric(metrics_path,
+		"jackoff_writer_catch_up_seconds_max");
+	printf("%s: %lu frames written, %.0f captured, %.0f dropped, "
+		"%.6f s longest catch-up\n", scenario->name, frames, captured,
+		dropped, catch_up);
+	
+	if (scenario->expect == EXPECT_FAILURE) {
+		if (result != 3) {
+			printf("%s: a failed write wasn't reported (run gave %d)\n",
+				scenario->name, result);
+			failed = 1;
+		}
+		if (frames >= (size_t) duration) {
+			printf("%s: the recording didn't stop at the failed write\n",
+				scenario->name);
+			failed = 1;
+		}
+	} else {
+		if (result != 0) {
+			printf("%s: the recording failed (run gave %d)\n",
+				scenario->name, result);
+			failed = 1;
+		}
+		if (!wav && info.st_size % frame_size != 0) {
+			printf("%s: the file ends partway through a frame\n",
+				scenario->name);
+			failed = 1;
+		}
+		if (captured + dropped != duration) {
+			printf("%s: %.0f frames captured and %.0f dropped; expected %.0f "
+				"in all\n", scenario->name, captured, dropped, duration);
+			failed = 1;
+		}
+		if (frames != captured) {
+			printf("%s: %lu frames in the file but %.0f captured\n",
+				scenario->name, frames, captured);
+			failed = 1;
+		}
+	}
+	
+	if (scenario->expect == EXPECT_COMPLETE) {
+		if (dropped != 0) {
+			printf("%s: %.0f frames dropped without any faults\n",
+				scenario->name, dropped);
+			failed = 1;
+		}
+		if (frames != (size_t) duration) {
+			printf("%s: %lu frames in the file; expected %.0f\n",
+				scenario->name, frames, duration);
+			failed = 1;
+		}
+		// The WAV scenarios are dithered down to 16 bits, so only their
+		// length is checked.
+		if (!wav && check_ramp(file_path, scenario->channels, frames) != 0)
+			failed = 1;
+	} else if (scenario->expect == EXPECT_DROPOUTS) {
+		if (dropped == 0) {
+			printf("%s: stalls longer than the transport dropped nothing\n",
+				scenario->name);
+			failed = 1;
+		}
+		if (catch_up <= 0) {
+			printf("%s: the writer's catch-up time wasn't recorded\n",
+				scenario->name);
+			failed = 1;
+		}
+	}
+	
+	unlink(file_path);
+	unlink(metrics_path);
+	return failed;
+}
+
+/*
+ * Checks that the file holds each channel's ramp unbroken, one frame after
+ * another, as its source played it.
+ */
+static int check_ramp(const char* path, size_t channels, size_t frames) {
+	FILE* file = fopen(path, "rb");
+	float* frame;
+	long first = 0, step;
+	size_t i, c;
+	int result = 0;
+	
+	frame = calloc(channels, sizeof(float));
+	if (!file || !frame) {
+		printf("%s: can't read the file back\n", path);
+		if (file)
+			fclose(file);
+		free(frame);
+		return 1;
+	}
+	
+	for (i = 0; i < frames && result == 0; i++) {
+		if (fread(frame, sizeof(float), channels, file) != channels) {
+			printf("%s: short read at frame %lu\n", path, i);
+			result = 1;
+			break;
+		}
+		if (i == 0)
+			first = (long) ((frame[0] + 0.5f) * FAKE_JACK_RAMP);
+		
+		for (c = 0; c < channels; c++) {
+			step = (first + (long) i) % FAKE_JACK_RAMP;
+			if (frame[c] != fake_jack_sample(c, (jack_nframes_t) step)) {
+				printf("%s: channel %lu breaks off at frame %lu\n", path,
+					c + 1, i);
+				result = 1;
+				break;
+			}
+		}
+	}
+	
+	fclose(file);
+	free(frame);
+	return result;
+}
+
+/*
+ * Reads how many 16-bit frames a WAV file's data chunk holds, or -1 if it
+ * has none, or if the file ends before the chunk does.
+ */
+static long wav_frames(const char* path, size_t channels) {
+	FILE* file = fopen(path, "rb");
+	unsigned char chunk[8];
+	uint32_t size;
+	long start;
+	long frames = -1;
+	
+	if (!file)
+		return -1;
+	if (fseek(file, 12, SEEK_SET) == 0) {
+		while (fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk)) {
+			size = (uint32_t) chunk[4] | ((uint32_t) chunk[5] << 8) |
+				((uint32_t) chunk[6] << 16) | ((uint32_t) chunk[7] << 24);
+			if (0 == memcmp(chunk, "data", 4)) {
+				start = ftell(file);
+				if (fseek(file, 0, SEEK_END) == 0 &&
+					ftell(file) - start >= (long) size &&
+					size % (channels * 2) == 0)
+					frames = (long) (size / (channels * 2));
+				break;
+			}
+			if (fseek(file, (long) (size + (size & 1)), SEEK_CUR) != 0)
+				break;
+		}
+	}
+	fclose(file);
+	return frames;
+}
+
+/*
+ * Reads one sample's value from a metrics file, or -1 if it isn't there.
+ */
+static double read_metric(const char* path, const char* name) {
+	FILE* file = fopen(path, "r");
+	char line[1024];
+	char* value;
+	size_t length = strlen(name);
+	double result = -1;
+	
+	if (!file)
+		return -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (0 == strncmp(line, name, length) && line[length] == '{') {
+			value = strrchr(line, ' ');
+			if (value)
+				result = strtod(value + 1, NULL);
+			break;
+		}
+	}
+	fclose(file);
+	return result;
+}
@@ -0,0 +1,209 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Checks that the vector conversion kernels in convert.c give exactly what
+ * the plain C conversion does, dither included, over ordinary audio and the
+ * edge cases: NaN, infinities, full scale and values that the dither can
+ * push past it. The edge cases are also checked against what they should
+ * become.
+ */
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+// Enough for several vectors and a ragged end.
+#define SAMPLES 1003
+#define SEED 0x5EED
+
+// From test_convert_scalar.c.
+void scalar_init_converter(jackoff_converter_t* converter, int bits,
+	jackoff_dither_t dither, uint32_t seed);
+void scalar_convert_to_short(jackoff_converter_t* converter,
+	const float* input, size_t samples, short* output);
+void scalar_convert_to_int(jackoff_converter_t* converter,
+	const float* input, size_t samples, int* output);
+
+static void fill_input(float* input, int bits);
+static int compare_kernels(const float* input, int bits,
+	jackoff_dither_t dither);
+static int check_edges(int bits, jackoff_dither_t dither);
+
+int main(int argc, char* argv[]) {
+	static float input[SAMPLES];
+	int bits, failures = 0;
+	
+	for (bits = 16; bits <= 24; bits += 8) {
+		fill_input(input, bits);
+		failures += compare_kernels(input, bits, JACKOFF_DITHER_NONE);
+		failures += compare_kernels(input, bits, JACKOFF_DITHER_TPDF);
+		failures += check_edges(bits, JACKOFF_DITHER_NONE);
+		failures += check_edges(bits, JACKOFF_DITHER_TPDF);
+	}
+	
+	if (failures)
+		printf("%d checks failed\n", failures);
+	return failures ? 1 : 0;
+}
+
+/*
+ * Edge cases first, scattered so that they land on every lane of the
+ * kernels; then a sine sweep, with a value on either side of each rounding
+ * boundary near full scale.
+ */
+static void fill_input(float* input, int bits) {
+	const float scale = (float) (1L << (bits - 1));
+	const float edges[] = {
+		NAN, -NAN, INFINITY, -INFINITY, 1.0f, -1.0f, 0.0f, -0.0f,
+		(scale - 1.0f) / scale, (scale - 1.5f) / scale,
+		(scale - 0.5f) / scale, (-scale + 0.5f) / scale,
+		(-scale + 1.0f) / scale, 2.0f, -2.0f, 1e30f, -1e30f,
+		0.5f / scale, -0.5f / scale, 1.5f / scale, FLT_MIN, -FLT_MIN
+	};
+	size_t count = sizeof(edges) / sizeof(edges[0]);
+	size_t i;
+	
+	for (i = 0; i < SAMPLES; i++)
+		input[i] = 0.9f * sinf((float) i * (float) i * 0.0007f);
+	for (i = 0; i < 3 * count; i++)
+		input[(i * 37) % SAMPLES] = edges[i % count];
+	for (i = 0; i < 64; i++)
+		input[SAMPLES - 1 - i] = (scale - 1.0f - (float) i * 0.25f) / scale;
+}
+
+/*
+ * Converts the input with both builds, in calls of uneven lengths so that
+ * each ends partway through a vector, and compares every sample.
+ */
+static int compare_kernels(const float* input, int bits,
+	jackoff_dither_t dither)
+{
+	static const size_t lengths[] = {SAMPLES, 1, 7, 8, 9, 64, 101};
+	jackoff_converter_t vector, scalar;
+	static short vector_short[SAMPLES], scalar_short[SAMPLES];
+	static int vector_int[SAMPLES], scalar_int[SAMPLES];
+	size_t start, length, l, i;
+	int failures = 0;
+	
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		jackoff_init_converter(&vector, bits, dither, SEED);
+		scalar_init_converter(&scalar, bits, dither, SEED);
+		
+		for (start = 0; start < SAMPLES; start += length) {
+			length = lengths[l];
+			if (length > SAMPLES - start)
+				length = SAMPLES - start;
+			if (bits == 16) {
+				jackoff_convert_to_short(&vector, input + start, length,
+					vector_short + start);
+				scalar_convert_to_short(&scalar, input + start, length,
+					scalar_short + start);
+			} else {
+				jackoff_convert_to_int(&vector, input + start, length,
+					vector_int + start);
+				scalar_convert_to_int(&scalar, input + start, length,
+					scalar_int + start);
+			}
+		}
+		
+		for (i = 0; i < SAMPLES; i++) {
+			if (bits == 16 ? vector_short[i] == scalar_short[i] :
+				vector_int[i] == scalar_int[i])
+				continue;
+			printf("%d-bit, %s, calls of %lu: sample %lu (%g) is %d, but "
+				"%d without the vector kernels\n", bits,
+				dither ? "dithered" : "rounded", lengths[l], i, input[i],
+				bits == 16 ? vector_short[i] : vector_int[i],
+				bits == 16 ? scalar_short[i] : scalar_int[i]);
+			failures++;
+		}
+	}
+	
+	return failures;
+}
+
+/*
+ * Checks what the edge cases become, in a full vector and in the
+ * remainder after one.
+ */
+static int check_edges(int bits, jackoff_dither_t dither) {
+	const int shift = 32 - bits;
+	const int full = (1 << (bits - 1)) - 1;
+	const struct {
+		float value;
+		int low, high; // the allowed range, before the shift to 32 bits
+	} edges[] = {
+		{NAN, 0, 0},
+		{-NAN, 0, 0},
+		{INFINITY, full, full},
+		{-INFINITY, -full - 1, -full - 1},
+		{1.0f, full, full},
+		{-1.0f, -full - 1, -full},
+		{2.0f, full, full},
+		{-2.0f, -full - 1, -full - 1},
+		{0.0f, -1, 1}
+	};
+	size_t count = sizeof(edges) / sizeof(edges[0]);
+	jackoff_converter_t converter;
+	float input[2 * JACKOFF_DITHER_LANES];
+	short short_output[2 * JACKOFF_DITHER_LANES];
+	int int_output[2 * JACKOFF_DITHER_LANES];
+	size_t e, i;
+	int value;
+	int failures = 0;
+	
+	jackoff_init_converter(&converter, bits, dither, SEED);
+	for (e = 0; e < count; e++) {
+		for (i = 0; i < 2 * JACKOFF_DITHER_LANES; i++)
+			input[i] = edges[e].value;
+		
+		// One vector's worth and then a few more for the remainder loop.
+		if (bits == 16) {
+			jackoff_convert_to_short(&converter, input,
+				JACKOFF_DITHER_LANES + 3, short_output);
+		} else {
+			jackoff_convert_to_int(&converter, input,
+				JACKOFF_DITHER_LANES + 3, int_output);
+		}
+		
+		for (i = 0; i < JACKOFF_DITHER_LANES + 3; i++) {
+			value = (bits == 16) ? short_output[i] : int_output[i] >> shift;
+			if (bits != 16 && (int_output[i] & ((1 << shift) - 1)) != 0) {
+				printf("%d-bit: %g leaves bits below the sample in %08x\n",
+					bits, edges[e].value, (unsigned) int_output[i]);
+				failures++;
+			}
+			if (value < edges[e].low || value > edges[e].high ||
+				(!dither && edges[e].value == 0.0f && value != 0))
+			{
+				printf("%d-bit, %s: %g became %d, not %d to %d\n", bits,
+					dither ? "dithered" : "rounded", edges[e].value, value,
+					edges[e].low, edges[e].high);
+				failures++;
+			}
+		}
+	}
+	
+	return failures;
+}
@@ -0,0 +1,33 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * convert.c built once more with its vector kernels compiled out, and its
+ * functions renamed, so that test_convert.c can check the build's kernels
+ * against the plain C ones.
+ */
+
+#undef __AVX2__
+#undef __SSE2__
+
+#define jackoff_init_converter scalar_init_converter
+#define jackoff_convert_to_short scalar_convert_to_short
+#define jackoff_convert_to_int scalar_convert_to_int
+
+#include "convert.c"
@@ -0,0 +1,182 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "threadpool.h"
+#include "logging.h"
+
+#include <unistd.h>
+#include <sched.h>
+
+typedef struct task {
+	jackoff_task_function_t function;
+	void* arg;
+	struct task* next;
+} task_t;
+
+struct jackoff_thread_pool {
+	pthread_t* threads;
+	size_t thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	task_t* head;
+	task_t* tail;
+	int stopping;
+};
+
+static void* worker_thread(void* arg);
+
+jackoff_thread_pool_t* jackoff_create_thread_pool(size_t threads,
+	const pthread_attr_t* attr)
+{
+	jackoff_thread_pool_t* pool;
+	
+	pool = calloc(1, sizeof(jackoff_thread_pool_t));
+	if (!pool) {
+		jackoff_warn("Failed to allocate memory for the thread pool.");
+		return NULL;
+	}
+	
+	pool->threads = calloc(threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		jackoff_warn("Failed to allocate memory for the thread pool.");
+		return NULL;
+	}
+	
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	
+	for (; pool->thread_count < threads; pool->thread_count++) {
+		if (pthread_create(&pool->threads[pool->thread_count], attr,
+			worker_thread, pool) != 0)
+		{
+			jackoff_warn("Failed to start worker thread %lu.",
+				pool->thread_count + 1);
+			break;
+		}
+	}
+	
+	if (pool->thread_count == 0) {
+		jackoff_destroy_thread_pool(pool);
+		return NULL;
+	}
+	
+	jackoff_debug("Started a pool of %lu worker threads.", pool->thread_count);
+	return pool;
+}
+
+/*
+ * Queues a task to be run by the next free worker. Returns 0 on success.
+ */
+int jackoff_submit_task(jackoff_thread_pool_t* pool,
+	jackoff_task_function_t function, void* arg)
+{
+	task_t* task = malloc(sizeof(task_t));
+	
+	if (!task)
+		return -1;
+	task->function = function;
+	task->arg = arg;
+	task->next = NULL;
+	
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = task;
+	else
+		pool->head = task;
+	pool->tail = task;
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	
+	return 0;
+}
+
+/*
+ * Runs every task still queued, then stops the workers.
+ */
+void jackoff_destroy_thread_pool(jackoff_thread_pool_t* pool) {
+	size_t i;
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+	
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * How many workers the pool actually started, which can be fewer than
+ * were asked for.
+ */
+size_t jackoff_thread_pool_size(const jackoff_thread_pool_t* pool) {
+	return pool->thread_count;
+}
+
+/*
+ * How many CPUs a thread started with the given attributes may run on: those
+ * in their affinity mask, or in the calling thread's if they have none or
+ * are NULL, or every CPU online if neither can be had.
+ */
+size_t jackoff_available_cpus(const pthread_attr_t* attr) {
+	cpu_set_t set;
+	long cpus;
+	
+	if (attr && pthread_attr_getaffinity_np(attr, sizeof(cpu_set_t),
+		&set) == 0 && CPU_COUNT(&set) > 0)
+		return (size_t) CPU_COUNT(&set);
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == 0 &&
+		CPU_COUNT(&set) > 0)
+		return (size_t) CPU_COUNT(&set);
+	
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (size_t) cpus : 1;
+}
+
+static void* worker_thread(void* arg) {
+	jackoff_thread_pool_t* pool = arg;
+	task_t* task;
+	
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->head && !pool->stopping)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		
+		task = pool->head;
+		if (!task) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pool->head = task->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+		
+		task->function(task->arg);
+		free(task);
+	}
+	
+	return NULL;
+}
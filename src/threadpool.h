@@ -0,0 +1,43 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_THREADPOOL_H_
+#define _JACKOFF_THREADPOOL_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct jackoff_thread_pool jackoff_thread_pool_t;
+typedef void (*jackoff_task_function_t)(void* arg);
+
+/*
+ * A fixed set of worker threads running tasks in the order they are
+ * submitted. Tasks report their own completion; the pool only runs them.
+ * The workers are started with the given attributes, or inherit the
+ * caller's scheduling if they are NULL.
+ */
+jackoff_thread_pool_t* jackoff_create_thread_pool(size_t threads,
+	const pthread_attr_t* attr);
+int jackoff_submit_task(jackoff_thread_pool_t* pool,
+	jackoff_task_function_t function, void* arg);
+void jackoff_destroy_thread_pool(jackoff_thread_pool_t* pool);
+size_t jackoff_thread_pool_size(const jackoff_thread_pool_t* pool);
+size_t jackoff_available_cpus(const pthread_attr_t* attr);
+
+#endif
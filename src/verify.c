@@ -0,0 +1,358 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * jackoff-verify: checks recordings against the manifests written beside
+ * them, reading the blocks of every file in parallel.
+ */
+
+#include "manifest.h"
+#include "crc32c.h"
+#include "threadpool.h"
+#include "logging.h"
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Each task reads this many blocks: enough to keep a disk streaming,
+// few enough that the files spread over every thread.
+#define BLOCKS_PER_TASK 16
+
+typedef struct verify_file {
+	char* path;
+	char* manifest_path;
+	jackoff_checksums_t* checksums;
+	int fd;
+	uint32_t* crcs; // as read
+	int unreadable;
+} verify_file_t;
+
+typedef struct verify_task {
+	struct verifier* verifier;
+	verify_file_t* file;
+	size_t first;
+	size_t count;
+} verify_task_t;
+
+typedef struct verifier {
+	jackoff_thread_pool_t* pool;
+	size_t remaining; // tasks still running
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+} verifier_t;
+
+static void show_usage_info(char* prog_name);
+static int open_file(verify_file_t* file, const char* argument);
+static void close_file(verify_file_t* file);
+static int check_file(verify_file_t* file);
+static void verify_blocks(void* arg);
+
+static const char* short_options = "j:vqh";
+static const struct option long_options[] = {
+	{"threads", required_argument, NULL, 'j'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"quiet", no_argument, NULL, 'q'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0}
+};
+
+/* The logger calls this on errors; there's nothing to wind down here. */
+void jackoff_shutdown() {
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	size_t threads = 0;
+	verifier_t verifier;
+	verify_file_t* files;
+	verify_task_t* tasks;
+	size_t file_count, task_count, blocks, i, t;
+	int option, long_index;
+	int failed = 0;
+	
+	while (1) {
+		option = getopt_long(argc, argv, short_options, long_options,
+			&long_index);
+		
+		if (option == -1)
+			break;
+		
+		switch (option) {
+			case 'j':
+				threads = (size_t) strtol(optarg, NULL, 0);
+				break;
+			case 'v':
+				jackoff_set_log_cutoff(JACKOFF_LOG_DEBUG);
+				break;
+			case 'q':
+				jackoff_set_log_cutoff(JACKOFF_LOG_WARNING);
+				break;
+			default:
+				show_usage_info(argv[0]);
+				return 10;
+		}
+	}
+	
+	if (argc - optind < 1) {
+		show_usage_info(argv[0]);
+		return 10;
+	}
+	argc -= optind;
+	argv += optind;
+	file_count = (size_t) argc;
+	
+	files = calloc(file_count, sizeof(verify_file_t));
+	if (!files) {
+		jackoff_error("failed to allocate memory");
+	}
+	
+	task_count = 0;
+	for (i = 0; i < file_count; i++) {
+		if (open_file(&files[i], argv[i]) != 0) {
+			failed = 1;
+			continue;
+		}
+		blocks = files[i].checksums->count;
+		task_count += (blocks + BLOCKS_PER_TASK - 1) / BLOCKS_PER_TASK;
+	}
+	
+	memset(&verifier, 0, sizeof(verifier));
+	pthread_mutex_init(&verifier.lock, NULL);
+	pthread_cond_init(&verifier.finished, NULL);
+	verifier.pool = jackoff_create_thread_pool(threads ? threads :
+		jackoff_available_cpus(NULL), NULL);
+	tasks = calloc(task_count ? task_count : 1, sizeof(verify_task_t));
+	if (!verifier.pool || !tasks) {
+		jackoff_error("failed to start the verifying threads");
+	}
+	
+	// Every block of every file goes to the pool at once.
+	t = 0;
+	for (i = 0; i < file_count; i++) {
+		if (!files[i].checksums)
+			continue;
+		for (blocks = 0; blocks < files[i].checksums->count;
+			blocks += BLOCKS_PER_TASK)
+		{
+			tasks[t].verifier = &verifier;
+			tasks[t].file = &files[i];
+			tasks[t].first = blocks;
+			tasks[t].count = files[i].checksums->count - blocks;
+			if (tasks[t].count > BLOCKS_PER_TASK)
+				tasks[t].count = BLOCKS_PER_TASK;
+			t++;
+		}
+	}
+	verifier.remaining = task_count;
+	for (t = 0; t < task_count; t++) {
+		if (jackoff_submit_task(verifier.pool, verify_blocks, &tasks[t]) != 0)
+			verify_blocks(&tasks[t]);
+	}
+	pthread_mutex_lock(&verifier.lock);
+	while (verifier.remaining > 0)
+		pthread_cond_wait(&verifier.finished, &verifier.lock);
+	pthread_mutex_unlock(&verifier.lock);
+	
+	for (i = 0; i < file_count; i++) {
+		if (files[i].checksums && check_file(&files[i]) != 0)
+			failed = 1;
+		close_file(&files[i]);
+	}
+	
+	jackoff_destroy_thread_pool(verifier.pool);
+	pthread_cond_destroy(&verifier.finished);
+	pthread_mutex_destroy(&verifier.lock);
+	free(tasks);
+	free(files);
+	return failed;
+}
+
+static void show_usage_info(char* prog_name) {
+	printf("%s\n\n", PACKAGE_STRING);
+	printf("Usage: %s [options] <recording or manifest>...\n", prog_name);
+	printf("  -j N, --threads=N                   number of threads "
+		"reading [one per CPU]\n");
+	printf("  -v, --verbose                       include debug output\n");
+	printf("  -q, --quiet                         report only failures\n");
+	printf("  -h, --help                          show this help and exit\n");
+}
+
+/*
+ * Finds a recording and its manifest from either of their names, and
+ * opens them. Returns 0 if both are there and agree on the file's size.
+ */
+static int open_file(verify_file_t* file, const char* argument) {
+	static const char suffix[] = ".manifest";
+	size_t length = strlen(argument);
+	struct stat status;
+	
+	file->fd = -1;
+	file->path = strdup(argument);
+	file->manifest_path = malloc(length + sizeof(suffix));
+	if (!file->path || !file->manifest_path) {
+		jackoff_warn("Failed to allocate memory.");
+		return -1;
+	}
+	if (length > sizeof(suffix) - 1 &&
+		0 == strcmp(argument + length - (sizeof(suffix) - 1), suffix))
+	{
+		strcpy(file->manifest_path, argument);
+		file->path[length - (sizeof(suffix) - 1)] = 0;
+	} else {
+		sprintf(file->manifest_path, "%s%s", argument, suffix);
+	}
+	
+	file->checksums = jackoff_load_manifest(file->manifest_path);
+	if (!file->checksums)
+		return -1;
+	
+	file->fd = open(file->path, O_RDONLY);
+	if (file->fd < 0 || fstat(file->fd, &status) != 0) {
+		jackoff_warn("\"%s\": %s", file->path, strerror(errno));
+		goto fail;
+	}
+	if ((uint64_t) status.st_size != file->checksums->size) {
+		jackoff_warn("\"%s\": FAILED: %llu bytes long, but the manifest "
+			"says %llu.", file->path, (unsigned long long) status.st_size,
+			(unsigned long long) file->checksums->size);
+		goto fail;
+	}
+	
+	file->crcs = calloc(file->checksums->count ? file->checksums->count : 1,
+		sizeof(uint32_t));
+	if (!file->crcs) {
+		jackoff_warn("Failed to allocate memory.");
+		goto fail;
+	}
+	
+	// The kernel can read ahead of every thread, block after block.
+	posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return 0;
+	
+fail:
+	jackoff_free_checksums(file->checksums);
+	file->checksums = NULL;
+	return -1;
+}
+
+static void close_file(verify_file_t* file) {
+	if (file->fd >= 0)
+		close(file->fd);
+	if (file->checksums)
+		jackoff_free_checksums(file->checksums);
+	free(file->crcs);
+	free(file->path);
+	free(file->manifest_path);
+}
+
+/*
+ * Compares what was read with the manifest, block by block and as a
+ * whole, and reports on the file. Returns 0 if it matches.
+ */
+static int check_file(verify_file_t* file) {
+	jackoff_checksums_t* checksums = file->checksums;
+	uint64_t offset, length;
+	uint32_t whole = 0;
+	size_t bad = 0;
+	size_t i;
+	
+	if (file->unreadable) {
+		jackoff_warn("\"%s\": FAILED: could not be read.", file->path);
+		return -1;
+	}
+	
+	for (i = 0; i < checksums->count; i++) {
+		offset = (uint64_t) i * checksums->block_size;
+		length = checksums->size - offset;
+		if (length > checksums->block_size)
+			length = checksums->block_size;
+		
+		if (file->crcs[i] != checksums->blocks[i]) {
+			jackoff_warn("\"%s\": block %lu (bytes %llu to %llu) doesn't "
+				"match.", file->path, i, (unsigned long long) offset,
+				(unsigned long long) (offset + length - 1));
+			bad++;
+		}
+		whole = jackoff_crc32c_combine(whole, file->crcs[i], length);
+	}
+	
+	if (bad > 0) {
+		jackoff_warn("\"%s\": FAILED: %lu of %lu blocks don't match.",
+			file->path, bad, checksums->count);
+		return -1;
+	}
+	if (whole != checksums->crc) {
+		jackoff_warn("\"%s\": FAILED: the blocks match, but the whole file "
+			"doesn't; the manifest is inconsistent.", file->path);
+		return -1;
+	}
+	
+	jackoff_info("\"%s\": OK", file->path);
+	return 0;
+}
+
+static void verify_blocks(void* arg) {
+	verify_task_t* task = arg;
+	verify_file_t* file = task->file;
+	jackoff_checksums_t* checksums = file->checksums;
+	verifier_t* verifier = task->verifier;
+	unsigned char* buffer;
+	uint64_t offset;
+	size_t length, done, i;
+	ssize_t got;
+	
+	buffer = malloc(checksums->block_size);
+	for (i = task->first; buffer && i < task->first + task->count; i++) {
+		offset = (uint64_t) i * checksums->block_size;
+		length = (checksums->size - offset < checksums->block_size) ?
+			(size_t) (checksums->size - offset) : checksums->block_size;
+		
+		for (done = 0; done < length; done += (size_t) got) {
+			got = pread(file->fd, buffer + done, length - done,
+				(off_t) (offset + done));
+			if (got < 0 && errno == EINTR) {
+				got = 0;
+				continue;
+			}
+			if (got <= 0)
+				break;
+		}
+		if (done < length)
+			break;
+		file->crcs[i] = jackoff_crc32c(0, buffer, length);
+	}
+	if (!buffer || i < task->first + task->count)
+		file->unreadable = 1;
+	free(buffer);
+	
+	pthread_mutex_lock(&verifier->lock);
+	verifier->remaining--;
+	pthread_cond_broadcast(&verifier->finished);
+	pthread_mutex_unlock(&verifier->lock);
+}
@@ -0,0 +1,520 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "writebehind.h"
+#include "metrics.h"
+#include "logging.h"
+#include "realtime.h"
+#include "faults.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+struct jackoff_write_behind {
+	int fd;
+	size_t capacity; // of each window; a whole number of pages
+	size_t page_size;
+	char* windows[2];
+	char* active;
+	sf_count_t start; // file offset of active[0]; page-aligned
+	size_t length; // bytes of the window that are valid
+	sf_count_t position; // libsndfile's idea of where it is
+	sf_count_t file_length;
+	int error; // errno of the first failed write
+	sf_count_t failed_at; // start of the first window that failed; or -1
+	jackoff_manifest_t* manifest; // sees every write, if there is one
+	
+	/* The writing thread, if there is one, and the window it's writing. */
+	int threaded;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	char* pending;
+	sf_count_t pending_start;
+	size_t pending_length;
+	int stopping;
+	
+	/* The thread's writes, timed for the metrics. Only writers may touch
+	 * their counters, so these wait here, under the lock, until a writer
+	 * takes them over. */
+	jackoff_counters_t tally;
+};
+
+static sf_count_t vio_get_filelen(void* data);
+static sf_count_t vio_seek(sf_count_t offset, int whence, void* data);
+static sf_count_t vio_read(void* ptr, sf_count_t count, void* data);
+static sf_count_t vio_write(const void* ptr, sf_count_t count, void* data);
+static sf_count_t vio_tell(void* data);
+
+static int write_window(jackoff_write_behind_t* buffer);
+static int flush_window(jackoff_write_behind_t* buffer);
+static int move_window(jackoff_write_behind_t* buffer);
+static void drain(jackoff_write_behind_t* buffer);
+static void take_tally(jackoff_write_behind_t* buffer);
+static void write_failed(jackoff_write_behind_t* buffer, sf_count_t start,
+	int error);
+static int write_fully(int fd, const char* data, size_t length,
+	sf_count_t offset, jackoff_counters_t* counters);
+static void* writer_thread(void* arg);
+
+static SF_VIRTUAL_IO write_behind_io = {
+	vio_get_filelen,
+	vio_seek,
+	vio_read,
+	vio_write,
+	vio_tell
+};
+
+/*
+ * Creates a write-behind buffer of `size` bytes (rounded up to whole pages)
+ * for a file that has just been opened for reading and writing and is
+ * empty. Returns NULL on failure.
+ */
+jackoff_write_behind_t* jackoff_create_write_behind(int fd, size_t size,
+	int threaded)
+{
+	jackoff_write_behind_t* buffer;
+	pthread_attr_t attr;
+	int result;
+	int i;
+	
+	buffer = calloc(1, sizeof(jackoff_write_behind_t));
+	if (!buffer) {
+		jackoff_warn("Failed to allocate the write-behind buffer.");
+		return NULL;
+	}
+	
+	buffer->fd = fd;
+	buffer->failed_at = -1;
+	buffer->page_size = (size_t) sysconf(_SC_PAGESIZE);
+	buffer->capacity = (size + buffer->page_size - 1) / buffer->page_size *
+		buffer->page_size;
+	if (buffer->capacity == 0)
+		buffer->capacity = buffer->page_size;
+	pthread_mutex_init(&buffer->lock, NULL);
+	pthread_cond_init(&buffer->changed, NULL);
+	
+	for (i = 0; i < (threaded ? 2 : 1); i++) {
+		if (posix_memalign((void**) &buffer->windows[i], buffer->page_size,
+			buffer->capacity) != 0)
+		{
+			jackoff_warn("Failed to allocate the write-behind buffer.");
+			jackoff_destroy_write_behind(buffer);
+			return NULL;
+		}
+	}
+	buffer->active = buffer->windows[0];
+	
+	if (threaded) {
+		jackoff_init_thread_attr(&attr);
+		result = pthread_create(&buffer->thread, &attr, writer_thread, buffer);
+		pthread_attr_destroy(&attr);
+		if (result != 0) {
+			jackoff_warn("Failed to start the write-behind thread.");
+			jackoff_destroy_write_behind(buffer);
+			return NULL;
+		}
+		buffer->threaded = 1;
+	}
+	
+	return buffer;
+}
+
+/*
+ * Writes out whatever is still buffered, syncs the file, and frees the
+ * buffer (but doesn't close the file). Returns -1 if anything failed to
+ * reach the file, now or earlier.
+ */
+int jackoff_destroy_write_behind(jackoff_write_behind_t* buffer) {
+	uint64_t started;
+	int result = 0;
+	
+	if (buffer->active && flush_window(buffer) != 0)
+		result = -1;
+	
+	if (buffer->threaded) {
+		pthread_mutex_lock(&buffer->lock);
+		buffer->stopping = 1;
+		pthread_cond_broadcast(&buffer->changed);
+		pthread_mutex_unlock(&buffer->lock);
+		pthread_join(buffer->thread, NULL);
+	}
+	
+	// Whatever the manifest took in passing from the failed window on may
+	// never have reached the file, so it reads that back instead.
+	if (buffer->manifest && buffer->failed_at >= 0) {
+		jackoff_manifest_write_failed(buffer->manifest,
+			(uint64_t) buffer->failed_at);
+	}
+	
+	if (buffer->error) {
+		jackoff_warn("Failed to write audio to disk: %s",
+			strerror(buffer->error));
+		result = -1;
+	} else if (buffer->active) {
+		started = jackoff_write_started();
+		if (fsync(buffer->fd) != 0 && errno != EINVAL) {
+			jackoff_warn("Failed to sync output file: %s", strerror(errno));
+			result = -1;
+		}
+		jackoff_count_write(started, 0);
+	}
+	
+	pthread_cond_destroy(&buffer->changed);
+	pthread_mutex_destroy(&buffer->lock);
+	free(buffer->windows[0]);
+	free(buffer->windows[1]);
+	free(buffer);
+	return result;
+}
+
+/* The callbacks to pass to sf_open_virtual, with the buffer as user data. */
+SF_VIRTUAL_IO* jackoff_write_behind_io() {
+	return &write_behind_io;
+}
+
+/*
+ * Where libsndfile's next write will land in the file.
+ */
+sf_count_t jackoff_write_behind_tell(const jackoff_write_behind_t* buffer) {
+	return buffer->position;
+}
+
+/*
+ * Has every write libsndfile makes checksummed into the manifest, at the
+ * offset it makes it, as it makes it.
+ */
+void jackoff_write_behind_checksum(jackoff_write_behind_t* buffer,
+	jackoff_manifest_t* manifest)
+{
+	buffer->manifest = manifest;
+}
+
+/*
+ * Parses a write buffer size: "MB", or "thread:MB" to write the buffer out
+ * from its own thread. A size of 0 turns the buffer off.
+ */
+int jackoff_parse_write_buffer(const char* value, size_t* size,
+	int* threaded)
+{
+	char* end;
+	double megabytes;
+	
+	*threaded = 0;
+	if (0 == strncmp(value, "thread:", 7)) {
+		*threaded = 1;
+		value += 7;
+	}
+	
+	megabytes = strtod(value, &end);
+	if (end == value || *end != 0 || megabytes < 0)
+		return 0;
+	*size = (size_t) (megabytes * 1024 * 1024);
+	return 1;
+}
+
+static sf_count_t vio_get_filelen(void* data) {
+	jackoff_write_behind_t* buffer = data;
+	return buffer->file_length;
+}
+
+static sf_count_t vio_seek(sf_count_t offset, int whence, void* data) {
+	jackoff_write_behind_t* buffer = data;
+	
+	switch (whence) {
+		case SEEK_SET:
+			buffer->position = offset;
+			break;
+		case SEEK_CUR:
+			buffer->position += offset;
+			break;
+		case SEEK_END:
+			buffer->position = buffer->file_length + offset;
+			break;
+	}
+	return buffer->position;
+}
+
+static sf_count_t vio_read(void* ptr, sf_count_t count, void* data) {
+	jackoff_write_behind_t* buffer = data;
+	ssize_t result;
+	
+	// Rare while writing, so the window just goes to the file first.
+	if (flush_window(buffer) != 0)
+		return 0;
+	buffer->start = buffer->position & ~((sf_count_t) buffer->page_size - 1);
+	buffer->length = 0;
+	
+	result = pread(buffer->fd, ptr, (size_t) count, buffer->position);
+	if (result < 0)
+		return 0;
+	buffer->position += result;
+	return result;
+}
+
+static sf_count_t vio_write(const void* ptr, sf_count_t count, void* data) {
+	jackoff_write_behind_t* buffer = data;
+	const char* source = ptr;
+	sf_count_t remaining = count;
+	size_t offset, amount;
+	
+	if (__atomic_load_n(&buffer->error, __ATOMIC_ACQUIRE))
+		return 0;
+	if (buffer->manifest) {
+		jackoff_manifest_write(buffer->manifest, (uint64_t) buffer->position,
+			ptr, (size_t) count);
+	}
+	
+	// The window must hold the position, or end just before it.
+	if (buffer->position < buffer->start ||
+		buffer->position > buffer->start + (sf_count_t) buffer->length)
+	{
+		if (move_window(buffer) != 0)
+			return 0;
+	}
+	
+	while (remaining > 0) {
+		offset = (size_t) (buffer->position - buffer->start);
+		amount = buffer->capacity - offset;
+		if ((sf_count_t) amount > remaining)
+			amount = (size_t) remaining;
+		
+		memcpy(buffer->active + offset, source, amount);
+		source += amount;
+		remaining -= amount;
+		buffer->position += amount;
+		if (offset + amount > buffer->length)
+			buffer->length = offset + amount;
+		if (buffer->position > buffer->file_length)
+			buffer->file_length = buffer->position;
+		
+		if (buffer->length == buffer->capacity &&
+			buffer->position == buffer->start + (sf_count_t) buffer->capacity)
+		{
+			if (write_window(buffer) != 0)
+				return count - remaining;
+		}
+	}
+	
+	return count;
+}
+
+static sf_count_t vio_tell(void* data) {
+	jackoff_write_behind_t* buffer = data;
+	return buffer->position;
+}
+
+/*
+ * Sends a full window to the file and starts the next one right after it.
+ * With a thread, the window is handed to it, and filling carries on in the
+ * other window as soon as the thread has finished with that one.
+ */
+static int write_window(jackoff_write_behind_t* buffer) {
+	if (buffer->threaded) {
+		pthread_mutex_lock(&buffer->lock);
+		while (buffer->pending)
+			pthread_cond_wait(&buffer->changed, &buffer->lock);
+		take_tally(buffer);
+		buffer->pending = buffer->active;
+		buffer->pending_start = buffer->start;
+		buffer->pending_length = buffer->length;
+		pthread_cond_broadcast(&buffer->changed);
+		pthread_mutex_unlock(&buffer->lock);
+		
+		buffer->active = (buffer->active == buffer->windows[0]) ?
+			buffer->windows[1] : buffer->windows[0];
+	} else if (write_fully(buffer->fd, buffer->active, buffer->length,
+		buffer->start, jackoff_thread_counters) != 0)
+	{
+		write_failed(buffer, buffer->start, errno);
+		return -1;
+	}
+	
+	buffer->start += buffer->capacity;
+	buffer->length = 0;
+	return 0;
+}
+
+/*
+ * Writes out the window as it is, full or not, and waits until nothing is
+ * left in flight.
+ */
+static int flush_window(jackoff_write_behind_t* buffer) {
+	drain(buffer);
+	if (buffer->length > 0 && write_fully(buffer->fd, buffer->active,
+		buffer->length, buffer->start, jackoff_thread_counters) != 0)
+	{
+		write_failed(buffer, buffer->start, errno);
+		return -1;
+	}
+	return buffer->error ? -1 : 0;
+}
+
+/*
+ * Moves the window to the page holding the position. What the file
+ * already has between the page's start and the position is read back in,
+ * so the window still goes out in whole pages from an aligned offset.
+ */
+static int move_window(jackoff_write_behind_t* buffer) {
+	size_t head;
+	sf_count_t existing;
+	ssize_t result;
+	
+	if (flush_window(buffer) != 0)
+		return -1;
+	
+	buffer->start = buffer->position & ~((sf_count_t) buffer->page_size - 1);
+	head = (size_t) (buffer->position - buffer->start);
+	existing = buffer->file_length - buffer->start;
+	if (existing > (sf_count_t) head)
+		existing = head;
+	
+	if (existing > 0) {
+		result = pread(buffer->fd, buffer->active, (size_t) existing,
+			buffer->start);
+		if (result != existing) {
+			buffer->error = (result < 0) ? errno : EIO;
+			return -1;
+		}
+	} else {
+		existing = 0;
+	}
+	memset(buffer->active + existing, 0, head - (size_t) existing);
+	buffer->length = head;
+	return 0;
+}
+
+static void drain(jackoff_write_behind_t* buffer) {
+	if (!buffer->threaded)
+		return;
+	pthread_mutex_lock(&buffer->lock);
+	while (buffer->pending)
+		pthread_cond_wait(&buffer->changed, &buffer->lock);
+	take_tally(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+/*
+ * Moves the thread's write timings over to the calling writer's counters.
+ * Called with the lock held.
+ */
+static void take_tally(jackoff_write_behind_t* buffer) {
+	jackoff_counters_t* counters = jackoff_thread_counters;
+	
+	if (counters) {
+		jackoff_count(counters, JACKOFF_METRIC_WRITE_CALLS,
+			buffer->tally.values[JACKOFF_METRIC_WRITE_CALLS]);
+		jackoff_count(counters, JACKOFF_METRIC_WRITE_NSEC,
+			buffer->tally.values[JACKOFF_METRIC_WRITE_NSEC]);
+		jackoff_count_max(counters, JACKOFF_METRIC_WRITE_MAX_NSEC,
+			buffer->tally.values[JACKOFF_METRIC_WRITE_MAX_NSEC]);
+		jackoff_count(counters, JACKOFF_METRIC_BYTES_WRITTEN,
+			buffer->tally.values[JACKOFF_METRIC_BYTES_WRITTEN]);
+	}
+	memset(&buffer->tally, 0, sizeof(buffer->tally));
+}
+
+/*
+ * Notes that the window at start failed to reach the file. The first error
+ * is the one reported. Called by the thread with the lock held, or by the
+ * writer while the thread is idle.
+ */
+static void write_failed(jackoff_write_behind_t* buffer, sf_count_t start,
+	int error)
+{
+	if (buffer->failed_at < 0 || start < buffer->failed_at)
+		buffer->failed_at = start;
+	if (!buffer->error)
+		__atomic_store_n(&buffer->error, error, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes the whole of data at offset, timing each pwrite into counters if
+ * they aren't NULL.
+ */
+static int write_fully(int fd, const char* data, size_t length,
+	sf_count_t offset, jackoff_counters_t* counters)
+{
+	uint64_t started = 0;
+	ssize_t written;
+	size_t amount;
+	
+	while (length > 0) {
+		amount = length;
+		if (counters)
+			started = jackoff_metrics_clock();
+		if (jackoff_inject_fault(&amount) != 0)
+			written = -1;
+		else
+			written = pwrite(fd, data, amount, offset);
+		jackoff_count_write_to(counters, started,
+			(written > 0) ? (size_t) written : 0);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return -1;
+		data += written;
+		length -= (size_t) written;
+		offset += written;
+	}
+	return 0;
+}
+
+static void* writer_thread(void* arg) {
+	jackoff_write_behind_t* buffer = arg;
+	jackoff_counters_t timing;
+	jackoff_metric_t metric;
+	sf_count_t start;
+	int error;
+	
+	pthread_mutex_lock(&buffer->lock);
+	while (1) {
+		while (!buffer->pending && !buffer->stopping)
+			pthread_cond_wait(&buffer->changed, &buffer->lock);
+		if (!buffer->pending)
+			break;
+		pthread_mutex_unlock(&buffer->lock);
+		
+		error = 0;
+		start = buffer->pending_start;
+		memset(&timing, 0, sizeof(timing));
+		if (write_fully(buffer->fd, buffer->pending, buffer->pending_length,
+			start, &timing) != 0)
+			error = errno;
+		
+		pthread_mutex_lock(&buffer->lock);
+		for (metric = 0; metric < JACKOFF_METRIC_COUNT; metric++) {
+			if (metric == JACKOFF_METRIC_WRITE_MAX_NSEC) {
+				jackoff_count_max(&buffer->tally, metric,
+					timing.values[metric]);
+			} else {
+				jackoff_count(&buffer->tally, metric, timing.values[metric]);
+			}
+		}
+		if (error)
+			write_failed(buffer, start, error);
+		buffer->pending = NULL;
+		pthread_cond_broadcast(&buffer->changed);
+	}
+	pthread_mutex_unlock(&buffer->lock);
+	
+	return NULL;
+}
@@ -0,0 +1,47 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_WRITEBEHIND_H_
+#define _JACKOFF_WRITEBEHIND_H_
+
+#include <stdlib.h>
+#include <sndfile.h>
+#include "manifest.h"
+
+/*
+ * A write-behind buffer for libsndfile's virtual I/O. libsndfile writes a
+ * little at a time; the buffer gathers those writes into a page-aligned
+ * window and sends the window to the file only when it is full, in one
+ * write of whole pages. Seeks back into what is already written (to patch a
+ * header, say) move the window there. With a thread, full windows are
+ * written by it while the other of two windows is being filled.
+ */
+typedef struct jackoff_write_behind jackoff_write_behind_t;
+
+jackoff_write_behind_t* jackoff_create_write_behind(int fd, size_t size,
+	int threaded);
+int jackoff_destroy_write_behind(jackoff_write_behind_t* buffer);
+SF_VIRTUAL_IO* jackoff_write_behind_io();
+sf_count_t jackoff_write_behind_tell(const jackoff_write_behind_t* buffer);
+void jackoff_write_behind_checksum(jackoff_write_behind_t* buffer,
+	jackoff_manifest_t* manifest);
+int jackoff_parse_write_buffer(const char* value, size_t* size,
+	int* threaded);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "writer.h"
+#include "metrics.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// How many blocks to write for one recording before moving on to the next,
+// so that one busy recording can't starve the others.
+#define WRITES_PER_TURN 64
+
+typedef struct {
+	jackoff_recording_t* recordings;
+	size_t count;
+	const jackoff_thread_policy_t* policy;
+	jackoff_host_t* host;
+	float idle_time;
+	jackoff_metrics_t* metrics;
+} writer_pool_t;
+
+typedef struct {
+	writer_pool_t* pool;
+	size_t index; // 1 for the calling thread, then up
+	pthread_t thread;
+} writer_t;
+
+static void* writer_thread(void* arg);
+static void write_recordings(writer_t* writer);
+static int service_recording(jackoff_recording_t* recording);
+static int switch_sample_rate(jackoff_recording_t* recording,
+	jack_nframes_t rate);
+static char* segment_path(const char* file_path, unsigned int segment);
+static void track_catch_up(jackoff_recording_t* recording,
+	jackoff_counters_t* counters);
+
+/*
+ * Drains every recording until all of them have finished or jackoff is shut
+ * down. The calling thread is one of the writers; threads - 1 more are
+ * started alongside it. Any recording can be served by any writer, but only
+ * one at a time.
+ */
+void jackoff_run_writers(jackoff_recording_t* recordings, size_t count,
+	size_t threads, const jackoff_thread_policy_t* policy,
+	jackoff_host_t* host, float idle_time, jackoff_metrics_t* metrics)
+{
+	writer_pool_t pool;
+	writer_t self;
+	writer_t* helpers = NULL;
+	pthread_attr_t attr;
+	size_t started = 0;
+	size_t i;
+	
+	pool.recordings = recordings;
+	pool.count = count;
+	pool.policy = policy;
+	pool.host = host;
+	pool.idle_time = idle_time;
+	pool.metrics = metrics;
+	
+	if (threads > 1) {
+		helpers = calloc(threads - 1, sizeof(writer_t));
+		if (!helpers)
+			jackoff_warn("Failed to allocate the writer threads.");
+	}
+	
+	// Every writer, this one included, takes up the writer policy itself;
+	// nothing else in the process runs with it.
+	jackoff_init_thread_attr(&attr);
+	for (i = 0; helpers && i < threads - 1; i++) {
+		helpers[i].pool = &pool;
+		helpers[i].index = i + 2;
+		if (pthread_create(&helpers[i].thread, &attr, writer_thread,
+			&helpers[i]) != 0)
+		{
+			jackoff_warn("Failed to start writer thread %lu.", i + 2);
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	if (started)
+		jackoff_debug("Writing with %lu threads.", started + 1);
+	
+	self.pool = &pool;
+	self.index = 1;
+	jackoff_apply_thread_policy(policy, host->jack_client, "writer");
+	write_recordings(&self);
+	
+	for (i = 0; i < started; i++)
+		pthread_join(helpers[i].thread, NULL);
+	if (helpers)
+		free(helpers);
+}
+
+/*
+ * Closes a recording's session and encoder, if they're still open.
+ */
+void jackoff_finish_recording(jackoff_recording_t* recording) {
+	if (recording->session) {
+		if (jackoff_close_session(recording->session) != 0)
+			recording->failed = 1;
+		recording->session = NULL;
+	}
+	free(recording->segment_path);
+	recording->segment_path = NULL;
+	
+	if (recording->encoder) {
+		jackoff_destroy_encoder(recording->encoder);
+		recording->encoder = NULL;
+	}
+	
+	if (recording->opened_at && !recording->closed_at)
+		recording->closed_at = jackoff_metrics_clock();
+	if (recording->client)
+		jackoff_abandon_client(recording->client);
+	recording->done = 1;
+}
+
+static void* writer_thread(void* arg) {
+	writer_t* writer = arg;
+	writer_pool_t* pool = writer->pool;
+	
+	jackoff_apply_thread_policy(pool->policy, pool->host->jack_client,
+		"writer");
+	write_recordings(writer);
+	return NULL;
+}
+
+static void write_recordings(writer_t* writer) {
+	writer_pool_t* pool = writer->pool;
+	jackoff_recording_t* recording;
+	size_t pending;
+	int progress;
+	unsigned long cycles;
+	size_t i;
+	
+	do {
+		pending = 0;
+		progress = 0;
+		cycles = jackoff_capture_cycles(pool->host);
+		
+		for (i = 0; i < pool->count; i++) {
+			recording = &pool->recordings[i];
+			if (recording->done)
+				continue;
+			pending++;
+			
+			if (!__sync_bool_compare_and_swap(&recording->claimed, 0, 1))
+				continue;
+			jackoff_thread_counters = jackoff_metrics_counters(pool->metrics,
+				writer->index, i);
+			if (!recording->done && service_recording(recording))
+				progress = 1;
+			jackoff_thread_counters = NULL;
+			__sync_lock_release(&recording->claimed);
+		}
+		
+		if (pending && !progress && pool->host->freewheeling) {
+			// There's no realtime pace to keep to: write as soon as the
+			// process callback has captured anything.
+			jackoff_wait_for_capture(pool->host, cycles, pool->idle_time);
+		} else if (pending && !progress) {
+			// Sleep for 1/4th the ring buffer duration.
+			jackoff_debug("Sleeping for %.04fs.", pool->idle_time);
+			usleep(1000000 * pool->idle_time);
+		}
+	} while (pending && jackoff_is_running());
+}
+
+/*
+ * Writes out what one recording has captured. Returns nonzero if any audio
+ * was written.
+ */
+static int service_recording(jackoff_recording_t* recording) {
+	jackoff_client_t* client = recording->client;
+	jackoff_counters_t* counters = jackoff_thread_counters;
+	uint64_t started = 0;
+	uint64_t write_time = 0;
+	uint64_t elapsed;
+	const char* name = recording->name ? recording->name : "";
+	const char* separator = recording->name ? ": " : "";
+	int progress = 0;
+	jack_nframes_t rate;
+	long result;
+	int i;
+	
+	if (client->ring_buffer_overflowed) {
+		jackoff_warn("%s%sRing buffer overflow; some audio was not written.",
+			name, separator);
+		client->ring_buffer_overflowed = 0;
+	}
+	
+	if (!client->status) {
+		jackoff_finish_recording(recording);
+		return 0;
+	}
+	
+	if (counters)
+		jackoff_count(counters, JACKOFF_METRIC_WRITER_ITERATIONS, 1);
+	
+	for (i = 0; i < WRITES_PER_TURN; i++) {
+		// A stalled write is the usual way to fall behind, so the writer
+		// looks again after each one, not just when it comes back around.
+		if (counters) {
+			track_catch_up(recording, counters);
+			started = jackoff_metrics_clock();
+			write_time = counters->values[JACKOFF_METRIC_WRITE_NSEC];
+		}
+		result = jackoff_write_session(recording->session);
+		if (counters) {
+			// Whatever wasn't spent in the output calls went to encoding.
+			// A write-behind thread's writes are counted when a writer
+			// takes them over, so they can add up to more than this call.
+			elapsed = jackoff_metrics_clock() - started;
+			write_time = counters->values[JACKOFF_METRIC_WRITE_NSEC] -
+				write_time;
+			jackoff_count(counters, JACKOFF_METRIC_ENCODE_NSEC,
+				(write_time < elapsed) ? elapsed - write_time : 0);
+		}
+		if (result > 0) {
+			progress = 1;
+			continue;
+		}
+		
+		if (result == -1) {
+			jackoff_warn("%s%sEncoding error; recording stopped.", name,
+				separator);
+			recording->failed = 1;
+			jackoff_finish_recording(recording);
+		} else if ((rate = jackoff_client_rate_switch(client)) != 0) {
+			if (switch_sample_rate(recording, rate) != 0) {
+				jackoff_warn("%s%sFailed to continue at %u Hz; recording "
+					"stopped.", name, separator, rate);
+				recording->failed = 1;
+				jackoff_finish_recording(recording);
+			}
+			progress = 1;
+		} else if (client->capture_finished &&
+			jackoff_client_frames_available(client) == 0)
+		{
+			jackoff_info("%s%sRecording finished.", name, separator);
+			jackoff_finish_recording(recording);
+		}
+		break;
+	}
+	
+	return progress;
+}
+
+/*
+ * Closes the recording's file once everything before a change of sample
+ * rate is in it, and carries on at the new rate in the next file. If the
+ * rate changed before anything was written, the file is started over.
+ */
+static int switch_sample_rate(jackoff_recording_t* recording,
+	jack_nframes_t rate)
+{
+	jackoff_client_t* client = recording->client;
+	const char* path;
+	char* next_path = NULL;
+	int result = 0;
+	
+	if (client->frames_consumed > recording->segment_start) {
+		next_path = segment_path(recording->file_path,
+			recording->segments + 2);
+		if (!next_path)
+			return -1;
+		recording->segments++;
+	}
+	
+	if (jackoff_close_session(recording->session) != 0)
+		result = -1;
+	recording->session = NULL;
+	if (next_path) {
+		free(recording->segment_path);
+		recording->segment_path = next_path;
+	}
+	recording->segment_start = client->frames_consumed;
+	
+	path = recording->segment_path ? recording->segment_path :
+		recording->file_path;
+	recording->session = jackoff_open_session(client, recording->encoder,
+		path);
+	if (!recording->session)
+		return -1;
+	
+	jackoff_info("Sample rate is now %u Hz; recording to \"%s\".", rate,
+		path);
+	return result;
+}
+
+/*
+ * Names the given file of a recording: "take.wav" continues in "take-2.wav",
+ * "take-3.wav" and so on. Standard output stays standard output.
+ */
+static char* segment_path(const char* file_path, unsigned int segment) {
+	const char* extension = strrchr(file_path, '.');
+	const char* slash = strrchr(file_path, '/');
+	size_t stem;
+	char* path;
+	
+	if (0 == strcmp(file_path, "-"))
+		return strdup(file_path);
+	if (!extension || (slash && extension < slash) || extension == file_path ||
+		extension[-1] == '/')
+		extension = file_path + strlen(file_path);
+	stem = extension - file_path;
+	
+	path = malloc(strlen(file_path) + 16);
+	if (!path) {
+		jackoff_warn("Failed to allocate memory for a file name.");
+		return NULL;
+	}
+	sprintf(path, "%.*s-%u%s", (int) stem, file_path, segment, extension);
+	return path;
+}
+
+/*
+ * Times how long the writer takes to recover once it has let the transport
+ * get more than a quarter full.
+ */
+static void track_catch_up(jackoff_recording_t* recording,
+	jackoff_counters_t* counters)
+{
+	jackoff_client_t* client = recording->client;
+	size_t available = jackoff_client_frames_available(client);
+	uint64_t now = jackoff_metrics_clock();
+	
+	if (available > client->transport_frames / 4) {
+		if (!recording->behind_since)
+			recording->behind_since = now;
+	} else if (recording->behind_since) {
+		jackoff_count_max(counters, JACKOFF_METRIC_CATCH_UP_MAX_NSEC,
+			now - recording->behind_since);
+		recording->behind_since = 0;
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * Jackoff: a simple utility to record audio from JACK.
+ * Copyright © 2009 Eric Naeseth.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef _JACKOFF_WRITER_H_
+#define _JACKOFF_WRITER_H_
+
+#include "jackoff.h"
+#include "realtime.h"
+#include "metrics.h"
+
+void jackoff_run_writers(jackoff_recording_t* recordings, size_t count,
+	size_t threads, const jackoff_thread_policy_t* policy,
+	jackoff_host_t* host, float idle_time, jackoff_metrics_t* metrics);
+void jackoff_finish_recording(jackoff_recording_t* recording);
+
+#endif